@@ -28,6 +28,57 @@ uint16_t LDRval;
  */
 volatile bool broadcast_ready;
 
+/**
+ * A reading and the mesh time it was taken at. DHT11 values are kept in tenths.
+ */
+struct sensorSample {
+    uint32_t time;
+    int16_t value[SAMPLE_CHANNELS];
+};
+
+/**
+ * The readings not broadcast yet, a ring that drops the oldest one if sending falls behind.
+ * batch_ready asks loop() to send them before the BROADCAST_INTERVAL deadline, because the ring
+ * is full or a reading just crossed its threshold. batch_alarm sends the batch with PRIORITY_HIGH.
+ * reported and last_report_ms hold the last reading stored, for report by exception.
+ */
+sensorSample samples[SAMPLE_BATCH_SIZE];
+uint8_t samples_head, samples_count;
+bool batch_ready, batch_alarm, alarm_active;
+int16_t reported[SAMPLE_CHANNELS];
+uint32_t last_report_ms;
+
+/**
+ * Readings of one sensor type merged from our subtree, see aggregateCallback().
+ * The mean is sum / count, sums are sent so aggregates merge again further up.
+ */
+struct sensorAggregate {
+    uint16_t count;         // readings merged, 0 if none this window
+    int16_t min[SAMPLE_CHANNELS];
+    int16_t max[SAMPLE_CHANNELS];
+    int32_t sum[SAMPLE_CHANNELS];
+    uint32_t nodes[AGGREGATE_MAX_NODES];
+    uint8_t nodeCount;
+};
+
+/**
+ * The aggregates of the current window, indexed by sensor type. aggregate_started is the
+ * millis() the window opened, aggregate_pending true while anything waits in it.
+ */
+sensorAggregate aggregates[SENSOR_TYPES];
+uint32_t aggregate_started;
+bool aggregate_pending;
+
+/**
+ * Position in a batch payload while its readings are decoded, see readBatch().
+ */
+struct batchReader {
+    const uint8_t *p, *end;
+    uint8_t sensor, count, channels, index;
+    uint32_t time;
+    int32_t value[SAMPLE_CHANNELS];
+};
+
 /***
  * Runs only once before the first loop().
  * Some sensors may need initialization.
@@ -42,9 +93,16 @@ void setup() {
 
     mesh.setDebugMsgTypes(ERROR | MESH_STATUS | CONNECTION);
     mesh.init(MESH_PREFIX, MESH_PASSWORD, MESH_PORT);
+    mesh.setSink(SINK_NODE);
+    if (DUTY_CYCLE_PERIOD > 0) {
+        mesh.setDutyCycle(DUTY_CYCLE_PERIOD * 1000, DUTY_CYCLE_WINDOW * 1000);
+    }
 
-    mesh.setReceiveCallback(&receivedCallback);
+    mesh.setReceiveCallback(&receivedBytesCallback);
     mesh.setNewConnectionCallback(&newConnectionCallback);
+    if (AGGREGATE_READINGS) {
+        mesh.setAggregateCallback(&aggregateCallback);
+    }
 
     vars_init();
     timers_init();
@@ -66,7 +124,7 @@ void setup() {
  * Always add a form of delay in the end (or yield) as the watchdog will bite otherwise.
  * At the end of this routine several network and scheduling background tasks are executed
  * so make sure to allow a loop() finish a few times per second. When the broadcast_ready is
- * true transmit the local sensor values.
+ * true, or the batch is ready early, transmit the stored sensor readings.
  */
 void loop() {
     switch (SENSOR_NO) {
@@ -97,9 +155,27 @@ void loop() {
             break;
     }
 
-    if (broadcast_ready) {
+    if (SENSOR_NO == 1 && !bDHTstarted) {
+        if (acquirestatus == 1) {
+            dht.reset();
+        }
+        dht.acquire();// non blocking method, getReadings() collects the result
+        bDHTstarted = true;
+    }
+
+    // a duty cycled leaf holds its sends until the next wake window, returning lets the SDK light-sleep meanwhile
+    if (mesh.timeToNextWake() > 0) {
+        return;
+    }
+
+    if (broadcast_ready || batch_ready) {
         broadcastReadings();
         broadcast_ready = false;
+        batch_ready = false;
+    }
+
+    if (aggregate_pending && millis() - aggregate_started >= AGGREGATE_WINDOW) {
+        broadcastAggregates();
     }
 }
 
@@ -125,14 +201,6 @@ void timer1_ISR() {
     Serial.println("Timer1 works");
 }
 
-/**
- * Timer task that updates the mesh
- */
-void meshUpdate_timer_task() {
-    mesh.update();
-    //Serial.println("Updating mesh...");
-}
-
 /**
  * Timer tasks that gets and stores locally the sensor readings.
  */
@@ -150,6 +218,16 @@ void vars_init() {
     gasVal = MQ135_THRESHOLD;
     LDRval = LDR_THRESHOLD;
     broadcast_ready = false;
+    samples_head = 0;
+    samples_count = 0;
+    batch_ready = false;
+    batch_alarm = false;
+    alarm_active = false;
+    reported[0] = 0;
+    reported[1] = 0;
+    last_report_ms = millis() - HEARTBEAT_INTERVAL * 1000UL;  // the first reading counts as a heartbeat
+    memset(aggregates, 0, sizeof(aggregates));
+    aggregate_pending = false;
     acquirestatus = 0;
     acquireresult = 0;
 }
@@ -158,26 +236,234 @@ void vars_init() {
  * Disarms,attaches callbacks and finally arms the timers.
  * Call this method once.In os_timer_arm if the 3rd arg is true then the task is
  * executed periodically.
+ * The mesh no longer needs a polling timer, it arms its own for the next connection deadline.
  */
 void timers_init() {
-    os_timer_disarm(&meshUpdateTimer);
     os_timer_disarm(&readingsTimer);
 
-    os_timer_setfn(&meshUpdateTimer, (os_timer_func_t *) meshUpdate_timer_task, NULL);
     os_timer_setfn(&readingsTimer, (os_timer_func_t *) getReadings_timer_task, NULL);
 
-    os_timer_arm(&meshUpdateTimer, MESH_UPDATE_INTERVAL, true);
     os_timer_arm(&readingsTimer, SENSOR_UPDATE_INTERVAL, true);
 }
 
 /**
  * Set a callback routine for any messages that are addressed to this node.
+ * Reading batches (see broadcastReadings()) and aggregates (see broadcastAggregates()) are
+ * decoded, anything else is printed as text.
  * @param from the id of the original sender of the message
- * @param msg a string that contains the message.The message can be anything.
- * A JSON, some other text string, or binary data.
+ * @param data the payload, only valid during the call.
+ * @param length the payload length.
  */
-void receivedCallback(uint32_t from, String &msg) {
-    Serial.printf("Received from %d : %s\n", from, msg.c_str());
+void receivedBytesCallback(uint32_t from, const uint8_t *data, uint16_t length) {
+    batchReader batch;
+    sensorAggregate aggregate;
+    uint8_t sensor;
+
+    if (readBatch(batch, data, length)) {
+        while (nextReading(batch)) {
+            Serial.printf("Received from %d sensor=%d t=%u : %d %d\n", from, batch.sensor, batch.time, batch.value[0], batch.value[1]);
+        }
+    } else if (readAggregate(data, length, aggregate, sensor)) {
+        for (uint8_t c = 0; c < sampleChannels(sensor); c++) {
+            Serial.printf("Aggregate from %d sensor=%d nodes=%d count=%d : min=%d max=%d mean=%d\n",
+                          from, sensor, aggregate.nodeCount, aggregate.count,
+                          aggregate.min[c], aggregate.max[c], aggregate.sum[c] / aggregate.count);
+        }
+    } else {
+        Serial.printf("Received from %d : %.*s\n", from, length, (const char *) data);
+    }
+}
+
+/**
+ * Starts decoding a batch payload, see broadcastReadings() for the layout.
+ * @return false if data is not a batch.
+ */
+bool readBatch(batchReader &batch, const uint8_t *data, uint16_t length) {
+    if (length < 3 || data[0] != SAMPLE_BATCH_MAGIC || data[1] == 0 || data[1] >= SENSOR_TYPES) {
+        return false;
+    }
+    batch.sensor = data[1];
+    batch.count = data[2];
+    batch.channels = sampleChannels(batch.sensor);
+    batch.index = 0;
+    batch.value[0] = 0;
+    batch.value[1] = 0;
+    batch.p = data + 3;
+    batch.end = data + length;
+    return getVarint(batch.p, batch.end, batch.time);
+}
+
+/**
+ * Decodes the next reading of a batch into batch.time and batch.value.
+ * @return false once all readings are read or the payload is cut short.
+ */
+bool nextReading(batchReader &batch) {
+    uint32_t step;
+    if (batch.index >= batch.count || !getVarint(batch.p, batch.end, step)) {
+        return false;
+    }
+    batch.time += step * 1000;
+    for (uint8_t c = 0; c < batch.channels; c++) {
+        uint32_t delta;
+        if (!getVarint(batch.p, batch.end, delta)) {
+            return false;
+        }
+        batch.value[c] += unzigzag(delta);
+    }
+    batch.index++;
+    return true;
+}
+
+/**
+ * Merges reading batches and aggregates arriving from our subtree, see setAggregateCallback().
+ * They wait in aggregates[] for broadcastAggregates(); on the way up the tree every relay
+ * merges them again, so the root links carry one record per sensor type and window.
+ * @return true if the broadcast was merged and must not be relayed, false for anything else.
+ */
+bool aggregateCallback(uint32_t from, const uint8_t *data, uint16_t length) {
+    batchReader batch;
+    sensorAggregate merged;
+    uint8_t sensor;
+
+    if (readBatch(batch, data, length)) {
+        sensor = batch.sensor;
+        memset(&merged, 0, sizeof(merged));
+        while (nextReading(batch)) {
+            for (uint8_t c = 0; c < batch.channels; c++) {
+                if (merged.count == 0 || batch.value[c] < merged.min[c]) {
+                    merged.min[c] = batch.value[c];
+                }
+                if (merged.count == 0 || batch.value[c] > merged.max[c]) {
+                    merged.max[c] = batch.value[c];
+                }
+                merged.sum[c] += batch.value[c];
+            }
+            merged.count++;
+        }
+        merged.nodes[0] = from;
+        merged.nodeCount = 1;
+    } else if (!readAggregate(data, length, merged, sensor)) {
+        return false;
+    }
+
+    if (merged.count == 0) {
+        return true;
+    }
+    if (!aggregate_pending) {
+        aggregate_started = millis();
+        aggregate_pending = true;
+    }
+    mergeAggregate(aggregates[sensor], merged, sampleChannels(sensor));
+    return true;
+}
+
+/**
+ * Adds the readings and contributors of from to into.
+ */
+void mergeAggregate(sensorAggregate &into, const sensorAggregate &from, uint8_t channels) {
+    for (uint8_t c = 0; c < channels; c++) {
+        if (into.count == 0 || from.min[c] < into.min[c]) {
+            into.min[c] = from.min[c];
+        }
+        if (into.count == 0 || from.max[c] > into.max[c]) {
+            into.max[c] = from.max[c];
+        }
+        into.sum[c] += from.sum[c];
+    }
+    into.count += from.count;
+
+    for (uint8_t i = 0; i < from.nodeCount; i++) {
+        bool known = false;
+        for (uint8_t j = 0; j < into.nodeCount && !known; j++) {
+            known = into.nodes[j] == from.nodes[i];
+        }
+        if (!known && into.nodeCount < AGGREGATE_MAX_NODES) {
+            into.nodes[into.nodeCount++] = from.nodes[i];
+        }
+    }
+}
+
+/**
+ * Broadcasts one record per sensor type that got readings this window and starts the next.
+ * Layout: AGGREGATE_MAGIC, sensor, node count (one byte each), the reading count as a varint,
+ * per channel min, max and sum as zigzag varints, then the chip IDs, 4 bytes little endian each.
+ */
+void broadcastAggregates() {
+    for (uint8_t sensor = 1; sensor < SENSOR_TYPES; sensor++) {
+        sensorAggregate &aggregate = aggregates[sensor];
+        if (aggregate.count == 0) {
+            continue;
+        }
+
+        uint8_t record[AGGREGATE_MAX_BYTES];
+        uint16_t length = 0;
+        record[length++] = AGGREGATE_MAGIC;
+        record[length++] = sensor;
+        record[length++] = aggregate.nodeCount;
+        length += putVarint(record + length, aggregate.count);
+        for (uint8_t c = 0; c < sampleChannels(sensor); c++) {
+            length += putVarint(record + length, zigzag(aggregate.min[c]));
+            length += putVarint(record + length, zigzag(aggregate.max[c]));
+            length += putVarint(record + length, zigzag(aggregate.sum[c]));
+        }
+        for (uint8_t i = 0; i < aggregate.nodeCount; i++) {
+            for (uint8_t b = 0; b < 4; b++) {
+                record[length++] = (aggregate.nodes[i] >> (8 * b)) & 0xFF;
+            }
+        }
+
+        publish(record, length, PRIORITY_NORMAL);
+        Serial.printf("Sent aggregate sensor=%d of %d readings from %d nodes\n", sensor, aggregate.count, aggregate.nodeCount);
+    }
+
+    memset(aggregates, 0, sizeof(aggregates));
+    aggregate_pending = false;
+}
+
+/**
+ * Decodes an aggregate written by broadcastAggregates().
+ * @return false if data is not a well formed aggregate.
+ */
+bool readAggregate(const uint8_t *data, uint16_t length, sensorAggregate &aggregate, uint8_t &sensor) {
+    if (length < 3 || data[0] != AGGREGATE_MAGIC || data[1] == 0 || data[1] >= SENSOR_TYPES ||
+        data[2] > AGGREGATE_MAX_NODES) {
+        return false;
+    }
+
+    const uint8_t *p = data + 3;
+    const uint8_t *end = data + length;
+    uint32_t v;
+    memset(&aggregate, 0, sizeof(aggregate));
+    sensor = data[1];
+
+    if (!getVarint(p, end, v) || v == 0) {
+        return false;
+    }
+    aggregate.count = v;
+    for (uint8_t c = 0; c < sampleChannels(sensor); c++) {
+        if (!getVarint(p, end, v)) {
+            return false;
+        }
+        aggregate.min[c] = unzigzag(v);
+        if (!getVarint(p, end, v)) {
+            return false;
+        }
+        aggregate.max[c] = unzigzag(v);
+        if (!getVarint(p, end, v)) {
+            return false;
+        }
+        aggregate.sum[c] = unzigzag(v);
+    }
+
+    if (end - p < 4 * data[2]) {
+        return false;
+    }
+    for (uint8_t i = 0; i < data[2]; i++) {
+        aggregate.nodes[i] = p[0] | (p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+        p += 4;
+    }
+    aggregate.nodeCount = data[2];
+    return true;
 }
 
 /**
@@ -192,42 +478,171 @@ void newConnectionCallback(bool adopt) {
 }
 
 /**
- * Broadcasts the existing values of the sensor(s) produced by getReadings().
- * Uses interrupts so DO NOT call inside an ISR, instead use getReadings to obtain
- * the values and then publish the results with this method.
- * case1 -> DHT11
- * case2 -> Photoresistor
- * case3 -> MQ135
+ * Publishes the readings stored by getReadings() as one binary batch and empties the ring.
+ * Do not call inside an ISR, the mesh sends from here.
+ * A batch holding a reading past its alarm threshold goes out with PRIORITY_HIGH, so it
+ * overtakes routine readings queued anywhere on its way.
+ * Layout, every number a varint:
+ *   SAMPLE_BATCH_MAGIC, SENSOR_NO, count (one byte each), mesh time of the first reading in us,
+ *   then per reading: ms since the previous one, and per channel the zigzag coded change.
  */
 void broadcastReadings() {
-    String msg;
+    if (samples_count == 0) {
+        return;
+    }
+
+    uint8_t batch[SAMPLE_BATCH_MAX_BYTES];
+    uint16_t length = 0;
+    uint8_t channels = sampleChannels(SENSOR_NO);
+    uint8_t first = (samples_head + SAMPLE_BATCH_SIZE - samples_count) % SAMPLE_BATCH_SIZE;
+    uint32_t base = samples[first].time;
+    uint32_t lastMs = 0;
+    int16_t last[SAMPLE_CHANNELS] = {0};
+
+    batch[length++] = SAMPLE_BATCH_MAGIC;
+    batch[length++] = SENSOR_NO;
+    batch[length++] = samples_count;
+    length += putVarint(batch + length, base);
+
+    for (uint8_t i = 0; i < samples_count; i++) {
+        sensorSample &sample = samples[(first + i) % SAMPLE_BATCH_SIZE];
+        uint32_t ms = (sample.time - base) / 1000;
+        length += putVarint(batch + length, ms - lastMs);
+        lastMs = ms;
+        for (uint8_t c = 0; c < channels; c++) {
+            length += putVarint(batch + length, zigzag(sample.value[c] - last[c]));
+            last[c] = sample.value[c];
+        }
+    }
+
+    publish(batch, length, batch_alarm ? PRIORITY_HIGH : PRIORITY_NORMAL);
+    Serial.printf("Sent %d readings in %d bytes\n", samples_count, length);
+    samples_count = 0;
+    batch_alarm = false;
+}
+
+/**
+ * Sends a payload to the sink if the mesh has one, broadcasts it otherwise.
+ */
+void publish(const uint8_t *data, uint16_t length, meshPriorityType priority) {
+    if (mesh.sendToSink(data, length, priority) == SEND_NO_ROUTE) {
+        mesh.sendBroadcast(data, length, priority);
+    }
+}
+
+/**
+ * Stores a reading in the ring, stamped with the mesh time, unless report by exception skips it.
+ * Asks for an early broadcast once the ring is full or when the reading just crossed its threshold.
+ * @param v0 the first value.
+ * @param v1 the second value, 0 for single value sensors.
+ * @param alarm true if the reading is past its threshold.
+ */
+void storeSample(int16_t v0, int16_t v1, bool alarm) {
+    if (REPORT_BY_EXCEPTION && !worthReporting(v0, v1, alarm)) {
+        return;
+    }
+    reported[0] = v0;
+    reported[1] = v1;
+    last_report_ms = millis();
+
+    sensorSample &sample = samples[samples_head];
+    sample.time = mesh.getNodeTime();
+    sample.value[0] = v0;
+    sample.value[1] = v1;
+    samples_head = (samples_head + 1) % SAMPLE_BATCH_SIZE;
+    if (samples_count < SAMPLE_BATCH_SIZE) {
+        samples_count++;
+    }
+
+    batch_alarm = batch_alarm || alarm;
+    if (samples_count == SAMPLE_BATCH_SIZE || (alarm && !alarm_active)) {
+        batch_ready = true;
+    }
+    alarm_active = alarm;
+}
+
+/**
+ * True if a reading has to be reported: it crossed the threshold, moved by a deadband since
+ * the last reported one, or the heartbeat is due.
+ */
+bool worthReporting(int16_t v0, int16_t v1, bool alarm) {
+    if (alarm != alarm_active || millis() - last_report_ms >= HEARTBEAT_INTERVAL * 1000UL) {
+        return true;
+    }
+
+    int16_t value[SAMPLE_CHANNELS] = {v0, v1};
+    for (uint8_t c = 0; c < sampleChannels(SENSOR_NO); c++) {
+        if (abs(value[c] - reported[c]) >= sampleDeadband(c)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Smallest change of a value worth reporting, in the units storeSample() gets.
+ */
+int sampleDeadband(uint8_t channel) {
     switch (SENSOR_NO) {
         case 1:
-            msg = "C:" + String(DHT_temperature) + "  H:" + String(DHT_humidity);
-            if (acquirestatus == 1) {
-                dht.reset();
-            }
-            if (!bDHTstarted) {
-                dht.acquire();// non blocking method
-                bDHTstarted = true;
-            }
-            break;
+            return channel == 0 ? DHT11_TEMPERATURE_DEADBAND : DHT11_HUMIDITY_DEADBAND;
         case 2:
-            msg = "LDR: " + String(LDRval);
-            break;
-        case 3:
-            msg = "Gas PPM: " + String(gasVal);
-            break;
+            return LDR_DEADBAND;
         default:
-            //Relay node, no sensors on board.
-            return;
+            return MQ135_DEADBAND;
     }
-    mesh.sendBroadcast(msg);
-    Serial.println(msg);
 }
 
 /**
- * This method SAVES locally the sensor results.
+ * Number of values one reading of the given sensor has.
+ */
+uint8_t sampleChannels(uint8_t sensor) {
+    return sensor == 1 ? 2 : 1;
+}
+
+/**
+ * Writes v as a varint, 7 bits per byte with the high bit set on all but the last.
+ * @return the number of bytes written, at most SAMPLE_VARINT_MAX.
+ */
+uint8_t putVarint(uint8_t *p, uint32_t v) {
+    uint8_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (v & 0x7F) | 0x80;
+        v >>= 7;
+    }
+    p[n++] = v;
+    return n;
+}
+
+/**
+ * Reads a varint written by putVarint() and advances p past it.
+ * @return false if the varint runs past end.
+ */
+bool getVarint(const uint8_t *&p, const uint8_t *end, uint32_t &v) {
+    v = 0;
+    for (uint8_t shift = 0; p < end && shift < 7 * SAMPLE_VARINT_MAX; shift += 7) {
+        uint8_t b = *p++;
+        v |= (uint32_t) (b & 0x7F) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Maps small signed changes to small unsigned numbers: 0, -1, 1, -2 ... become 0, 1, 2, 3 ...
+ */
+uint32_t zigzag(int32_t v) {
+    return ((uint32_t) v << 1) ^ (uint32_t) (v >> 31);
+}
+
+int32_t unzigzag(uint32_t v) {
+    return (int32_t) (v >> 1) ^ -(int32_t) (v & 1);
+}
+
+/**
+ * This method SAVES locally the sensor results, every reading goes into the batch.
  * Very-fast routine without interrupts, can be called by an ISR.
  * case1 -> DHT11
  * case2 -> Photoresistor
@@ -243,6 +658,8 @@ void getReadings() {
                     if (acquireresult == 0) {
                         DHT_temperature = dht.getCelsius();
                         DHT_humidity = dht.getHumidity();
+                        storeSample(DHT_temperature * 10, DHT_humidity * 10,
+                                    DHT_temperature >= DHT11_TEMPERATURE_THRESHOLD);
                     }
                     bDHTstarted = false;
                 }
@@ -250,9 +667,11 @@ void getReadings() {
             break;
         case 2:
             LDRval = analogRead(ANALOGPIN);
+            storeSample(LDRval, 0, LDRval < LDR_THRESHOLD);
             break;
         case 3:
             gasVal = analogRead(ANALOGPIN);
+            storeSample(gasVal, 0, gasVal > MQ135_THRESHOLD);
             break;
         default:
             //Relay node.
@@ -2,24 +2,40 @@
 #include <ArduinoJson.h>
 #include <SimpleList.h>
 
-extern "C" {
-#include "user_interface.h"
-#include "espconn.h"
-}
+#include "easyMeshPlatform.h"
 
 #include "easyMesh.h"
 
-static void (*receivedCallback)( uint32_t from, String &msg);
-static void (*newConnectionCallback)( bool adopt );
-
-extern easyMesh* staticThis;
 
 /**
  * Set a callback routine for any messages that are addressed to this node.
  */
 void ICACHE_FLASH_ATTR easyMesh::setReceiveCallback( void(*onReceive)(uint32_t from, String &msg) ) {
     debugMsg( GENERAL, "setReceiveCallback():\n");
-    receivedCallback = onReceive;
+    _receivedCallback = onReceive;
+}
+
+/**
+ * Set a callback that gets the payload of messages addressed to this node as bytes.
+ * data points into the receive buffer and is only valid during the call, copy what you keep.
+ * Both callbacks can be set; a binary payload is only turned into a String for the other one.
+ */
+void ICACHE_FLASH_ATTR easyMesh::setReceiveCallback( void(*onReceive)(uint32_t from, const uint8_t *data, uint16_t length) ) {
+    debugMsg( GENERAL, "setReceiveCallback(bytes):\n");
+    _receivedBytesCallback = onReceive;
+}
+
+/**
+ * Set a callback that may absorb packages from our subtree instead of relaying them, so a
+ * relay can merge the readings of its children and send one aggregate in their place.
+ * It gets every BROADCAST arriving from a child before it is relayed, and every SINGLE a child
+ * sends on towards a sink, see sendToSink(); urgent ones are always relayed.
+ * Returning true absorbs it: it is neither relayed nor passed to the receive callback.
+ * data is only valid during the call.
+ */
+void ICACHE_FLASH_ATTR easyMesh::setAggregateCallback( bool(*onAggregate)(uint32_t from, const uint8_t *data, uint16_t length) ) {
+    debugMsg( GENERAL, "setAggregateCallback():\n");
+    _aggregateCallback = onAggregate;
 }
 
 /**
@@ -29,112 +45,269 @@ void ICACHE_FLASH_ATTR easyMesh::setReceiveCallback( void(*onReceive)(uint32_t f
  */
 void ICACHE_FLASH_ATTR easyMesh::setNewConnectionCallback( void(*onNewConnection)(bool adopt) ) {
     debugMsg( GENERAL, "setNewConnectionCallback():\n");
-    newConnectionCallback = onNewConnection;
+    _newConnectionCallback = onNewConnection;
 }
 
 /**
- * Drops the connection between us and the other node.
+ * Drops the connection between us and the other node. The others hear of it through a
+ * nodeSync; keepalives no longer carry the subs, so without one they would route to the
+ * lost subtree until something else changes.
  */
-meshConnectionType* ICACHE_FLASH_ATTR easyMesh::closeConnection( meshConnectionType *conn ) {
+meshConnectionList::iterator ICACHE_FLASH_ATTR easyMesh::closeConnection( meshConnectionType *conn ) {
     debugMsg( CONNECTION, "closeConnection(): conn-chipId=%d\n", conn->chipId );
+    removeTopology( conn->chipId );
+    conn->sendQueue.end();
+    conn->recvBuffer.end();
+    conn->esp_conn->reverse = NULL;  // callbacks still to come for it find no connection
     espconn_disconnect( conn->esp_conn );
-    return _connections.erase( conn );
+    meshConnectionList::iterator next = _connections.erase( conn );
+    markStaleConnections( NULL );
+    updateBeacon();  // hop or child count changed
+    return next;
+}
+
+/**
+ * True once nodeTime has reached deadline, also across a wrap of the 32 bit clock.
+ */
+static inline bool timeReached( uint32_t nodeTime, uint32_t deadline ) {
+    return (int32_t)( nodeTime - deadline ) >= 0;
 }
 
 /**
  * Maintenance routine. Checks (and enforces) node timeouts and other connection statuses.
  * For example if a connection`s status has been marked as closed or needs sync then
  * this routine executes the required action.
+ * Only connections whose nextCheck has passed are looked at; the timer is then armed for
+ * the earliest deadline left, so nothing runs in between. All times are compared with
+ * timeReached(), which stays correct when the 32 bit node time wraps.
  */
 void ICACHE_FLASH_ATTR easyMesh::manageConnections( void ) {
     debugMsg( GENERAL, "manageConnections():\n");
-    SimpleList<meshConnectionType>::iterator connection = _connections.begin();
+    meshCycleTimer cycles( _stats.manageCycles );
+    uint32_t nodeTime = getNodeTime();
+    uint32_t next = nodeTime + CLOCK_WRAP_GUARD;  // wake at least this often so getNodeTime64() sees every wrap
+
+    meshConnectionList::iterator connection = _connections.begin();
     while ( connection != _connections.end() ) {
-        if ( connection->lastRecieved + NODE_TIMEOUT < getNodeTime() ) {
-            debugMsg( CONNECTION, "manageConnections(): dropping %d NODE_TIMEOUT last=%u node=%u\n", connection->chipId, connection->lastRecieved, getNodeTime() );
+        if ( timeReached( nodeTime, connection->nextCheck ) ) {
+            if ( timeReached( nodeTime, connection->lastRecieved + linkTimeout( connection ) + 1 ) ) {
+                debugMsg( CONNECTION, "manageConnections(): dropping %d NODE_TIMEOUT last=%u node=%u\n", connection->chipId, connection->lastRecieved, nodeTime );
 
-            connection = closeConnection( connection );
-            continue;
-        }
+                _stats.timeoutDrops++;
+                connection = closeConnection( connection );
+                continue;
+            }
 
-        if( connection->esp_conn->state == ESPCONN_CLOSE ) {
-            debugMsg( CONNECTION, "manageConnections(): dropping %d ESPCONN_CLOSE\n",connection->chipId);
-            connection = closeConnection( connection );
-            continue;
-        }
+            if( connection->esp_conn->state == ESPCONN_CLOSE ) {
+                debugMsg( CONNECTION, "manageConnections(): dropping %d ESPCONN_CLOSE\n",connection->chipId);
+                connection = closeConnection( connection );
+                continue;
+            }
 
-        switch ( connection->nodeSyncStatus ) {
-            case NEEDED:           // start a nodeSync
-                debugMsg( SYNC, "manageConnections(): start nodeSync with %d\n", connection->chipId);
-                startNodeSync( connection );
-                connection->nodeSyncStatus = IN_PROGRESS;
+            if ( connection->sendReady && !connection->sendQueue.empty() )
+                sendQueued( connection );  // a wake window opened on a duty cycled link
 
-            case IN_PROGRESS:
-                connection++;
-                continue;
+            manageConnection( connection, nodeTime );
+            connection->nextCheck = connectionDeadline( connection, nodeTime );
         }
 
-        switch ( connection->timeSyncStatus ) {
-            case NEEDED:
-                debugMsg( SYNC, "manageConnections(): starting timeSync with %d\n", connection->chipId);
-                startTimeSync( connection );
-                connection->timeSyncStatus = IN_PROGRESS;
+        if ( !timeReached( connection->nextCheck, next ) )
+            next = connection->nextCheck;
+        connection++;
+    }
 
-            case IN_PROGRESS:
-                connection++;
-                continue;
-        }
+    scheduleUpdate( next );
+}
 
-        if ( connection->newConnection == true ) {  // we should only get here once first nodeSync and timeSync are complete
-            newConnectionCallback( adoptionCalc( connection ) );
-            connection->newConnection = false;
+/**
+ * Moves one connection on through nodeSync, timeSync and the new connection callback.
+ * @param conn The connection, known to be alive.
+ * @param nodeTime The time of this update pass.
+ */
+void ICACHE_FLASH_ATTR easyMesh::manageConnection( meshConnectionType *conn, uint32_t nodeTime ) {
+    switch ( conn->nodeSyncStatus ) {
+        case NEEDED:           // start a nodeSync
+            debugMsg( SYNC, "manageConnections(): start nodeSync with %d\n", conn->chipId);
+            startNodeSync( conn );
+            conn->nodeSyncStatus = IN_PROGRESS;
+
+        case IN_PROGRESS:
+            return;
+    }
 
-            connection++;
-            continue;
-        }
+    // TIME_SYNC stamps and PINGs measure the link, one held until the next wake window would
+    // count the wait as delay, so they only start while the sleeping end is awake
+    bool dozing = linkDozing( conn, nodeTime );
+
+    switch ( conn->timeSyncStatus ) {
+        case NEEDED:
+            if ( dozing )
+                return;
+            debugMsg( SYNC, "manageConnections(): starting timeSync with %d\n", conn->chipId);
+            startTimeSync( conn );
+            conn->timeSyncStatus = IN_PROGRESS;
+
+        case IN_PROGRESS:
+            if ( dozing )
+                postponeTimeSync( conn );  // the window closed before an answer came, see handleTimeSync()
+            return;
+    }
 
-        // check to see if we've recieved something lately.  Else, flag for new sync.
-        // Stagger AP and STA so that they don't try to start a sync at the same time.
-        uint32_t nodeTime = getNodeTime();
-        if ( connection->nodeSyncRequest == 0 ) { // nodeSync not in progress
-            if (    (connection->esp_conn->proto.tcp->local_port == _meshPort  // we are AP
-                     &&
-                     connection->lastRecieved + ( NODE_TIMEOUT / 2 ) < nodeTime )
-                ||
-                    (connection->esp_conn->proto.tcp->local_port != _meshPort  // we are the STA
-                     &&
-                     connection->lastRecieved + ( NODE_TIMEOUT * 3 / 4 ) < nodeTime )
-                ) {
-                connection->nodeSyncStatus = NEEDED;
-            }
+    if ( conn->newConnection == true ) {  // we should only get here once first nodeSync and timeSync are complete
+        if ( _newConnectionCallback != NULL )
+            _newConnectionCallback( adoptionCalc( conn ) );
+        conn->newConnection = false;
+        return;
+    }
+
+    // the side that adopted the time resyncs as often as its measured drift asks for
+    if ( conn->time.adopt && !dozing && timeReached( nodeTime, conn->lastTimeSync + conn->time.interval ) ) {
+        debugMsg( SYNC, "manageConnections(): timeSync with %d due\n", conn->chipId);
+        startTimeSync( conn );
+        return;
+    }
+
+    // check to see if we've recieved something lately.  Else, PING it, or flag for new sync if it can't answer.
+    // Stagger AP and STA so that they don't try to start a sync at the same time.
+    if ( conn->nodeSyncRequest == 0 && conn->pingSent == 0 ) { // nodeSync or PING not in progress
+        if (    (conn->esp_conn->proto.tcp->local_port == _meshPort  // we are AP
+                 &&
+                 timeReached( nodeTime, conn->lastRecieved + ( linkTimeout( conn ) / 2 ) + 1 ) )
+            ||
+                (conn->esp_conn->proto.tcp->local_port != _meshPort  // we are the STA
+                 &&
+                 timeReached( nodeTime, conn->lastRecieved + ( linkTimeout( conn ) * 3 / 4 ) + 1 ) )
+            ) {
+            if ( !conn->keepalive )
+                conn->nodeSyncStatus = NEEDED;
+            else if ( !dozing )
+                sendPing( conn );
         }
-        connection++;
     }
 }
 
 /**
- * Cycles through the available connections and selects a valid one.
- * @param chipId The unique chip id of an esp8266. Its connections will be cycled through.
+ * Sends a few byte keepalive on an idle link. The PONG refreshes lastRecieved on our side,
+ * the PING does so on theirs, and the round trip is kept in the connection stats.
  */
-meshConnectionType* ICACHE_FLASH_ATTR easyMesh::findConnection( uint32_t chipId ) {
-    debugMsg( GENERAL, "In findConnection(chipId)\n");
+void ICACHE_FLASH_ATTR easyMesh::sendPing( meshConnectionType *conn ) {
+    conn->pingSent = system_get_time();
+    if ( conn->pingSent == 0 )
+        conn->pingSent = 1;
+
+    debugMsg( CONNECTION, "sendPing(): to %u\n", conn->chipId );
+    String msg( conn->pingSent );
+    sendMessage( conn, conn->chipId, PING, msg );
+}
 
-    SimpleList<meshConnectionType>::iterator connection = _connections.begin();
-    while ( connection != _connections.end() ) {
+/**
+ * Works out the link round trip from the time stamp our PING carried.
+ */
+void ICACHE_FLASH_ATTR easyMesh::handlePong( meshConnectionType *conn, String &msg ) {
+    uint32_t sent = strtoul( msg.c_str(), NULL, 10 );
+    if ( sent == conn->pingSent )
+        conn->stats.rtt = system_get_time() - sent;
+    conn->pingSent = 0;
+    debugMsg( CONNECTION, "handlePong(): from %u rtt=%uus\n", conn->chipId, conn->stats.rtt );
+}
 
-        if ( connection->chipId == chipId ) {  // check direct connections
-            debugMsg( GENERAL, "findConnection(chipId): Found Direct Connection\n");
-            return connection;
-        }
+/**
+ * Works out when manageConnection() has something to do for a connection, unless an event
+ * (a sync package, a disconnect) calls scheduleConnection() sooner.
+ * @param conn The connection.
+ * @param nodeTime The time of this update pass.
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::connectionDeadline( meshConnectionType *conn, uint32_t nodeTime ) {
+    if ( conn->nodeSyncStatus == NEEDED )
+        return nodeTime;
+    if ( conn->timeSyncStatus == NEEDED )
+        return linkWake( conn, nodeTime );  // see manageConnection(), it waits for a wake window
+
+    bool synced = conn->nodeSyncStatus == COMPLETE && conn->timeSyncStatus == COMPLETE;
+    if ( synced && conn->newConnection )
+        return nodeTime;
+
+    uint32_t timeout = linkTimeout( conn );
+    uint32_t deadline = conn->lastRecieved + timeout + 1;  // first moment the timeout test fires
+    if ( synced && conn->nodeSyncRequest == 0 && conn->pingSent == 0 ) {
+        uint32_t reSync = conn->lastRecieved + 1 +
+                ( conn->esp_conn->proto.tcp->local_port == _meshPort ? timeout / 2 : timeout * 3 / 4 );
+        reSync = linkWake( conn, reSync );
+        if ( !timeReached( reSync, deadline ) )
+            deadline = reSync;
+    }
+    if ( synced && conn->time.adopt ) {
+        uint32_t reTime = linkWake( conn, conn->lastTimeSync + conn->time.interval );
+        if ( !timeReached( reTime, deadline ) )
+            deadline = reTime;
+    }
+    if ( conn->timeSyncStatus == IN_PROGRESS && conn->dutyPeriod != 0 ) {  // an exchange does not outlast the wake window
+        uint32_t sleep = linkSleep( conn, nodeTime );
+        if ( !timeReached( sleep, deadline ) )
+            deadline = sleep;
+    }
+    if ( conn->sendReady && !conn->sendQueue.empty() ) {  // held for the next wake window
+        uint32_t wake = linkWake( conn, nodeTime );
+        if ( !timeReached( wake, deadline ) )
+            deadline = wake;
+    }
+    return deadline;
+}
 
-        String chipIdStr(chipId);
-        if ( connection->subConnections.indexOf(chipIdStr) != -1 ) { // check sub-connections
-            debugMsg( GENERAL, "findConnection(chipId): Found Sub Connection\n");
-            return connection;
-        }
+/**
+ * Makes the next update pass look at conn, as soon as possible.
+ * Called wherever a connection's sync state changes outside manageConnections().
+ */
+void ICACHE_FLASH_ATTR easyMesh::scheduleConnection( meshConnectionType *conn ) {
+    conn->nextCheck = getNodeTime();
+    scheduleUpdate( conn->nextCheck );
+}
 
-        connection++;
+/**
+ * Arms the update timer for nodeTime, unless it is already armed for something earlier.
+ * @param nodeTime When update() has to run, in node time.
+ */
+void ICACHE_FLASH_ATTR easyMesh::scheduleUpdate( uint32_t nodeTime ) {
+    if ( _updateArmed && timeReached( nodeTime, _nextUpdate ) )
+        return;
+
+    int32_t delay = (int32_t)( nodeTime - getNodeTime() );
+    uint32_t delayMs = delay > 0 ? ( delay + 999 ) / 1000 : 1;  // os_timer has ms resolution
+
+    os_timer_disarm( &_updateTimer );
+    os_timer_arm( &_updateTimer, delayMs, 0 );
+    _nextUpdate = nodeTime;
+    _updateArmed = true;
+}
+
+/**
+ * Runs the update pass when the earliest deadline expires.
+ */
+void ICACHE_FLASH_ATTR easyMesh::updateTimerCallback( void *arg ) {
+    easyMesh *mesh = (easyMesh *)arg;
+    mesh->_updateArmed = false;
+    mesh->update();
+}
+
+/**
+ * Returns the direct connection that leads to a node, using the routing table.
+ * @param chipId The unique chip id of the node we want to reach.
+ */
+meshConnectionType* ICACHE_FLASH_ATTR easyMesh::findConnection( uint32_t chipId ) {
+    debugMsg( GENERAL, "In findConnection(chipId)\n");
+
+    meshRouteType *route = findRoute( chipId );
+    if ( route != NULL ) {
+        meshConnectionList::iterator connection = _connections.begin();
+        while ( connection != _connections.end() ) {
+            if ( connection->chipId == route->nextHop ) {
+                debugMsg( GENERAL, "findConnection(chipId): Found route, hops=%d\n", route->hops);
+                return connection;
+            }
+            connection++;
+        }
     }
+
     debugMsg( CONNECTION, "findConnection(%d): did not find connection\n", chipId );
     return NULL;
 }
@@ -146,76 +319,95 @@ meshConnectionType* ICACHE_FLASH_ATTR easyMesh::findConnection( uint32_t chipId
 meshConnectionType* ICACHE_FLASH_ATTR easyMesh::findConnection( espconn *conn ) {
     debugMsg( GENERAL, "In findConnection(esp_conn) conn=0x%x\n", conn );
 
-    int i=0;
-
-    SimpleList<meshConnectionType>::iterator connection = _connections.begin();
-    while ( connection != _connections.end() ) {
-        if ( connection->esp_conn == conn ) {
-            return connection;
-        }
-        connection++;
-    }
+    meshConnectionType *connection = connectionFor( conn );
+    if ( connection != NULL && connection->mesh == this )
+        return connection;
 
     debugMsg( CONNECTION, "findConnection(espconn): Did not Find\n");
     return NULL;
 }
 
+/**
+ * Returns the connection an espconn belongs to, in O(1) through its reverse field.
+ * Only for espconns that went through meshConnectedCb(), NULL once the connection is closed.
+ */
+meshConnectionType* ICACHE_FLASH_ATTR easyMesh::connectionFor( espconn *conn ) {
+    meshConnectionType *connection = (meshConnectionType *)conn->reverse;
+    if ( connection == NULL || connection->esp_conn != conn )
+        return NULL;
+    return connection;
+}
+
+/**
+ * Returns the mesh an espconn without a connection belongs to: a station connection we
+ * opened, or one accepted on a mesh port. Meshes sharing a port, as in a host simulator,
+ * are told apart by the AP address the connection came in on.
+ */
+easyMesh* ICACHE_FLASH_ATTR easyMesh::meshFor( espconn *conn ) {
+    easyMesh *portMatch = NULL;
+    for ( uint8_t i = 0; i < MESH_MAX_INSTANCES; i++ ) {
+        easyMesh *mesh = _instances[i];
+        if ( mesh == NULL )
+            continue;
+        if ( conn == &mesh->_stationConn )
+            return mesh;
+        if ( conn->proto.tcp->local_port == mesh->_meshPort ) {
+            if ( mesh->onApSubnet( conn->proto.tcp->local_ip ) )
+                return mesh;
+            if ( portMatch == NULL )
+                portMatch = mesh;
+        }
+    }
+    return portMatch;
+}
+
 
 /**
-* Returns a JSON Array of all subconnections.
+* Writes a JSON Array of all subconnections, built from the topology pool.
 * @param exlude The subconnections of this connection will not be included in the JSON array.
+* @param out Receives the array, see meshJsonWriter::overflow() for whether it fit.
 */
-String ICACHE_FLASH_ATTR easyMesh::subConnectionJson( meshConnectionType *exclude ) {
+void ICACHE_FLASH_ATTR easyMesh::subConnectionJson( meshConnectionType *exclude, meshJsonWriter &out ) {
     debugMsg( GENERAL, "subConnectionJson(), exclude=%d\n", exclude->chipId );
 
-    DynamicJsonBuffer jsonBuffer( JSON_BUFSIZE );
-    JsonArray& subArray = jsonBuffer.createArray();
-    if ( !subArray.success() )
-        debugMsg( ERROR, "subConnectionJson(): ran out of memory 1");
+    out.append( "[" );
+    bool first = true;
 
-    SimpleList<meshConnectionType>::iterator sub = _connections.begin();
+    meshConnectionList::iterator sub = _connections.begin();
     while ( sub != _connections.end() ) {
         if ( sub != exclude && sub->chipId != 0 ) {  //exclude connection that we are working with & anything too new.
-            JsonObject& subObj = jsonBuffer.createObject();
-            if ( !subObj.success() )
-                debugMsg( ERROR, "subConnectionJson(): ran out of memory 2");
-
-            subObj["chipId"] = sub->chipId;
-
-            if ( sub->subConnections.length() != 0 ) {
-                //debugMsg( GENERAL, "subConnectionJson(): sub->subConnections=%s\n", sub->subConnections.c_str() );
-
-                JsonArray& subs = jsonBuffer.parseArray( sub->subConnections );
-                if ( !subs.success() )
-                    debugMsg( ERROR, "subConnectionJson(): ran out of memory 3");
-
-                subObj["subs"] = subs;
-            }
-
-            if ( !subArray.add( subObj ) )
-                debugMsg( ERROR, "subConnectionJson(): ran out of memory 4");
+            if ( !first )
+                out.append( "," );
+            first = false;
+
+            out.append( "{\"chipId\":" );
+            out.append( sub->chipId );
+            if ( sub->sink )
+                out.append( ",\"sink\":1" );
+            out.append( ",\"subs\":[" );
+            uint8_t root = findTopologyRoot( sub->chipId );
+            if ( root != TOPOLOGY_ROOT )
+                appendSubTopology( out, root );
+            out.append( "]}" );
         }
         sub++;
     }
-
-    String ret;
-    subArray.printTo( ret );
-    debugMsg( GENERAL, "subConnectionJson(): ret=%s\n", ret.c_str());
-    return ret;
+    out.append( "]" );
 }
 
 
 /**
  * Returns the number of active connections in the mesh network.
+ * Reads the per connection counts kept by updateTopology(), so it is cheap to call often.
  * @param exclude The type of connections to exclude from this count.
  */
 uint16_t ICACHE_FLASH_ATTR easyMesh::connectionCount( meshConnectionType *exclude ) {
     uint16_t count = 0;
 
-    SimpleList<meshConnectionType>::iterator sub = _connections.begin();
+    meshConnectionList::iterator sub = _connections.begin();
     while ( sub != _connections.end() ) {
         if ( sub != exclude ) {  //exclude this connection in the calc.
-            count += ( 1 + jsonSubConnCount( sub->subConnections ) );
+            count += ( 1 + sub->subCount );
         }
         sub++;
     }
@@ -224,161 +416,466 @@ uint16_t ICACHE_FLASH_ATTR easyMesh::connectionCount( meshConnectionType *exclud
     return count;
 }
 
-
-/**
-* Returns the number of active subconnections.
-* @param The JSON array with the subs.
-*/
-uint16_t ICACHE_FLASH_ATTR easyMesh::jsonSubConnCount( String& subConns ) {
-    debugMsg( GENERAL, "jsonSubConnCount(): subConns=%s\n", subConns.c_str() );
-
-    uint16_t count = 0;
-
-    if ( subConns.length() < 3 )
-        return 0;
-
-    DynamicJsonBuffer jsonBuffer( JSON_BUFSIZE );
-    JsonArray& subArray = jsonBuffer.parseArray( subConns );
-
-    if ( !subArray.success() ) {
-        debugMsg( ERROR, "subConnCount(): out of memory1\n");
-    }
-
-    String str;
-    for ( uint8_t i = 0; i < subArray.size(); i++ ) {
-        str = subArray.get<String>(i);
-        debugMsg( GENERAL, "jsonSubConnCount(): str=%s\n", str.c_str() );
-        JsonObject& obj = jsonBuffer.parseObject( str );
-        if ( !obj.success() ) {
-            debugMsg( ERROR, "subConnCount(): out of memory2\n");
-        }
-
-        str = obj.get<String>("subs");
-        count += ( 1 + jsonSubConnCount( str ) );
-    }
-
-    debugMsg( CONNECTION, "jsonSubConnCount(): leaving count=%d\n", count );
-
-    return count;
-}
-
 /**
  * This control block is sent by a new connection in the network.
  * All the neccessary control blocks are attached here (recv,sent,recon...). 
  * @param arg The new connection,a meshConnectionType obj.
  */
 void ICACHE_FLASH_ATTR easyMesh::meshConnectedCb(void *arg) {
-    staticThis->debugMsg( CONNECTION, "meshConnectedCb(): new meshConnection !!!\n");
-    meshConnectionType newConn;
-    newConn.esp_conn = (espconn *)arg;
-    espconn_set_opt( newConn.esp_conn, ESPCONN_NODELAY );  // removes nagle, low latency, but soaks up bandwidth
-    newConn.lastRecieved = staticThis->getNodeTime();
+    debugMsg( CONNECTION, "meshConnectedCb(): new meshConnection !!!\n");
+    easyMesh *mesh = meshFor( (espconn *)arg );
+    if ( mesh == NULL ) {
+        debugMsg( ERROR, "meshConnectedCb(): no mesh for this connection, local_port=%d\n", ((espconn *)arg)->proto.tcp->local_port );
+        return;
+    }
 
-    espconn_regist_recvcb(newConn.esp_conn, meshRecvCb);
-    espconn_regist_sentcb(newConn.esp_conn, meshSentCb);
-    espconn_regist_reconcb(newConn.esp_conn, meshReconCb);
-    espconn_regist_disconcb(newConn.esp_conn, meshDisconCb);
+    meshConnectionType *newConn = mesh->_connections.allocate();
+    if ( newConn == NULL ) {
+        debugMsg( ERROR, "meshConnectedCb(): all %d connection slots taken, refusing\n", MAX_CONNECTIONS );
+        espconn_disconnect( (espconn *)arg );
+        return;
+    }
 
-    staticThis->_connections.push_back( newConn );
+    if ( !newConn->sendQueue.begin( mesh->_sendQueueSize ) ||
+         !newConn->recvBuffer.begin( RECV_BUFFER_SIZE ) ) {
+        debugMsg( ERROR, "meshConnectedCb(): out of memory for the connection buffers, refusing\n");
+        newConn->sendQueue.end();
+        newConn->recvBuffer.end();
+        mesh->_connections.erase( newConn );
+        espconn_disconnect( (espconn *)arg );
+        return;
+    }
 
-    if( newConn.esp_conn->proto.tcp->local_port != staticThis->_meshPort ) { // we are the station, start nodeSync
-        staticThis->debugMsg( CONNECTION, "meshConnectedCb(): we are STA, start nodeSync\n");
-        staticThis->startNodeSync( staticThis->_connections.end() - 1 );
-        newConn.timeSyncStatus = NEEDED;
+    newConn->esp_conn = (espconn *)arg;
+    newConn->mesh = mesh;
+    newConn->esp_conn->reverse = newConn;  // the slot never moves, so this holds until closeConnection()
+    espconn_set_opt( newConn->esp_conn, ESPCONN_NODELAY );  // removes nagle, low latency, but soaks up bandwidth
+    newConn->lastRecieved = mesh->getNodeTime();
+
+    espconn_regist_recvcb(newConn->esp_conn, meshRecvCb);
+    espconn_regist_sentcb(newConn->esp_conn, meshSentCb);
+    espconn_regist_reconcb(newConn->esp_conn, meshReconCb);
+    espconn_regist_disconcb(newConn->esp_conn, meshDisconCb);
+
+    if( newConn->esp_conn->proto.tcp->local_port != mesh->_meshPort ) { // we are the station, start nodeSync
+        debugMsg( CONNECTION, "meshConnectedCb(): we are STA, start nodeSync\n");
+        newConn->timeSyncStatus = NEEDED;
+        mesh->setLinkDuty( newConn, mesh->_dutyPeriod, mesh->_dutyWindow, mesh->_chipId );
+        mesh->startNodeSync( newConn );
+        mesh->armRoamTimer();
+        mesh->_rejoinStep = 0;  // back in, the next loss starts with the cache again
+        mesh->_meshAPs.clear();  // the other scan results will be stale by then
     }
     else
-        staticThis->debugMsg( CONNECTION, "meshConnectedCb(): we are AP\n");
+        debugMsg( CONNECTION, "meshConnectedCb(): we are AP\n");
 
-    staticThis->debugMsg( GENERAL, "meshConnectedCb(): leaving\n");
+    mesh->updateBeacon();
+
+    mesh->scheduleConnection( newConn );
+
+    debugMsg( GENERAL, "meshConnectedCb(): leaving\n");
 }
 
 /**
 * This control block is sent by a connection that wants to transmit something.
-* A JSON buffer is allocated to hold the incoming message.
-* Finally depending on the type of the message (SYNC,REPLY..) the neccessary actions are made.
+* TCP is a byte stream: one callback can carry several packages (see meshSentCb()) or only part of one.
+* Complete packages are handled in place, a trailing partial one is kept in the connection's
+* recvBuffer and completed by the next callback.
 * @param arg The connection,an espconn obj.
 */
 void ICACHE_FLASH_ATTR easyMesh::meshRecvCb(void *arg, char *data, unsigned short length) {
-    meshConnectionType *receiveConn = staticThis->findConnection( (espconn *)arg );
-
-    staticThis->debugMsg( COMMUNICATION, "meshRecvCb(): data=%s fromId=%d\n", data, receiveConn->chipId );
+    meshConnectionType *receiveConn = connectionFor( (espconn *)arg );
 
     if ( receiveConn == NULL ) {
-        staticThis->debugMsg( ERROR, "meshRecvCb(): recieved from unknown connection 0x%x ->%s<-\n", arg, data);
-        staticThis->debugMsg( ERROR, "dropping this msg... see if we recover?\n");
+        debugMsg( ERROR, "meshRecvCb(): recieved from unknown connection 0x%x length=%d\n", arg, length);
+        debugMsg( ERROR, "dropping this msg... see if we recover?\n");
         return;
     }
 
-    DynamicJsonBuffer jsonBuffer( JSON_BUFSIZE );
-    JsonObject& root = jsonBuffer.parseObject( data );
-    if (!root.success()) {   // Test if parsing succeeded.
-        staticThis->debugMsg( ERROR, "meshRecvCb: parseObject() failed. data=%s<--\n", data);
+    easyMesh *mesh = receiveConn->mesh;
+    meshHandle handle = mesh->_connections.handleOf( receiveConn );
+    meshCycleTimer cycles( mesh->_stats.recvCycles );
+    mesh->_recvTime = mesh->getNodeTime();  // as early as we can, for timeSync
+
+    debugMsg( COMMUNICATION, "meshRecvCb(): length=%d fromId=%d\n", length, receiveConn->chipId );
+
+    uint8_t *bytes = (uint8_t *)data;
+    uint16_t offset = 0;
+
+    // complete the package the previous segment ended with
+    meshRecvBuffer &pending = receiveConn->recvBuffer;
+    if ( !pending.empty() ) {
+        uint16_t before = pending.used();
+        uint16_t chunk = min( (uint16_t)length, pending.space() );
+        pending.append( bytes, chunk );
+
+        uint16_t packageLen = packageLength( pending.data(), pending.used() );
+        if ( packageLen == 0 ) {
+            if ( pending.space() > 0 )
+                return;  // still not complete, wait for the next segment
+
+            debugMsg( ERROR, "meshRecvCb(): package does not fit the reassembly buffer, dropping\n");
+            mesh->countParseError( receiveConn );
+            pending.clear();
+            offset = chunk;
+        } else {
+            // handled in the buffer, which closeConnection() frees, so nothing may touch it afterwards
+            mesh->handlePackage( receiveConn, pending.data(), packageLen );
+            offset = packageLen - before;
+
+            receiveConn = mesh->_connections.get( handle );
+            if ( receiveConn == NULL )
+                return;
+            receiveConn->recvBuffer.clear();
+        }
+    }
+
+    while ( offset < length ) {
+        uint16_t remaining = length - offset;
+        if ( !isPackageStart( bytes + offset, remaining ) ) {
+            uint16_t skip = nextPackageStart( bytes + offset, remaining );
+            debugMsg( ERROR, "meshRecvCb(): garbled stream, skipping %d bytes\n", skip);
+            mesh->countParseError( receiveConn );
+            offset += skip;
+            continue;
+        }
+
+        uint16_t packageLen = packageLength( bytes + offset, remaining );
+        if ( packageLen == 0 ) {  // split across segments, keep the start for the next callback
+            if ( !receiveConn->recvBuffer.append( bytes + offset, remaining ) ) {
+                debugMsg( ERROR, "meshRecvCb(): partial package too long, dropping %d bytes\n", remaining);
+                mesh->countParseError( receiveConn );
+            }
+            return;
+        }
+
+        mesh->handlePackage( receiveConn, bytes + offset, packageLen );
+        offset += packageLen;
+
+        // handling a package can close the connection, the handle then no longer resolves
+        receiveConn = mesh->_connections.get( handle );
+        if ( receiveConn == NULL )
+            return;
+    }
+}
+
+/**
+* Handles one complete package.
+* Binary packages are recognised by their magic byte, anything else is treated as a legacy JSON package.
+* Finally depending on the type of the message (SYNC,REPLY..) the neccessary actions are made.
+* @param receiveConn The connection the package arrived on.
+* @param bytes The package.
+* @param length The package length in bytes.
+*/
+void ICACHE_FLASH_ATTR easyMesh::handlePackage(meshConnectionType *receiveConn, uint8_t *bytes, uint16_t length) {
+    meshPackageHeader header;
+    meshSyncInfo sync;
+    String msg;
+    const uint8_t *payload = NULL;  // SINGLE and BROADCAST payload, points into bytes or msg
+    uint16_t payloadLength = 0;
+
+    countReceived( receiveConn, length );
+
+    bool binary = isBinaryPackage( bytes, length );
+    if ( binary ) {
+        if ( !decodePackageHeader( bytes, length, header ) ) {
+            debugMsg( ERROR, "handlePackage(): bad binary package length=%d\n", length);
+            countParseError( receiveConn );
+            return;
+        }
+        receiveConn->wireFormat = WIRE_BINARY;  // they speak it, so answer in it
+    }
+
+    bool peeked = binary || peekJsonHeader( bytes, length, header );
+
+    // a broadcast that went around a loop or was seen already is dropped before any parsing or relaying
+    if ( peeked && isFlooded( header ) && !acceptFlooded( receiveConn, header ) )
         return;
+
+    // fast path: relay SINGLEs (and other routed packages) for other nodes on the routing header alone,
+    // a JSON one the aggregate callback wants to see needs its payload parsed first
+    if ( peeked && isRouted( header ) && header.dest != _chipId ) {
+        bool offer = aggregateCandidate( receiveConn, header );
+        if ( binary || !offer ) {
+            receiveConn->lastRecieved = getNodeTime();
+            if ( !offer || !_aggregateCallback( header.from, bytes + packageHeaderSize( header ), header.length ) )
+                forwardSingle( header, bytes, length );
+            return;
+        }
+    }
+
+    if ( binary ) {
+        payload = bytes + packageHeaderSize( header );
+        payloadLength = header.length;
+        sync.keepalive = ( header.flags & PACKAGE_FLAG_PING ) != 0;
+        sync.sink = ( header.flags & PACKAGE_FLAG_SINK ) != 0;
+        if ( ( header.flags & PACKAGE_FLAG_SYNC_HASH ) && payloadLength >= PACKAGE_SYNC_HASH_SIZE ) {
+            sync.hasHash = true;
+            for ( uint8_t b = 0; b < 4; b++ ) {
+                sync.hash |= (uint32_t)payload[b] << ( 8 * b );
+                sync.known |= (uint32_t)payload[4 + b] << ( 8 * b );
+            }
+            payload += PACKAGE_SYNC_HASH_SIZE;
+            payloadLength -= PACKAGE_SYNC_HASH_SIZE;
+            if ( ( header.flags & PACKAGE_FLAG_DUTY ) && payloadLength >= PACKAGE_SYNC_DUTY_SIZE ) {
+                for ( uint8_t b = 0; b < 4; b++ ) {
+                    sync.dutyPeriod |= (uint32_t)payload[b] << ( 8 * b );
+                    sync.dutyWindow |= (uint32_t)payload[4 + b] << ( 8 * b );
+                }
+                payload += PACKAGE_SYNC_DUTY_SIZE;
+                payloadLength -= PACKAGE_SYNC_DUTY_SIZE;
+            }
+            if ( ( header.flags & PACKAGE_FLAG_HOPS ) && payloadLength >= PACKAGE_SYNC_HOPS_SIZE ) {
+                sync.hops = payload[0];
+                payload += PACKAGE_SYNC_HOPS_SIZE;
+                payloadLength -= PACKAGE_SYNC_HOPS_SIZE;
+            }
+            sync.hasSubs = payloadLength > 0;
+        }
+        if ( header.type != SINGLE && header.type != BROADCAST )  // those are handed on as bytes
+            payloadToString( payload, payloadLength, msg );
+    } else {
+        // the lease ends with this block, the handlers below are free to use the arena again
+        meshJsonLease lease( _jsonArena );
+        if ( lease.buffer == NULL ) {
+            debugMsg( ERROR, "handlePackage(): JSON arena busy, dropping package\n");
+            return;
+        }
+
+        JsonObject& root = lease.buffer->parseObject( (char *)bytes, JSON_NESTING_LIMIT );  // parses in place
+        if (!root.success()) {   // Test if parsing succeeded.
+            debugMsg( ERROR, "handlePackage(): parseObject() failed. length=%d\n", length);
+            countParseError( receiveConn );
+            return;
+        }
+
+        header.type = (int)root["type"];
+        header.from = (uint32_t)root["from"];
+        header.dest = (uint32_t)root["dest"];
+        if ( root.containsKey( "urgent" ) )
+            header.flags |= PACKAGE_FLAG_URGENT;
+
+        if ( !peeked && isFlooded( header ) ) {  // unusual key order
+            if ( root.containsKey( "seq" ) ) {
+                header.flags |= PACKAGE_FLAG_SEQ;
+                header.seq = (uint16_t)root["seq"];
+            }
+            if ( !acceptFlooded( receiveConn, header ) )
+                return;
+        }
+
+        if ( header.type == NODE_SYNC_REQUEST || header.type == NODE_SYNC_REPLY ) {
+            sync.hasSubs = root.containsKey( "subs" );
+            if ( sync.hasSubs )
+                msg = root["subs"].as<String>();
+            sync.keepalive = root.containsKey( "ping" );
+            sync.sink = root.containsKey( "sink" );
+            if ( root.containsKey( "duty" ) ) {
+                sync.dutyPeriod = root["duty"].as<uint32_t>();
+                sync.dutyWindow = root["window"].as<uint32_t>();
+            }
+            if ( root.containsKey( "hops" ) )
+                sync.hops = root["hops"].as<uint8_t>();
+            if ( root.containsKey( "hash" ) ) {
+                sync.hasHash = true;
+                sync.hash = root["hash"].as<uint32_t>();
+                sync.known = root["known"].as<uint32_t>();
+            }
+            if ( (int)root["wire"] >= PACKAGE_VERSION )
+                receiveConn->wireFormat = WIRE_BINARY;
+            payload = (const uint8_t *)msg.c_str();
+            payloadLength = msg.length();
+        } else if ( root.containsKey( "bin" ) ) {  // a byte payload with NUL in it, see buildMeshPackage()
+            char *text = (char *)root["bin"].as<const char *>();  // parsed in place, so it points into bytes
+            if ( text == NULL || !base64ToPayload( text, payloadLength ) ) {
+                debugMsg( ERROR, "handlePackage(): bad base64 payload, dropping\n");
+                countParseError( receiveConn );
+                return;
+            }
+            payload = (const uint8_t *)text;
+        } else {
+            msg = root["msg"].as<String>();
+            payload = (const uint8_t *)msg.c_str();
+            payloadLength = msg.length();
+        }
     }
 
-    staticThis->debugMsg( GENERAL, "Recvd from %d-->%s<--\n", receiveConn->chipId, data);
+    debugMsg( GENERAL, "Recvd from %d type=%d length=%d\n", receiveConn->chipId, header.type, payloadLength);
 
-    String msg = root["msg"];
+    // record that we've gotten a valid package, before a handler gets a chance to close receiveConn
+    receiveConn->lastRecieved = getNodeTime();
 
-    switch( (meshPackageType)(int)root["type"] ) {
+    switch( (meshPackageType)header.type ) {
         case NODE_SYNC_REQUEST:
         case NODE_SYNC_REPLY:
-            staticThis->handleNodeSync( receiveConn, root );
+            handleNodeSync( receiveConn, header, msg, sync );
             break;
 
         case TIME_SYNC:
-            staticThis->handleTimeSync( receiveConn, root );
+            handleTimeSync( receiveConn, msg );
+            break;
+
+        case PING:
+            sendMessage( receiveConn, header.from, PONG, msg );
+            break;
+
+        case PONG:
+            handlePong( receiveConn, msg );
             break;
 
         case SINGLE:
-            if ( (uint32_t)root["dest"] == staticThis->getChipId() ) {  // msg for us!
-                receivedCallback( (uint32_t)root["from"], msg);
-            } else {                                                    // pass it along
-                //staticThis->sendMessage( (uint32_t)root["dest"], (uint32_t)root["from"], SINGLE, msg );  //this is ineffiecnt
-                String tempStr( data );
-                staticThis->sendPackage( staticThis->findConnection( (uint32_t)root["dest"] ), tempStr );
+            if ( header.dest == _chipId ) {  // msg for us!
+                deliverPackage( header.from, payload, payloadLength, msg );
+            } else if ( !absorbAggregate( receiveConn, header, payload, payloadLength ) ) {  // pass it along
+                meshConnectionType *nextConn = findConnection( header.dest );
+                if ( nextConn != NULL && sendMessage( nextConn, header.dest, header.from, SINGLE, payload, payloadLength, PACKAGE_NO_SEQ, packagePriority( header ) ) < SEND_QUEUE_FULL )
+                    countForwarded( nextConn );
             }
             break;
 
         case BROADCAST:
-            staticThis->broadcastMessage( (uint32_t)root["from"], BROADCAST, msg, receiveConn);
-            receivedCallback( (uint32_t)root["from"], msg);
+            if ( absorbAggregate( receiveConn, header, payload, payloadLength ) )
+                break;
+            broadcastMessage( header.from, BROADCAST, payload, payloadLength, receiveConn,
+                              ( header.flags & PACKAGE_FLAG_SEQ ) ? header.seq : PACKAGE_NO_SEQ, packagePriority( header ) );
+            deliverPackage( header.from, payload, payloadLength, msg );
+            break;
+
+        case STATS_REQUEST:
+        case STATS_REPLY:
+            if ( isRouted( header ) && header.dest != _chipId ) {  // unusual key order, pass it along
+                meshConnectionType *nextConn = findConnection( header.dest );
+                if ( nextConn != NULL && sendMessage( nextConn, header.dest, header.from, (meshPackageType)header.type, msg ) < SEND_QUEUE_FULL )
+                    countForwarded( nextConn );
+            } else if ( header.type == STATS_REQUEST ) {
+                if ( header.dest == 0 )  // asked everyone, so flood it on like a broadcast
+                    broadcastMessage( header.from, STATS_REQUEST, msg, receiveConn,
+                                      ( header.flags & PACKAGE_FLAG_SEQ ) ? header.seq : PACKAGE_NO_SEQ );
+                handleStatsRequest( header.from );
+            } else if ( _statsCallback != NULL ) {
+                _statsCallback( header.from, msg );
+            }
             break;
 
         default:
-            staticThis->debugMsg( ERROR, "meshRecvCb(): unexpected json, root[\"type\"]=%d", (int)root["type"]);
+            debugMsg( ERROR, "handlePackage(): unexpected package type=%d", header.type);
             return;
     }
+}
+
+/**
+ * Hands a SINGLE or BROADCAST payload to the application.
+ * @param from The node it originates from.
+ * @param payload The payload, a view into the received package.
+ * @param length The payload length.
+ * @param msg The payload as a String if the JSON parser made one, empty for binary packages.
+ */
+void ICACHE_FLASH_ATTR easyMesh::deliverPackage( uint32_t from, const uint8_t *payload, uint16_t length, String &msg ) {
+    if ( _receivedBytesCallback != NULL )
+        _receivedBytesCallback( from, payload, length );
+
+    if ( _receivedCallback != NULL ) {
+        if ( msg.length() != length )  // binary, convert only for this callback
+            payloadToString( payload, length, msg );
+        _receivedCallback( from, msg );
+    }
+}
 
-    // record that we've gotten a valid package
-    receiveConn->lastRecieved = staticThis->getNodeTime();
-    return;
+/**
+ * True if the aggregate callback gets to see this package before we relay it: it comes from our
+ * subtree, is not urgent, and is a BROADCAST or a SINGLE on its way to a sink.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::aggregateCandidate( meshConnectionType *receiveConn, meshPackageHeader &header ) {
+    if ( _aggregateCallback == NULL || packagePriority( header ) != PRIORITY_NORMAL )
+        return false;
+    if ( header.type != BROADCAST && !( header.type == SINGLE && knownSink( header.dest ) ) )
+        return false;
+    return receiveConn != stationConnection();
+}
+
+/**
+ * Offers a package to the aggregate callback, see setAggregateCallback().
+ * @return True if the callback absorbed it, it must then be neither relayed nor delivered.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::absorbAggregate( meshConnectionType *receiveConn, meshPackageHeader &header, const uint8_t *payload, uint16_t length ) {
+    if ( !aggregateCandidate( receiveConn, header ) || !_aggregateCallback( header.from, payload, length ) )
+        return false;
+
+    debugMsg( COMMUNICATION, "absorbAggregate(): type=%d from=%u aggregated\n", header.type, header.from );
+    return true;
+}
+
+/**
+ * True for packages that are flooded to every node and deduplicated on (from, seq).
+ */
+bool ICACHE_FLASH_ATTR easyMesh::isFlooded( meshPackageHeader &header ) {
+    return header.type == BROADCAST || ( header.type == STATS_REQUEST && header.dest == 0 );
+}
+
+/**
+ * True for packages that travel along the routing table to header.dest.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::isRouted( meshPackageHeader &header ) {
+    return header.type == SINGLE || header.type == STATS_REPLY ||
+           ( header.type == STATS_REQUEST && header.dest != 0 );
 }
 
 /**
  * The control block responsible for sending a message to another node,
  * basically popping a conn from sendQueue and sending a package.
+ * With batching on, as many queued packages as fit under PACKAGE_MAX_SIZE go out in one espconn_send.
  * @param arg The espconn CB.
  */
 void ICACHE_FLASH_ATTR easyMesh::meshSentCb(void *arg) {
-    staticThis->debugMsg( GENERAL, "meshSentCb():\n");    //data sent successfully
+    debugMsg( GENERAL, "meshSentCb():\n");    //data sent successfully
     espconn *conn = (espconn*)arg;
-    meshConnectionType *meshConnection = staticThis->findConnection( conn );
+    meshConnectionType *meshConnection = connectionFor( conn );
 
     if ( meshConnection == NULL ) {
-        staticThis->debugMsg( ERROR, "meshSentCb(): err did not find meshConnection? Likely it was dropped for some reason\n");
+        debugMsg( ERROR, "meshSentCb(): err did not find meshConnection? Likely it was dropped for some reason\n");
+        return;
+    }
+    meshConnection->mesh->sendQueued( meshConnection );
+}
+
+/**
+ * Sends the front of the send queue, merged into one segment where the peer splits them again.
+ * With nothing queued, or the far end of the link asleep, the connection is ready again instead.
+ * @param conn A connection with no send in flight.
+ */
+void ICACHE_FLASH_ATTR easyMesh::sendQueued( meshConnectionType *conn ) {
+    meshSendLanes &queue = conn->sendQueue;  // high lane first
+    if ( conn->time.stampPending && queue.lane( PRIORITY_HIGH ).empty() && !linkDozing( conn, getNodeTime() ) ) {
+        conn->sendReady = true;
+        sendTimeStamp( conn );  // our next stamp waited for this, see sendTimeStamp()
         return;
     }
+    if ( queue.empty() || linkDozing( conn, getNodeTime() ) ) {
+        conn->sendReady = true;
+        if ( !queue.empty() )
+            holdForWake( conn );
+        return;
+    }
+
+    uint16_t length = queue.pop( _sendBuffer, PACKAGE_MAX_SIZE );
+    uint16_t packages = 1;
 
-    if ( !meshConnection->sendQueue.empty() ) {
-        String package = *meshConnection->sendQueue.begin();
-        meshConnection->sendQueue.pop_front();
-        sint8 errCode = espconn_send( meshConnection->esp_conn, (uint8*)package.c_str(), package.length() );
-        if ( errCode != 0 ) {
-            staticThis->debugMsg( ERROR, "meshSentCb(): espconn_send Failed err=%d\n", errCode );
+    // binary capable nodes split merged packages again, so fill the segment
+    if ( _batching && conn->wireFormat == WIRE_BINARY ) {
+        while ( !queue.empty() && length + queue.frontLength() <= PACKAGE_MAX_SIZE ) {
+            length += queue.pop( _sendBuffer + length, PACKAGE_MAX_SIZE - length );
+            packages++;
         }
+    }
+
+    sint8 errCode = espconn_send( conn->esp_conn, _sendBuffer, length );
+    if ( errCode != 0 ) {
+        debugMsg( ERROR, "sendQueued(): espconn_send Failed err=%d\n", errCode );
+        countSendError( conn );
+        conn->sendReady = true;  // no sent callback will follow
     } else {
-        meshConnection->sendReady = true;
+        conn->sendReady = false;  // until meshSentCb()
+        countSent( conn, packages, length );
     }
 }
 
@@ -389,13 +886,20 @@ void ICACHE_FLASH_ATTR easyMesh::meshSentCb(void *arg) {
 void ICACHE_FLASH_ATTR easyMesh::meshDisconCb(void *arg) {
     struct espconn *disConn = (espconn *)arg;
 
-    staticThis->debugMsg( CONNECTION, "meshDisconCb(): ");
+    debugMsg( CONNECTION, "meshDisconCb(): ");
+
+    meshConnectionType *meshConnection = connectionFor( disConn );
+    easyMesh *mesh = meshConnection != NULL ? meshConnection->mesh : meshFor( disConn );
+    if ( mesh == NULL )
+        return;
+    if ( meshConnection != NULL )
+        mesh->scheduleConnection( meshConnection );  // let manageConnections() clean it up
 
     //test to see if this connection was on the STATION interface by checking the local port
-    if ( disConn->proto.tcp->local_port == staticThis->_meshPort ) {
-        staticThis->debugMsg( CONNECTION, "AP connection.  No new action needed. local_port=%d\n", disConn->proto.tcp->local_port);
+    if ( disConn->proto.tcp->local_port == mesh->_meshPort ) {
+        debugMsg( CONNECTION, "AP connection.  No new action needed. local_port=%d\n", disConn->proto.tcp->local_port);
     } else {
-        staticThis->debugMsg( CONNECTION, "Station Connection! Find new node. local_port=%d\n", disConn->proto.tcp->local_port);
+        debugMsg( CONNECTION, "Station Connection! Find new node. local_port=%d\n", disConn->proto.tcp->local_port);
         // should start up automatically when station_status changes to IDLE
         wifi_station_disconnect();
     }
@@ -407,7 +911,11 @@ void ICACHE_FLASH_ATTR easyMesh::meshDisconCb(void *arg) {
 * @param event The SystemEvent to check.
 */
 void ICACHE_FLASH_ATTR easyMesh::meshReconCb(void *arg, sint8 err) {
-    staticThis->debugMsg( ERROR, "In meshReconCb(): err=%d\n", err );
+    debugMsg( ERROR, "In meshReconCb(): err=%d\n", err );
+
+    meshConnectionType *meshConnection = connectionFor( (espconn *)arg );
+    if ( meshConnection != NULL )
+        meshConnection->mesh->scheduleConnection( meshConnection );
 }
 
 /**
@@ -415,37 +923,44 @@ void ICACHE_FLASH_ATTR easyMesh::meshReconCb(void *arg, sint8 err) {
  * @param event The SystemEvent to check.
  */
 void ICACHE_FLASH_ATTR easyMesh::wifiEventCb(System_Event_t *event) {
+    easyMesh *mesh = _stationOwner != NULL ? _stationOwner : _instances[0];
+    if (mesh == NULL)
+        return;
+
     switch (event->event) {
         case EVENT_STAMODE_CONNECTED:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_CONNECTED ssid=%s\n", (char*)event->event_info.connected.ssid );
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_CONNECTED ssid=%s\n", (char*)event->event_info.connected.ssid );
+            mesh->rememberParent( event->event_info.connected );
             break;
         case EVENT_STAMODE_DISCONNECTED:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_DISCONNECTED\n");
-            staticThis->connectToBestAP();
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_DISCONNECTED\n");
+            if ( mesh->_rejoinStep > 0 && mesh->_rejoinStep <= PARENT_CACHE_SIZE )
+                wifi_station_disconnect();  // a cached parent did not answer, stop the SDK retrying it
+            mesh->connectToBestAP();
             break;
         case EVENT_STAMODE_AUTHMODE_CHANGE:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_AUTHMODE_CHANGE\n");
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_AUTHMODE_CHANGE\n");
             break;
         case EVENT_STAMODE_GOT_IP:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_GOT_IP\n");
-            staticThis->tcpConnect();
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_GOT_IP\n");
+            mesh->tcpConnect();
             break;
 
         case EVENT_SOFTAPMODE_STACONNECTED:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_SOFTAPMODE_STACONNECTED\n");
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_SOFTAPMODE_STACONNECTED\n");
             break;
 
         case EVENT_SOFTAPMODE_STADISCONNECTED:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_SOFTAPMODE_STADISCONNECTED\n");
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_SOFTAPMODE_STADISCONNECTED\n");
             break;
         case EVENT_STAMODE_DHCP_TIMEOUT:
-            staticThis->debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_DHCP_TIMEOUT\n");
+            debugMsg( CONNECTION, "wifiEventCb(): EVENT_STAMODE_DHCP_TIMEOUT\n");
             break;
         case EVENT_SOFTAPMODE_PROBEREQRECVED:
             // debugMsg( GENERAL, "Event: EVENT_SOFTAPMODE_PROBEREQRECVED\n");  // dont need to know about every probe request
             break;
         default:
-            staticThis->debugMsg( ERROR, "Unexpected WiFi event: %d\n", event->event);
+            debugMsg( ERROR, "Unexpected WiFi event: %d\n", event->event);
             break;
     }
 }
@@ -2,18 +2,28 @@
 #include <ArduinoJson.h>
 #include <SimpleList.h>
 
-extern "C" {
-#include "user_interface.h"
-#include "espconn.h"
-}
+#include "easyMeshPlatform.h"
 
 #include "easyMesh.h"
 #include "easyMeshSync.h"
 
 
-easyMesh* staticThis;
+easyMesh *easyMesh::_instances[MESH_MAX_INSTANCES];
+easyMesh *easyMesh::_stationOwner = NULL;
 uint16_t  count = 0;
 
+/**
+ * Takes the mesh out of the callback routing.
+ */
+ICACHE_FLASH_ATTR easyMesh::~easyMesh( void ) {
+    for ( uint8_t i = 0; i < MESH_MAX_INSTANCES; i++ ) {
+        if ( _instances[i] == this )
+            _instances[i] = NULL;
+    }
+    if ( _stationOwner == this )
+        _stationOwner = NULL;
+}
+
 /**
  * Initializes the mesh network by reseting the wifi connection and assigning blank values to the mesh variables.
  * Call in the setup phase of the project but ONLY ONCE.
@@ -23,7 +33,8 @@ uint16_t  count = 0;
  */
 void ICACHE_FLASH_ATTR easyMesh::init( String prefix, String password, uint16_t port ) {
     // shut everything down, start with a blank slate.
-    debugMsg( STARTUP, "init():\n",    wifi_station_set_auto_connect( 0 ));
+    debugMsg( STARTUP, "init():\n");
+    wifi_station_set_auto_connect( 0 );
     
     if ( wifi_station_get_connect_status() != STATION_IDLE ) {
         debugMsg( ERROR, "Station is doing something... wierd!? status=%d\n", wifi_station_get_connect_status());
@@ -33,10 +44,18 @@ void ICACHE_FLASH_ATTR easyMesh::init( String prefix, String password, uint16_t
     
     wifi_set_event_handler_cb( wifiEventCb );
     
-    staticThis = this;  // provides a way for static callback methods to access "this" object;
+    // static SDK callbacks find their mesh through the connection, or through this table
+    uint8_t slot = 0;
+    while ( slot < MESH_MAX_INSTANCES && _instances[slot] != NULL && _instances[slot] != this )
+        slot++;
+    if ( slot < MESH_MAX_INSTANCES )
+        _instances[slot] = this;
+    else
+        debugMsg( ERROR, "init(): more than MESH_MAX_INSTANCES meshes\n" );
     
     // start configuration
-    debugMsg( GENERAL, "wifi_set_opmode(STATIONAP_MODE) succeeded? %d\n", wifi_set_opmode( STATIONAP_MODE ) );
+    bool opmodeSet = wifi_set_opmode( STATIONAP_MODE );  // not inside debugMsg(), it may be compiled out
+    debugMsg( GENERAL, "wifi_set_opmode(STATIONAP_MODE) succeeded? %d\n", opmodeSet );
     
     _meshPrefix = prefix;
     _meshPassword = password;
@@ -44,6 +63,10 @@ void ICACHE_FLASH_ATTR easyMesh::init( String prefix, String password, uint16_t
     _chipId = system_get_chip_id();
     _mySSID = _meshPrefix + String( _chipId );
     
+    os_timer_disarm( &_updateTimer );
+    os_timer_setfn( &_updateTimer, updateTimerCallback, this );
+    scheduleUpdate( getNodeTime() + CLOCK_WRAP_GUARD );  // keeps the 64 bit clock ticking while there are no connections
+
     apInit();       // setup AP
     stationInit();  // setup station
     
@@ -52,6 +75,8 @@ void ICACHE_FLASH_ATTR easyMesh::init( String prefix, String password, uint16_t
 
 /**
  * Starts the update sequence.
+ * The mesh runs this itself whenever a connection deadline expires (see scheduleUpdate()),
+ * calling it from the sketch is harmless but no longer needed.
  */
 void ICACHE_FLASH_ATTR easyMesh::update( void ) {
     manageStation();
@@ -59,21 +84,122 @@ void ICACHE_FLASH_ATTR easyMesh::update( void ) {
     return;
 }
 
+/**
+ * Microseconds until the mesh needs the CPU again, 0xFFFFFFFF if nothing is scheduled.
+ * Lets the sketch decide whether a light sleep is worth it.
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::timeToNextUpdate( void ) {
+    if ( !_updateArmed )
+        return 0xFFFFFFFF;
+
+    int32_t left = (int32_t)( _nextUpdate - getNodeTime() );
+    return left > 0 ? left : 0;
+}
+
 /**
  * Sends a message only once to a specific node in the mesh.
  * @param destId The chip unique ID of the receiver node.
  * @param msg The message to be sent.
+ * @param priority PRIORITY_HIGH for alerts, they overtake queued application data on every hop.
+ * @return SEND_OK or SEND_QUEUED on success, otherwise why the message was dropped.
  */
-bool ICACHE_FLASH_ATTR easyMesh::sendSingle( uint32_t &destId, String &msg ){
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendSingle( uint32_t &destId, String &msg, meshPriorityType priority ){
     debugMsg( COMMUNICATION, "sendSingle(): dest=%d msg=%s\n", destId, msg.c_str());
-    sendMessage( destId, SINGLE, msg );
+    return sendMessage( destId, SINGLE, msg, priority );
+}
+
+/**
+ * Sends a byte payload only once to a specific node in the mesh. Between binary capable nodes
+ * it travels as is; a JSON link carries it base64 encoded if it contains NUL. Only nodes that
+ * predate binary payloads lose such a payload, plain text reaches them as before.
+ * @param destId The chip unique ID of the receiver node.
+ * @param data The payload.
+ * @param length The payload length, at most PACKAGE_MAX_SIZE less the header.
+ * @param priority PRIORITY_HIGH for alerts, see the String version.
+ * @return SEND_OK or SEND_QUEUED on success, otherwise why the message was dropped.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendSingle( uint32_t &destId, const uint8_t *data, uint16_t length, meshPriorityType priority ){
+    debugMsg( COMMUNICATION, "sendSingle(): dest=%d length=%d\n", destId, length);
+    return sendMessage( destId, SINGLE, data, length, priority );
 }
 
 /**
  * Sends a message to every node in the network.
  * @param msg The message to be broadcast.
+ * @param priority PRIORITY_HIGH for alerts, see sendSingle().
+ * @return The worst send status over all connections.
  */
-bool ICACHE_FLASH_ATTR easyMesh::sendBroadcast( String &msg ) {
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendBroadcast( String &msg, meshPriorityType priority ) {
     debugMsg( COMMUNICATION, "sendBroadcast(): msg=%s\n", msg.c_str());
-    broadcastMessage( _chipId, BROADCAST, msg );
+    return broadcastMessage( _chipId, BROADCAST, msg, NULL, nextBroadcastSeq(), priority );
+}
+
+/**
+ * Sends a byte payload to every node in the network, see the byte version of sendSingle().
+ * @param data The payload.
+ * @param length The payload length.
+ * @param priority PRIORITY_HIGH for alerts.
+ * @return The worst send status over all connections.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendBroadcast( const uint8_t *data, uint16_t length, meshPriorityType priority ) {
+    debugMsg( COMMUNICATION, "sendBroadcast(): length=%d\n", length);
+    return broadcastMessage( _chipId, BROADCAST, data, length, NULL, nextBroadcastSeq(), priority );
+}
+
+/**
+ * Sends a message to the nearest sink as a SINGLE, so it travels up the routing table and
+ * costs one transmission per hop instead of a flood through the whole mesh.
+ * On a sink it goes straight to our own receive callback.
+ * @param msg The message to be sent.
+ * @param priority PRIORITY_HIGH for alerts, see sendSingle().
+ * @return SEND_NO_ROUTE if no sink is known, otherwise as sendSingle().
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendToSink( String &msg, meshPriorityType priority ) {
+    if ( _sink ) {
+        deliverPackage( _chipId, (const uint8_t *)msg.c_str(), msg.length(), msg );
+        return SEND_OK;
+    }
+
+    uint32_t sinkId = findSink();
+    if ( sinkId == 0 ) {
+        debugMsg( COMMUNICATION, "sendToSink(): no sink known\n");
+        return SEND_NO_ROUTE;
+    }
+    return sendSingle( sinkId, msg, priority );
+}
+
+/**
+ * Sends a byte payload to the nearest sink, see the String version.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendToSink( const uint8_t *data, uint16_t length, meshPriorityType priority ) {
+    if ( _sink ) {
+        String msg;  // the String callback, if set, converts it
+        deliverPackage( _chipId, data, length, msg );
+        return SEND_OK;
+    }
+
+    uint32_t sinkId = findSink();
+    if ( sinkId == 0 ) {
+        debugMsg( COMMUNICATION, "sendToSink(): no sink known\n");
+        return SEND_NO_ROUTE;
+    }
+    return sendSingle( sinkId, data, length, priority );
+}
+
+/**
+ * Makes this node a sink (a gateway collecting sendToSink() traffic) or a normal node again.
+ * The role travels with nodeSync, so every connection is synced again when it changes.
+ */
+void ICACHE_FLASH_ATTR easyMesh::setSink( bool sink ) {
+    debugMsg( GENERAL, "setSink(): %d\n", sink );
+    if ( sink == _sink )
+        return;
+
+    _sink = sink;
+    meshConnectionList::iterator connection = _connections.begin();
+    while ( connection != _connections.end() ) {
+        connection->nodeSyncStatus = NEEDED;
+        scheduleConnection( connection );
+        connection++;
+    }
 }
\ No newline at end of file
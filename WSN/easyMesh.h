@@ -5,16 +5,55 @@
 #include <SimpleList.h>
 #include <ArduinoJson.h>
 
-extern "C" {
-#include "user_interface.h"
-#include "espconn.h"
-}
+#include "easyMeshPlatform.h"
 
 #include "easyMeshSync.h"
+#include "easyMeshPackage.h"
+#include "easyMeshQueue.h"
+#include "easyMeshSlab.h"
+#include "easyMeshJson.h"
+#include "easyMeshStats.h"
 
 #define NODE_TIMEOUT        3000000  //uSecs
 
-#define JSON_BUFSIZE        300 // initial size for the DynamicJsonBuffers.
+#define ROUTE_TABLE_SIZE    64  // power of 2, comfortably above the number of nodes in the mesh
+#define TOPOLOGY_POOL_SIZE  64  // nodes we can keep track of, at most 255
+#define TOPOLOGY_ROOT       0xFF  // parent index of a direct connection
+#define SEEN_CACHE_SIZE     16  // recent (from, seq) broadcasts remembered to drop duplicates
+
+#ifndef MESH_MAX_INSTANCES
+#define MESH_MAX_INSTANCES  2   // easyMesh objects one process runs, raise it for a host simulator
+#endif
+
+#define MAX_CHILDREN            10  // stations our AP takes at most, a full AP is never picked as parent
+#define CHILD_HEAP_RESERVE      12288   // bytes of heap kept for everything but children when sizing the AP
+#define CHILD_HEAP_OVERHEAD     2048    // bytes per child beyond its queues, the TCP pcb and SDK station state
+#define MAX_CONNECTIONS         ( MAX_CHILDREN + 1 )  // connection slots, our children plus the uplink
+#define PARENT_HOP_PENALTY      20  // dB a parent's score loses per hop it sits from the root, more than a better signal gains
+#define PARENT_CHILD_PENALTY    3   // dB per child it already serves
+#define PARENT_UNKNOWN_HOPS     2   // assumed for older nodes that send no mesh IE
+#define ROAM_INTERVAL           60000   // ms between same channel rescans while we have a parent
+#define ROAM_JITTER             15000   // ms spread by chip id, so siblings don't rescan together
+#define ROAM_DEEPER_INTERVAL    3000    // ms to the rescan once our parent moved further from the root
+#define ROAM_HYSTERESIS         8   // dB a candidate has to beat the current parent by
+#define BEACON_CACHE_SIZE       16  // mesh IEs remembered from the last scan
+
+#define PARENT_CACHE_SIZE       2   // last good parents tried before any scan
+#define PARENT_CACHE_MAGIC      0x4D455348  // "MESH", marks a valid copy in RTC memory
+#define PARENT_CACHE_RTC_BLOCK  64  // first RTC memory block left to the user, survives deep sleep
+
+#define MESH_IE_OUI         { 0x18, 0xFE, 0x34 }  // Espressif's OUI
+#define MESH_IE_MAGIC       'E'
+#define MESH_IE_VERSION     1
+#define MESH_IE_MIN_SIZE    4   // magic, version, hops, children
+#define MESH_IE_LIMIT_SIZE  5   // and the children the AP takes
+#define MESH_IE_SIZE        6   // and the nodes in its mesh, older nodes stop before either
+
+#define AP_SUBNET_PREFIX    10  // our AP serves 10.x.y.0/24, x.y assigned through our parent's lease
+#define AP_SUBNET_SPREAD    0x9E35  // 1 mod 4, see assignSubnet()
+#define AP_BEACON_MIN       100 // TU between the root's beacons, where most joins happen
+#define AP_BEACON_STEP      50  // TU added per hop, leaves beacon less and save power
+#define AP_BEACON_MAX       300 // TU, also used while our depth is unknown
 
 
 enum nodeStatusType {
@@ -43,7 +82,42 @@ enum meshPackageType {
     NODE_SYNC_REPLY = 6,
     CONTROL = 7,  //deprecated
     BROADCAST = 8,  //application data for everyone
-    SINGLE = 9   //application data for a single node
+    SINGLE = 9,  //application data for a single node
+    STATS_REQUEST = 10,  // ask dest (0 for everyone) for its meshStats
+    STATS_REPLY = 11,    // meshStats as JSON, routed back to the node that asked
+    PING = 12,  // keepalive to a direct connection, msg is the sender's system_get_time()
+    PONG = 13   // PING answered, msg echoed
+};
+
+/**
+ * The hash handshake of a NODE_SYNC package. Subs are only sent when the peer does not
+ * already hold them, which it tells us through known.
+ */
+struct meshSyncInfo {
+    bool hasHash = false;   // false for older nodes, they always send and need full subs
+    bool hasSubs = true;
+    uint32_t hash = 0;      // hash of the sender's subs for us
+    uint32_t known = 0;     // hash of our subs the sender holds, 0 if none
+    bool keepalive = false; // sender answers PING
+    bool sink = false;      // sender collects sendToSink() traffic
+    uint32_t dutyPeriod = 0;    // us, the sender sleeps between wake windows, 0 if it never does
+    uint32_t dutyWindow = 0;    // us awake per period
+    uint8_t hops = 0xFF;    // sender's hops from the root, 0xFF if it didn't say
+};
+
+struct meshSeenType {
+    uint32_t from = 0;
+    uint16_t seq = PACKAGE_NO_SEQ;
+};
+
+enum sendStatusType {  // ordered from best to worst
+    SEND_OK = 0,             // handed to espconn_send
+    SEND_QUEUED = 1,         // waiting in the connection's send queue
+    SEND_QUEUED_DROPPED = 2, // queued, older packages were dropped to make room (DROP_OLDEST)
+    SEND_QUEUE_FULL = 3,     // dropped, the send queue is full (DROP_NEWEST)
+    SEND_TOO_LONG = 4,       // larger than PACKAGE_MAX_SIZE
+    SEND_NO_ROUTE = 5,       // destination unknown or no connections
+    SEND_ERROR = 6           // espconn_send failed
 };
 
 
@@ -61,11 +135,38 @@ enum debugType {
     // add types if you like, room for a total of 16 types
 };
 
+/**
+ * The debug types compiled in. debugMsg() calls of any other type are removed by the
+ * preprocessor, arguments included, so the chatty hot path types cost nothing by default.
+ * setDebugMsgTypes() picks at runtime from what is left; build with e.g.
+ * -DDEBUG_MSG_TYPES=0xFFFF to get GENERAL and COMMUNICATION back.
+ */
+#ifndef DEBUG_MSG_TYPES
+#define DEBUG_MSG_TYPES     ( ERROR | STARTUP | MESH_STATUS | CONNECTION | SYNC | MSG_TYPES | REMOTE | APPLICATION )
+#endif
+
+extern uint16_t meshDebugTypes;  // runtime mask, see setDebugMsgTypes()
+
+#define debugMsg( type, ... ) \
+    ( ( ( DEBUG_MSG_TYPES & ( type ) ) && ( meshDebugTypes & ( type ) ) ) ? \
+      easyMesh::debugOut( ( type ), __VA_ARGS__ ) : (void)0 )
+
+
+class easyMesh;
 
 struct meshConnectionType {
-    espconn *esp_conn;
+    espconn *esp_conn;          // its reverse points back here, set in meshConnectedCb()
+    easyMesh *mesh = NULL;      // the mesh the SDK callbacks for this connection go to
     uint32_t chipId = 0;
-    String subConnections;
+    uint32_t subsHash = 0;  // hash of the subs last received, to spot topology changes
+    uint32_t peerKnownHash = 0;  // hash of our subs the peer reported holding, see meshSyncInfo
+    bool keepalive = false;      // peer answers PING, so idle links need no nodeSync
+    bool sink = false;           // peer is a sink
+    uint32_t dutyPeriod = 0;     // us, the sleeping end of this link wakes this often, 0 if neither sleeps
+    uint32_t dutyWindow = 0;     // us it stays awake then
+    uint32_t dutyOffset = 0;     // node time modulo dutyPeriod at which its window opens
+    uint32_t pingSent = 0;       // system_get_time() of the unanswered PING, 0 if none
+    uint16_t subCount = 0;  // nodes behind this connection, not counting itself
     timeSync time;
     uint32_t lastRecieved = 0;
     bool newConnection = true;
@@ -76,33 +177,133 @@ struct meshConnectionType {
     syncStatusType timeSyncStatus = NEEDED;
     uint32_t lastTimeSync = 0;
 
+    wireFormatType wireFormat = WIRE_JSON;  // switched to WIRE_BINARY once the remote node advertises it
+
     bool sendReady = true;
-    SimpleList <String> sendQueue;
+    meshSendLanes sendQueue;
+    uint32_t queueDrops = 0;
+
+    meshRecvBuffer recvBuffer;
+
+    uint32_t nextCheck = 0;  // node time manageConnections() has to look at this connection again
+
+    meshConnectionStats stats;
+};
+
+typedef meshSlab<meshConnectionType, MAX_CONNECTIONS> meshConnectionList;
+
+struct meshTopologyNode {
+    uint32_t chipId = 0;    // 0 marks a free slot
+    uint32_t via = 0;       // direct connection this node was learned from
+    uint8_t parent = TOPOLOGY_ROOT;  // pool index of the parent node
+    uint8_t hops = 0;
+    bool sink = false;      // advertised as a sink, a candidate for sendToSink()
+};
+
+/**
+ * What a mesh AP advertises in the vendor IE of its beacons and probe responses.
+ */
+struct meshBeaconInfo {
+    uint8_t bssid[6];
+    uint8_t hops = 0;       // from the root, the node without a parent
+    uint8_t children = 0;   // stations on its AP
+    uint8_t capacity = MAX_CHILDREN;    // stations it takes at most
+    uint8_t nodes = 0;      // in its mesh, capped at 255, 0 if it didn't say
+};
+
+struct meshParentEntry {
+    uint8_t bssid[6];
+    uint8_t channel = 0;    // 0 marks an empty entry
+    uint8_t ssidLen = 0;
+    uint8_t ssid[32];
+};
+
+/**
+ * The parents we were last connected to, newest first. Kept in RAM and copied to RTC memory,
+ * so a reboot from deep sleep can rejoin without a scan as well.
+ */
+struct meshParentCache {
+    uint32_t magic = 0;
+    meshParentEntry entries[PARENT_CACHE_SIZE];
+    uint32_t checksum = 0;
+};
+
+struct meshRouteType {
+    uint32_t chipId = 0;    // 0 marks a free slot
+    uint32_t nextHop = 0;   // chipId of the direct connection that leads there
+    uint8_t hops = 0;
 };
 
 
 class easyMesh {
 public:
+    ~easyMesh(void);
+
     //inline functions
     uint32 getChipId(void) { return _chipId; };
 
     // in easyMeshDebug.cpp
     void setDebugMsgTypes(uint16_t types);
 
-    void debugMsg(debugType type, const char *format ...);
+    static void debugOut(debugType type, const char *format ...);  // use debugMsg()
 
     // in easyMesh.cpp
     void init(String prefix, String password, uint16_t port);
 
     void update(void);
 
-    bool sendSingle(uint32_t &destId, String &msg);
+    uint32_t timeToNextUpdate(void);
+
+    sendStatusType sendSingle(uint32_t &destId, String &msg, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendSingle(uint32_t &destId, const uint8_t *data, uint16_t length, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendBroadcast(String &msg, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendBroadcast(const uint8_t *data, uint16_t length, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendToSink(String &msg, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendToSink(const uint8_t *data, uint16_t length, meshPriorityType priority = PRIORITY_NORMAL);
+
+    void setSink(bool sink);
 
-    bool sendBroadcast(String &msg);
+    bool isSink(void) { return _sink; };
+
+    bool isDutyCycling(void) { return _dutyPeriod != 0; };
+
+    void setSendQueue(uint16_t size, dropPolicyType policy);
+
+    uint32_t getQueueDrops(void) { return _queueDrops; };
+
+    void setBatching(bool batching) { _batching = batching; };
+
+    // in easyMeshRouting.cpp
+    uint32_t findSink(void);
+
+    // in easyMeshDuty.cpp
+    void setDutyCycle(uint32_t period, uint32_t window);
+
+    uint32_t timeToNextWake(void);
+
+    // in easyMeshStats.cpp
+    const meshStats &getStats(void) { return _stats; };
+
+    const meshConnectionStats *getConnectionStats(uint32_t chipId);
+
+    void resetStats(void);
+
+    void setStatsCallback(void(*onStats)(uint32_t from, String &stats));
+
+    sendStatusType requestStats(uint32_t destId);
 
     // in easyMeshConnection.cpp
     void setReceiveCallback(void(*onReceive)(uint32_t from, String &msg));
 
+    void setReceiveCallback(void(*onReceive)(uint32_t from, const uint8_t *data, uint16_t length));
+
+    void setAggregateCallback(bool(*onAggregate)(uint32_t from, const uint8_t *data, uint16_t length));
+
     void setNewConnectionCallback(void(*onNewConnection)(bool adopt));
 
     uint16_t connectionCount(meshConnectionType *exclude = NULL);
@@ -110,74 +311,225 @@ public:
     // in easyMeshSync.cpp
     uint32_t getNodeTime(void);
 
+    uint64_t getNodeTime64(void);
+
     // should be prototected, but public for debugging
     scanStatusType _scanStatus = IDLE;
     nodeStatusType _nodeStatus = INITIALIZING;
     SimpleList <bss_info> _meshAPs;
-    SimpleList <meshConnectionType> _connections;
+    meshConnectionList _connections;
 
 protected:
 
     // in easyMeshComm.cpp
     //must be accessable from callback
-    bool sendMessage(meshConnectionType *conn, uint32_t destId, meshPackageType type, String &msg);
+    sendStatusType sendMessage(meshConnectionType *conn, uint32_t destId, meshPackageType type, String &msg);
+
+    sendStatusType sendMessage(meshConnectionType *conn, uint32_t destId, uint32_t fromId, meshPackageType type, String &msg, uint16_t seq = PACKAGE_NO_SEQ, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendMessage(meshConnectionType *conn, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq = PACKAGE_NO_SEQ, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendMessage(uint32_t destId, meshPackageType type, String &msg, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType sendMessage(uint32_t destId, meshPackageType type, const uint8_t *payload, uint16_t length, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType broadcastMessage(uint32_t fromId, meshPackageType type, String &msg, meshConnectionType *exclude = NULL, uint16_t seq = PACKAGE_NO_SEQ, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType broadcastMessage(uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, meshConnectionType *exclude = NULL, uint16_t seq = PACKAGE_NO_SEQ, meshPriorityType priority = PRIORITY_NORMAL);
+
+    bool acceptFlooded(meshConnectionType *receiveConn, meshPackageHeader &header);
+
+    bool seenBroadcast(uint32_t fromId, uint16_t seq);
+
+    uint16_t nextBroadcastSeq(void);
+
+    sendStatusType forwardSingle(meshPackageHeader &header, uint8_t *package, uint16_t length);
+
+    static meshPriorityType packagePriority(meshPackageHeader &header);
+
+    static bool isControl(meshPackageType type);
+
+    sendStatusType sendEncoded(meshConnectionType *connection, uint16_t length, meshPriorityType priority);
+
+    sendStatusType sendPackage(meshConnectionType *connection, const uint8_t *package, uint16_t length, meshPriorityType priority = PRIORITY_NORMAL);
+
+    sendStatusType queuePackage(meshConnectionType *connection, const uint8_t *package, uint16_t length, meshPriorityType priority);
+
+    uint16_t encodePackage(meshConnectionType *conn, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq, meshPriorityType priority);
+
+    uint16_t buildMeshPackage(uint8_t *buf, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq = PACKAGE_NO_SEQ, meshPriorityType priority = PRIORITY_NORMAL);
 
-    bool sendMessage(uint32_t destId, meshPackageType type, String &msg);
+    uint16_t buildBinaryPackage(uint8_t *buf, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq = PACKAGE_NO_SEQ, meshPriorityType priority = PRIORITY_NORMAL);
 
-    bool broadcastMessage(uint32_t fromId, meshPackageType type, String &msg, meshConnectionType *exclude = NULL);
 
-    bool sendPackage(meshConnectionType *connection, String &package);
+    // in easyMeshStats.cpp
+    void handleStatsRequest(uint32_t fromId);
 
-    String buildMeshPackage(uint32_t destId, meshPackageType type, String &msg);
+    String statsJson(void);
 
+    void countSent(meshConnectionType *conn, uint16_t packages, uint16_t bytes);
+
+    void countReceived(meshConnectionType *conn, uint16_t bytes);
+
+    void countForwarded(meshConnectionType *conn);
+
+    void countSendError(meshConnectionType *conn);
+
+    void countParseError(meshConnectionType *conn);
+
+    void countQueued(meshConnectionType *conn);
 
     // in easyMeshSync.cpp
     //must be accessable from callback
     void startNodeSync(meshConnectionType *conn);
 
-    void handleNodeSync(meshConnectionType *conn, JsonObject &root);
+    void sendNodeSync(meshConnectionType *conn, meshPackageType type);
+
+    void handleNodeSync(meshConnectionType *conn, meshPackageHeader &header, String &subs, meshSyncInfo &sync);
+
+    void markStaleConnections(meshConnectionType *exclude);
 
     void startTimeSync(meshConnectionType *conn);
 
-    void handleTimeSync(meshConnectionType *conn, JsonObject &root);
+    void sendTimeStamp(meshConnectionType *conn);
+
+    void postponeTimeSync(meshConnectionType *conn);
+
+    void handleTimeSync(meshConnectionType *conn, String &timeStamp);
 
     bool adoptionCalc(meshConnectionType *conn);
 
+    void shiftNodeTimes(int32_t adjustment);
+
     // in easyMeshConnection.cpp
     void manageConnections(void);
 
-    String subConnectionJson(meshConnectionType *exclude);
+    void manageConnection(meshConnectionType *conn, uint32_t nodeTime);
+
+    uint32_t connectionDeadline(meshConnectionType *conn, uint32_t nodeTime);
+
+    void scheduleConnection(meshConnectionType *conn);
+
+    void sendPing(meshConnectionType *conn);
+
+    void handlePong(meshConnectionType *conn, String &msg);
+
+    void scheduleUpdate(uint32_t nodeTime);
+
+    void subConnectionJson(meshConnectionType *exclude, meshJsonWriter &out);
 
     meshConnectionType *findConnection(uint32_t chipId);
 
     meshConnectionType *findConnection(espconn *conn);
 
+    static meshConnectionType *connectionFor(espconn *conn);
+
+    static easyMesh *meshFor(espconn *conn);
+
     void cleanDeadConnections(void);
 
     void tcpConnect(void);
 
     bool connectToBestAP(void);
 
-    uint16_t jsonSubConnCount(String &subConns);
+    meshConnectionList::iterator closeConnection(meshConnectionType *conn);
+
+    void sendQueued(meshConnectionType *conn);
+
+    // in easyMeshDuty.cpp
+    void setLinkDuty(meshConnectionType *conn, uint32_t period, uint32_t window, uint32_t sleeperId);
+
+    bool linkDozing(meshConnectionType *conn, uint32_t nodeTime);
+
+    uint32_t linkWake(meshConnectionType *conn, uint32_t nodeTime);
+
+    uint32_t linkSleep(meshConnectionType *conn, uint32_t nodeTime);
+
+    uint32_t linkTimeout(meshConnectionType *conn);
+
+    void holdForWake(meshConnectionType *conn);
+
+    // in easyMeshRouting.cpp
+    meshRouteType *findRoute(uint32_t chipId);
+
+    bool addRoute(uint32_t chipId, uint32_t nextHop, uint8_t hops);
+
+    void eraseRoute(uint16_t i);
+
+    void removeRoutes(uint32_t nextHop);
+
+    uint8_t addTopologyNode(uint32_t chipId, uint32_t via, uint8_t parent, uint8_t hops);
+
+    uint16_t addSubTopology(JsonArray &subs, uint32_t via, uint8_t parent, uint8_t hops);
+
+    void removeTopology(uint32_t via);
 
-    meshConnectionType *closeConnection(meshConnectionType *conn);
+    void updateTopology(meshConnectionType *conn, String &subs);
+
+    void appendSubTopology(meshJsonWriter &out, uint8_t parent);
+
+    uint8_t findTopologyRoot(uint32_t chipId);
+
+    bool knownSink(uint32_t chipId);
 
     // in easyMeshSTA.cpp
     void manageStation(void);
 
+    meshConnectionType *stationConnection(void);
+
+    uint8_t hopCount(void);
+
+    uint8_t childCount(void);
+
+    void updateBeacon(void);
+
+    static void beaconIeCb(user_ie_type type, const uint8 sa[6], const uint8 m_oui[3], uint8 *ie, uint8 ie_len, sint32 rssi);
+
+    meshBeaconInfo *findBeacon(const uint8 *bssid);
+
+    int16_t parentScore(bss_info &ap);
+
+    bool parentFull(bss_info &ap);
+    bool biggerMesh(bss_info &ap, uint32_t apChipId);
+
+    void armRoamTimer(uint32_t interval = ROAM_INTERVAL);
+
+    static void roamTimerCallback(void *arg);
+
+    void evaluateRoam(void);
+
+    void loadParentCache(void);
+
+    void rememberParent(Event_StaMode_Connected_t &connected);
+
+    bool rejoinFromCache(void);
+
     // in ?
     static void stationScanCb(void *arg, STATUS status);
 
     static void scanTimerCallback(void *arg);
 
+    static void updateTimerCallback(void *arg);
+
     void stationInit(void);
 
     bool stationConnect(void);
 
-    void startStationScan(void);
+    bool startStationScan(uint8_t channel = 0);
 
+    // in easyMeshAP.cpp
     void apInit(void);
 
+    void apConfigure(void);
+
+    uint16_t apBeaconInterval(void);
+
+    uint8_t childLimit(void);
+
+    void assignSubnet(ip_info &uplink);
+
+    bool onApSubnet(const uint8 *ip);
+
     void tcpServerInit(espconn &serverConn, esp_tcp &serverTcp, espconn_connect_callback connectCb, uint32 port);
 
     // callbacks
@@ -190,12 +542,34 @@ protected:
 
     static void meshRecvCb(void *arg, char *data, unsigned short length);
 
+    void handlePackage(meshConnectionType *receiveConn, uint8_t *bytes, uint16_t length);
+
+    void deliverPackage(uint32_t from, const uint8_t *payload, uint16_t length, String &msg);
+
+    bool aggregateCandidate(meshConnectionType *receiveConn, meshPackageHeader &header);
+
+    bool absorbAggregate(meshConnectionType *receiveConn, meshPackageHeader &header, const uint8_t *payload, uint16_t length);
+
+    bool isFlooded(meshPackageHeader &header);
+
+    bool isRouted(meshPackageHeader &header);
+
     static void meshDisconCb(void *arg);
 
     static void meshReconCb(void *arg, sint8 err);
 
 
     // variables
+    static easyMesh *_instances[MESH_MAX_INSTANCES];    // for SDK callbacks that carry no connection
+    static easyMesh *_stationOwner;  // the mesh driving the station: wifi events and scan results go there
+
+    void (*_receivedCallback)(uint32_t from, String &msg) = NULL;
+    void (*_receivedBytesCallback)(uint32_t from, const uint8_t *data, uint16_t length) = NULL;
+    bool (*_aggregateCallback)(uint32_t from, const uint8_t *data, uint16_t length) = NULL;
+    void (*_newConnectionCallback)(bool adopt) = NULL;
+
+    meshClock _clock;
+
     uint32_t _chipId;
     String _mySSID;
     String _meshPrefix;
@@ -203,6 +577,45 @@ protected:
     uint16_t _meshPort;
 
     os_timer_t _scanTimer;
+    os_timer_t _roamTimer;      // same channel rescan for a better parent, see evaluateRoam()
+
+    SimpleList<meshBeaconInfo> _beacons;
+    uint8_t _uplinkHops = 0;    // hops our parent advertised
+    uint8_t _meshIE[MESH_IE_SIZE];  // the SDK keeps pointing at it
+    uint16_t _apSubnet = 0;     // the x.y of our AP's 10.x.y.0/24
+    uint16_t _apBeaconInterval = 0; // as last configured, 0 before apInit()
+    uint8_t _childLimit = MAX_CHILDREN;
+
+    meshParentCache _parentCache;
+    uint8_t _rejoinStep = 0;    // where rejoinFromCache() is: cached parents, then their channel, then all
+
+    os_timer_t _updateTimer;  // armed for the earliest connection deadline, see scheduleUpdate()
+    uint32_t _nextUpdate = 0;
+    bool _updateArmed = false;
+    uint32_t _recvTime = 0;     // node time meshRecvCb() was entered, the arrival time of timeSync stamps
+
+    uint16_t _sendQueueSize = SEND_QUEUE_SIZE;
+    dropPolicyType _dropPolicy = DROP_OLDEST;
+    uint32_t _queueDrops = 0;
+    bool _batching = true;
+    bool _sink = false;         // we collect sendToSink() traffic, advertised in every nodeSync
+    uint32_t _dutyPeriod = 0;   // us, see setDutyCycle(), 0 while we never sleep
+    uint32_t _dutyWindow = 0;
+    uint32_t _dutyOffset = 0;
+    uint8_t _sendBuffer[PACKAGE_MAX_SIZE];  // packages are encoded here, and meshSentCb() unpacks the send queue here
+
+    uint16_t _broadcastSeq = PACKAGE_NO_SEQ;  // last sequence number we sent a broadcast with
+    meshSeenType _seen[SEEN_CACHE_SIZE];
+    uint8_t _seenNext = 0;  // slot the next unseen broadcast overwrites
+
+    meshStats _stats;
+    void (*_statsCallback)(uint32_t from, String &stats) = NULL;
+
+    meshJsonArena _jsonArena;  // see easyMeshJson.h, parsing never allocates
+
+    meshRouteType _routes[ROUTE_TABLE_SIZE];
+    meshTopologyNode _topology[TOPOLOGY_POOL_SIZE];
+    uint16_t _topologySize = 0;
 
     espconn _meshServerConn;
     esp_tcp _meshServerTcp;
@@ -1,9 +1,6 @@
 #include <Arduino.h>
 
-extern "C" {
-#include "user_interface.h"
-#include "espconn.h"
-}
+#include "easyMeshPlatform.h"
 
 #include "easyMesh.h"
 
@@ -12,10 +9,28 @@ extern "C" {
  * Enforce WPA2-PSK auth and finally creates the TCP server.
  */
 void ICACHE_FLASH_ATTR easyMesh::apInit( void  ) {
+    // 16 bits of the chip id spread over x.y, only used until a parent assigns us one, see
+    // assignSubnet(); the root keeps it
+    _apSubnet = (uint16_t)((_chipId * 2654435761u) >> 16);
+    apConfigure();
+    updateBeacon();
+
+    // establish AP tcpServers
+    tcpServerInit(_meshServerConn, _meshServerTcp, meshConnectedCb, _meshPort);
+}
+
+/**
+ * (Re)applies the AP: our subnet, a beacon interval for our depth and a child limit for the
+ * heap we have. The SDK restarts the AP on any change, dropping its stations, so after
+ * apInit() this only runs while none are on it and when our subnet is our parent's.
+ */
+void ICACHE_FLASH_ATTR easyMesh::apConfigure( void ) {
     ip_addr ip, netmask;
-    IP4_ADDR(&ip, 192, 168, (_chipId & 0xFF), 1);
+    IP4_ADDR(&ip, AP_SUBNET_PREFIX, (_apSubnet >> 8), (_apSubnet & 0xFF), 1);
     IP4_ADDR(&netmask, 255, 255, 255, 0);
 
+    wifi_softap_dhcps_stop();   // the SDK refuses a new AP address while DHCP runs
+
     ip_info ipInfo;
     ipInfo.ip = ip;
     ipInfo.gw = ip;
@@ -24,7 +39,7 @@ void ICACHE_FLASH_ATTR easyMesh::apInit( void  ) {
         debugMsg(ERROR, "wifi_set_ip_info() failed\n");
     }
 
-    debugMsg(STARTUP, "apInit(): Starting AP with SSID=%s IP=%d.%d.%d.%d GW=%d.%d.%d.%d NM=%d.%d.%d.%d\n",
+    debugMsg(STARTUP, "apConfigure(): AP with SSID=%s IP=%d.%d.%d.%d GW=%d.%d.%d.%d NM=%d.%d.%d.%d\n",
              _mySSID.c_str(),
              IP2STR(&ipInfo.ip),
              IP2STR(&ipInfo.gw),
@@ -39,17 +54,83 @@ void ICACHE_FLASH_ATTR easyMesh::apInit( void  ) {
     memcpy(apConfig.password, _meshPassword.c_str(), _meshPassword.length());
     apConfig.authmode = AUTH_WPA2_PSK;
     apConfig.ssid_len = _mySSID.length();
-    apConfig.beacon_interval = 100;
-    apConfig.max_connection = 10;
+    bool first = _apBeaconInterval == 0;
+    _apBeaconInterval = apBeaconInterval();
+    _childLimit = childLimit();
+    apConfig.beacon_interval = _apBeaconInterval;
+    apConfig.max_connection = _childLimit;
+
+    debugMsg(STARTUP, "apConfigure(): beacon=%u TU children=%u\n", _apBeaconInterval, _childLimit);
 
-    wifi_softap_set_config(&apConfig);// Set ESP8266 softap config .
+    // only the first call is worth the flash write, later ones follow the tree at runtime
+    if (first)
+        wifi_softap_set_config(&apConfig);// Set ESP8266 softap config .
+    else
+        wifi_softap_set_config_current(&apConfig);
     if (!wifi_softap_dhcps_start())
         debugMsg(ERROR, "DHCP server failed\n");
     else
         debugMsg(STARTUP, "DHCP server started\n");
+}
 
-    // establish AP tcpServers
-    tcpServerInit(_meshServerConn, _meshServerTcp, meshConnectedCb, _meshPort);
+/**
+ * Beacon interval for our depth: the root and its neighbours beacon often so nodes find them
+ * fast, deeper nodes have fewer candidates and save the airtime and power.
+ */
+uint16_t ICACHE_FLASH_ATTR easyMesh::apBeaconInterval( void ) {
+    uint8_t hops = hopCount();
+    if (hops >= (AP_BEACON_MAX - AP_BEACON_MIN) / AP_BEACON_STEP)
+        return AP_BEACON_MAX;
+    return AP_BEACON_MIN + hops * AP_BEACON_STEP;
+}
+
+/**
+ * Children our heap carries: each one gets both send lanes, a receive buffer and the SDK's
+ * station state, on top of the children we already serve. Never more than MAX_CHILDREN,
+ * never less than one so the tree can always grow.
+ */
+uint8_t ICACHE_FLASH_ATTR easyMesh::childLimit( void ) {
+    uint32_t perChild = _sendQueueSize + PRIORITY_QUEUE_SIZE + RECV_BUFFER_SIZE + CHILD_HEAP_OVERHEAD;
+    uint32_t heap = system_get_free_heap_size();
+    uint32_t limit = childCount();
+    if (heap > CHILD_HEAP_RESERVE)
+        limit += (heap - CHILD_HEAP_RESERVE) / perChild;
+    if (limit < 1)
+        limit = 1;
+    return limit < MAX_CHILDREN ? limit : MAX_CHILDREN;
+}
+
+/**
+ * Takes our AP subnet from the lease our parent's DHCP gave us, one step of a full period
+ * congruential generator from the parent's x.y, with twice the host part of our address plus
+ * one as the increment. An odd increment never maps x.y onto itself, so we never end up on the
+ * parent's subnet; no two stations on one AP hold the same lease, so siblings never share one
+ * either; and down a chain of first leases the subnets only come round again after 65536 hops.
+ * Moving restarts the AP and drops every child, so with children attached we keep a subnet that
+ * still works. Only on the parent's own, where we could not route between the two, they are
+ * dropped; they rejoin on the new subnet and take theirs from it in turn.
+ */
+void ICACHE_FLASH_ATTR easyMesh::assignSubnet( ip_info &uplink ) {
+    uint8 *lease = (uint8 *)&uplink.ip;
+    uint16_t assigned = (uint16_t)(((lease[1] << 8) | lease[2]) * AP_SUBNET_SPREAD + 2 * lease[3] + 1);
+    if (assigned == _apSubnet)
+        return;
+
+    bool clash = onApSubnet(lease);
+    if (!clash && (childCount() > 0 || wifi_softap_get_station_num() > 0))
+        return;
+
+    debugMsg(CONNECTION, "assignSubnet(): moving our AP to %u.%u%s\n", assigned >> 8, assigned & 0xFF,
+             clash ? ", it was our parent's" : "");
+    _apSubnet = assigned;
+    apConfigure();
+}
+
+/**
+ * True if ip lies in the 10.x.y.0/24 our AP serves.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::onApSubnet( const uint8 *ip ) {
+    return ip[0] == AP_SUBNET_PREFIX && ip[1] == (_apSubnet >> 8) && ip[2] == (_apSubnet & 0xFF);
 }
 
 /**
@@ -61,6 +142,7 @@ void ICACHE_FLASH_ATTR easyMesh::tcpServerInit(espconn &serverConn, esp_tcp &ser
     debugMsg( GENERAL, "tcpServerInit():\n");
     
     serverConn.type = ESPCONN_TCP;
+    serverConn.reverse = NULL;
     serverConn.state = ESPCONN_NONE;
     serverConn.proto.tcp = &serverTcp;
     serverConn.proto.tcp->local_port = port;
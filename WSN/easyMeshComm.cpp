@@ -4,8 +4,6 @@
 
 #include "easyMesh.h"
 
-extern easyMesh* staticThis;
-
 /**
  * Sends a message to a specific node given a connection object and an destination ID.
  * @param type The mesh connection type.
@@ -13,12 +11,47 @@ extern easyMesh* staticThis;
  * @param type The mesh package type.
  * @param msg The message to be sent over the network to the other node.
  */
-bool ICACHE_FLASH_ATTR easyMesh::sendMessage(meshConnectionType *conn, uint32_t destId, meshPackageType type, String &msg) {
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendMessage(meshConnectionType *conn, uint32_t destId, meshPackageType type, String &msg) {
+    return sendMessage(conn, destId, _chipId, type, msg);
+}
+
+/**
+ * Sends a message on behalf of another node, in whatever format the connection speaks.
+ * @param conn The connection to send it on.
+ * @param destId The destination id of the mesh node.
+ * @param fromId The node the message originates from.
+ * @param type The mesh package type.
+ * @param msg The message to be sent over the network to the other node.
+ * @param seq The origin's broadcast sequence number, PACKAGE_NO_SEQ for none.
+ * @param priority PRIORITY_HIGH marks an application message urgent, control types always are.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendMessage(meshConnectionType *conn, uint32_t destId, uint32_t fromId, meshPackageType type, String &msg, uint16_t seq, meshPriorityType priority) {
     debugMsg(COMMUNICATION, "sendMessage(conn): conn-chipId=%d destId=%d type=%d msg=%s\n",
              conn->chipId, destId, (uint8_t) type, msg.c_str());
 
-    String package = buildMeshPackage(destId, type, msg);
-    return sendPackage(conn, package);
+    return sendMessage(conn, destId, fromId, type, (const uint8_t *) msg.c_str(), msg.length(), seq, priority);
+}
+
+/**
+ * Sends a byte payload on behalf of another node. Binary connections copy it straight behind
+ * the header; on JSON connections it goes as text, or base64 encoded if it contains NUL,
+ * see buildMeshPackage(). Either way it is encoded into _sendBuffer, sendPackage() copies it
+ * on into espconn or the send queue.
+ * @param conn The connection to send it on.
+ * @param destId The destination id of the mesh node.
+ * @param fromId The node the message originates from.
+ * @param type The mesh package type.
+ * @param payload The payload bytes.
+ * @param length The payload length.
+ * @param seq The origin's broadcast sequence number, PACKAGE_NO_SEQ for none.
+ * @param priority PRIORITY_HIGH marks an application message urgent, control types always are.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendMessage(meshConnectionType *conn, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq, meshPriorityType priority) {
+    debugMsg(COMMUNICATION, "sendMessage(conn): conn-chipId=%d destId=%d type=%d length=%d\n",
+             conn->chipId, destId, (uint8_t) type, length);
+
+    meshPriorityType lane = isControl(type) ? PRIORITY_HIGH : priority;
+    return sendEncoded(conn, encodePackage(conn, destId, fromId, type, payload, length, seq, priority), lane);
 }
 
 /**
@@ -26,110 +59,388 @@ bool ICACHE_FLASH_ATTR easyMesh::sendMessage(meshConnectionType *conn, uint32_t
  * @param destId The destination id of the mesh node.
  * @param type The mesh package type.
  * @param msg The message to be sent over the network to the other node.
+ * @param priority PRIORITY_HIGH to have it overtake queued application data on every hop.
  */
-bool ICACHE_FLASH_ATTR easyMesh::sendMessage(uint32_t destId, meshPackageType type, String &msg) {
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendMessage(uint32_t destId, meshPackageType type, String &msg, meshPriorityType priority) {
     debugMsg(COMMUNICATION, "In sendMessage(destId): destId=%d type=%d, msg=%s\n",
              destId, type, msg.c_str());
 
     meshConnectionType * conn = findConnection(destId);
     if (conn != NULL) {
-        return sendMessage(conn, destId, type, msg);
+        return sendMessage(conn, destId, _chipId, type, msg, PACKAGE_NO_SEQ, priority);
     } else {
         debugMsg(ERROR, "In sendMessage(destId): findConnection( destId ) failed\n");
-        return false;
+        return SEND_NO_ROUTE;
     }
 }
 
 /**
- * Sends a message to every node in the network.
- * @param from The sender of
+ * Sends a byte payload to a specific node given a destination ID.
+ * @param destId The destination id of the mesh node.
  * @param type The mesh package type.
- * @param msg The message to be sent over the network to the other node.
- * @param exclude The types to exclude from the broadcast.
+ * @param payload The payload bytes.
+ * @param length The payload length.
+ * @param priority PRIORITY_HIGH to have it overtake queued application data on every hop.
  */
-bool ICACHE_FLASH_ATTR easyMesh::broadcastMessage(uint32_t from,
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendMessage(uint32_t destId, meshPackageType type, const uint8_t *payload, uint16_t length, meshPriorityType priority) {
+    debugMsg(COMMUNICATION, "In sendMessage(destId): destId=%d type=%d, length=%d\n",
+             destId, type, length);
+
+    meshConnectionType * conn = findConnection(destId);
+    if (conn != NULL) {
+        return sendMessage(conn, destId, _chipId, type, payload, length, PACKAGE_NO_SEQ, priority);
+    } else {
+        debugMsg(ERROR, "In sendMessage(destId): findConnection( destId ) failed\n");
+        return SEND_NO_ROUTE;
+    }
+}
+
+/**
+ * Sends a text message to every node in the network, see the byte payload version.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::broadcastMessage(uint32_t from,
                                 meshPackageType type,
                                 String &msg,
-                                meshConnectionType *exclude ) {
+                                meshConnectionType *exclude,
+                                uint16_t seq,
+                                meshPriorityType priority ) {
+    return broadcastMessage( from, type, (const uint8_t *) msg.c_str(), msg.length(), exclude, seq, priority );
+}
+
+/**
+ * Sends a message to every node in the network. Broadcasts carry dest 0.
+ * The package is encoded into _sendBuffer again for every connection: sending the previous
+ * one may have reused it for the send queue, and encoding costs no more than a copy would.
+ * @param from The node the broadcast originates from, kept when we relay it.
+ * @param type The mesh package type.
+ * @param payload The payload bytes, a relayed one is a view into the received package.
+ * @param length The payload length.
+ * @param exclude The connection the broadcast came in on, NULL for our own.
+ * @param seq The origin's sequence number, lets every node drop copies it has already seen.
+ * @param priority PRIORITY_HIGH for an urgent broadcast.
+ * @return The worst status of all connections, SEND_NO_ROUTE if there was nobody to send to.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::broadcastMessage(uint32_t from,
+                                meshPackageType type,
+                                const uint8_t *payload,
+                                uint16_t length,
+                                meshConnectionType *exclude,
+                                uint16_t seq,
+                                meshPriorityType priority ) {
+    if ( seq != PACKAGE_NO_SEQ && from == _chipId )
+        seenBroadcast( from, seq );  // so our own broadcast coming back around a loop is dropped
 
     if ( exclude != NULL )
-        debugMsg( COMMUNICATION, "broadcastMessage(): from=%d type=%d, msg=%s exclude=%d\n",
-                   from, type, msg.c_str(), exclude->chipId);
+        debugMsg( COMMUNICATION, "broadcastMessage(): from=%d type=%d, length=%d exclude=%d\n",
+                   from, type, length, exclude->chipId);
     else
-        debugMsg( COMMUNICATION, "broadcastMessage(): from=%d type=%d, msg=%s exclude=NULL\n",
-                   from, type, msg.c_str());
+        debugMsg( COMMUNICATION, "broadcastMessage(): from=%d type=%d, length=%d exclude=NULL\n",
+                   from, type, length);
 
-    SimpleList<meshConnectionType>::iterator connection = _connections.begin();
+    sendStatusType ret = SEND_NO_ROUTE;
+    bool sent = false;
+
+    meshConnectionList::iterator connection = _connections.begin();
     while ( connection != _connections.end() ) {
         if ( connection != exclude ) {
-            sendMessage( connection, connection->chipId, type, msg );
+            sendStatusType status = sendEncoded( connection, encodePackage( connection, 0, from, type, payload, length, seq, priority ), priority );
+
+            if ( exclude != NULL && status < SEND_QUEUE_FULL )  // relaying someone else's broadcast
+                countForwarded( connection );
+            if ( !sent || status > ret )
+                ret = status;
+            sent = true;
         }
         connection++;
     }
+    return ret;
+}
+
+/**
+ * Decides whether a flooded package (BROADCAST, mesh wide STATS_REQUEST) is handled and relayed.
+ * Reverse path check: the mesh is a tree, so a copy that did not come from our next hop towards
+ * its origin came around a loop (two links formed during churn). Only the copy on the tree path
+ * is accepted, which makes every node receive and relay each broadcast once. Copies on the tree
+ * path that were seen already are dropped through the seen cache.
+ * @param receiveConn The connection the package came in on.
+ * @param header Its routing header.
+ * @return False if the package must be dropped.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::acceptFlooded(meshConnectionType *receiveConn, meshPackageHeader &header) {
+    meshRouteType *route = findRoute(header.from);
+    if (route != NULL && receiveConn->chipId != 0 && route->nextHop != receiveConn->chipId) {
+        debugMsg(COMMUNICATION, "acceptFlooded(): broadcast from=%u off the tree path via %u dropped\n", header.from, receiveConn->chipId);
+        return false;
+    }
+
+    if ((header.flags & PACKAGE_FLAG_SEQ) && seenBroadcast(header.from, header.seq)) {
+        debugMsg(COMMUNICATION, "acceptFlooded(): duplicate broadcast from=%u seq=%d dropped\n", header.from, header.seq);
+        return false;
+    }
     return true;
 }
 
 /**
- * Send a package to a specific connection.
+ * Checks a broadcast against the recently seen cache and remembers it if it is new.
+ * The cache is a small ring, so the oldest entry is the one that gets replaced.
+ * @param fromId The node the broadcast originates from.
+ * @param seq Its sequence number.
+ * @return True if we have seen this broadcast before and it must be dropped.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::seenBroadcast(uint32_t fromId, uint16_t seq) {
+    for (uint8_t i = 0; i < SEEN_CACHE_SIZE; i++) {
+        if (_seen[i].from == fromId && _seen[i].seq == seq)
+            return true;
+    }
+
+    _seen[_seenNext].from = fromId;
+    _seen[_seenNext].seq = seq;
+    _seenNext = (_seenNext + 1) % SEEN_CACHE_SIZE;
+    return false;
+}
+
+/**
+ * Returns the sequence number for the next broadcast we originate, never PACKAGE_NO_SEQ.
+ */
+uint16_t ICACHE_FLASH_ATTR easyMesh::nextBroadcastSeq(void) {
+    if (++_broadcastSeq == PACKAGE_NO_SEQ)
+        _broadcastSeq++;
+    return _broadcastSeq;
+}
+
+/**
+ * Passes a routed package (SINGLE, STATS_REQUEST or STATS_REPLY) that is not for us on towards its destination.
+ * Only the routing header has been read; the payload is neither parsed nor copied unless
+ * the next hop is an older node that needs the package re-encoded as JSON.
+ * @param header The decoded routing header.
+ * @param package The package exactly as it was received.
+ * @param length The package length in bytes.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::forwardSingle(meshPackageHeader &header, uint8_t *package, uint16_t length) {
+    meshConnectionType *nextConn = findConnection(header.dest);
+    if (nextConn == NULL) {
+        debugMsg(ERROR, "forwardSingle(): no route to %u, dropping\n", header.dest);
+        return SEND_NO_ROUTE;
+    }
+
+    sendStatusType status;
+    meshPriorityType priority = packagePriority(header);
+    if (isBinaryPackage(package, length) && nextConn->wireFormat != WIRE_BINARY) {
+        uint16_t jsonLength = buildMeshPackage(_sendBuffer, header.dest, header.from, (meshPackageType)header.type,
+                                               package + packageHeaderSize(header), header.length, PACKAGE_NO_SEQ, priority);
+        status = sendEncoded(nextConn, jsonLength, priority);
+    } else {
+        status = sendPackage(nextConn, package, length, priority);  // JSON is understood by everyone
+    }
+
+    if (status < SEND_QUEUE_FULL)
+        countForwarded(nextConn);
+    return status;
+}
+
+/**
+ * The lane a received package travels on when we pass it along.
+ */
+meshPriorityType ICACHE_FLASH_ATTR easyMesh::packagePriority(meshPackageHeader &header) {
+    if (isControl((meshPackageType)header.type) || (header.flags & PACKAGE_FLAG_URGENT))
+        return PRIORITY_HIGH;
+    return PRIORITY_NORMAL;
+}
+
+/**
+ * True for the package types that keep the mesh itself running. They always take the high lane,
+ * a TIME_SYNC stuck behind application data would no longer measure the link.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::isControl(meshPackageType type) {
+    return type == NODE_SYNC_REQUEST || type == NODE_SYNC_REPLY || type == TIME_SYNC ||
+           type == PING || type == PONG;
+}
+
+/**
+ * Sends the package just encoded into _sendBuffer.
  * @param connection The connection via which the package will be sent.
- * @param package The package to send.
+ * @param length Its length, 0 if it did not fit in PACKAGE_MAX_SIZE.
+ * @param priority The lane it waits in if the connection is busy.
  */
-bool ICACHE_FLASH_ATTR easyMesh::sendPackage(meshConnectionType *connection, String &package) {
-    debugMsg(COMMUNICATION, "Sending to %d-->%s<--\n", connection->chipId, package.c_str());
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendEncoded(meshConnectionType *connection, uint16_t length, meshPriorityType priority) {
+    if (length == 0) {
+        debugMsg(ERROR, "sendEncoded(): err package longer than %d\n", PACKAGE_MAX_SIZE);
+        return SEND_TOO_LONG;
+    }
+    return sendPackage(connection, _sendBuffer, length, priority);
+}
 
-    if (package.length() > 1400)
-        debugMsg(ERROR, "sendPackage(): err package too long length=%d\n", package.length());
+/**
+ * Send an encoded package (JSON or binary) to a specific connection.
+ * It only goes out directly while nothing waits in the send lanes. Otherwise it is queued behind
+ * what waits there, until meshSentCb() if the connection is busy with the previous package, or
+ * until the next wake window while the far end of a duty cycled link sleeps.
+ * @param connection The connection via which the package will be sent.
+ * @param package The encoded package.
+ * @param length The package length in bytes.
+ * @param priority The lane it waits in if the connection is busy.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::sendPackage(meshConnectionType *connection, const uint8_t *package, uint16_t length, meshPriorityType priority) {
+    if (length > PACKAGE_MAX_SIZE) {
+        debugMsg(ERROR, "sendPackage(): err package too long length=%d\n", length);
+        return SEND_TOO_LONG;
+    }
 
-    if (connection->sendReady) {
-        sint8 errCode = espconn_send(connection->esp_conn, (uint8 *) package.c_str(), package.length());
-        connection->sendReady = false;
+    if (connection->sendReady && connection->sendQueue.empty() && !linkDozing(connection, getNodeTime())) {
+        sint8 errCode = espconn_send(connection->esp_conn, (uint8 *) package, length);
 
         if (errCode == 0) {
-            return true;
+            connection->sendReady = false;  // until meshSentCb()
+            countSent(connection, 1, length);
+            return SEND_OK;
         } else {
             debugMsg(ERROR, "sendPackage(): espconn_send Failed err=%d\n", errCode);
-            return false;
+            countSendError(connection);
+            return SEND_ERROR;
         }
-    } else {
-        connection->sendQueue.push_back(package);
     }
+    // packages held for a wake window go first, sendQueued() holds them on if it is still closed
+    sendStatusType status = queuePackage(connection, package, length, priority);
+    if (connection->sendReady)
+        sendQueued(connection);
+    return status;
+}
+
+/**
+ * Puts a package in one of the connection's send lanes, applying the drop policy when it is full.
+ * A high priority package that finds its lane full waits in the normal lane instead, it is
+ * still sent, only without overtaking.
+ * @param connection The connection the package is waiting for.
+ * @param package The encoded package.
+ * @param length The package length in bytes.
+ * @param priority The lane to queue it in.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::queuePackage(meshConnectionType *connection, const uint8_t *package, uint16_t length, meshPriorityType priority) {
+    if (priority == PRIORITY_HIGH && connection->sendQueue.lane(PRIORITY_HIGH).push(package, length)) {
+        countQueued(connection);
+        return SEND_QUEUED;
+    }
+
+    meshSendQueue &queue = connection->sendQueue.lane(PRIORITY_NORMAL);
+    if (queue.push(package, length)) {
+        countQueued(connection);
+        return SEND_QUEUED;
+    }
+
+    if (_dropPolicy == DROP_NEWEST || (int)length + QUEUE_LENGTH_SIZE > queue.size()) {
+        debugMsg(COMMUNICATION, "queuePackage(): queue to %u full, dropping new package\n", connection->chipId);
+        connection->queueDrops++;
+        _queueDrops++;
+        return SEND_QUEUE_FULL;
+    }
+
+    while (!queue.fits(length) && queue.dropOldest()) {
+        connection->queueDrops++;
+        _queueDrops++;
+    }
+    debugMsg(COMMUNICATION, "queuePackage(): queue to %u full, dropped oldest packages\n", connection->chipId);
+
+    queue.push(package, length);
+    countQueued(connection);
+    return SEND_QUEUED_DROPPED;
 }
 
+/**
+ * Sets the send queue capacity and what to do once it is full.
+ * The size applies to connections made after the call, so call it before init().
+ * @param size Bytes per connection for the normal lane, at least PACKAGE_MAX_SIZE + QUEUE_LENGTH_SIZE.
+ * The high lane always gets PRIORITY_QUEUE_SIZE on top.
+ * @param policy DROP_OLDEST or DROP_NEWEST.
+ */
+void ICACHE_FLASH_ATTR easyMesh::setSendQueue(uint16_t size, dropPolicyType policy) {
+    if (size < PACKAGE_MAX_SIZE + QUEUE_LENGTH_SIZE) {
+        debugMsg(ERROR, "setSendQueue(): size=%d can not hold a full package\n", size);
+        size = PACKAGE_MAX_SIZE + QUEUE_LENGTH_SIZE;
+    }
+    _sendQueueSize = size;
+    _dropPolicy = policy;
+}
+
+
+/**
+ * Encodes a package into _sendBuffer in the wire format of the connection.
+ * @return The package length, 0 if it does not fit in PACKAGE_MAX_SIZE.
+ */
+uint16_t ICACHE_FLASH_ATTR easyMesh::encodePackage( meshConnectionType *conn, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq, meshPriorityType priority ) {
+    if ( conn->wireFormat == WIRE_BINARY )
+        return buildBinaryPackage( _sendBuffer, destId, fromId, type, payload, length, seq, priority );
+    return buildMeshPackage( _sendBuffer, destId, fromId, type, payload, length, seq, priority );
+}
 
 /**
- * Creates a package for a specific node in the mesh network.
+ * Creates a JSON package for a specific node in the mesh network.
+ * Used for nodes that have not (yet) advertised the binary wire format. A JSON string ends at
+ * the first NUL, so a payload containing one goes base64 encoded under "bin", which
+ * handlePackage() decodes again; any other payload goes as plain "msg" text, which older
+ * nodes understand as well. A time stamp is JSON already and goes in as it is.
+ * @param buf Receives the package, PACKAGE_MAX_SIZE bytes.
  * @param destId The ID of the destination node.
+ * @param fromId The ID of the node the package originates from.
  * @param type The mesh package type of the package.
- * @param msg The message to be sent in the package.
- */
-String ICACHE_FLASH_ATTR easyMesh::buildMeshPackage( uint32_t destId, meshPackageType type, String &msg ) {
-    debugMsg( GENERAL, "In buildMeshPackage(): msg=%s\n", msg.c_str() );
-
-    DynamicJsonBuffer jsonBuffer( JSON_BUFSIZE );
-    JsonObject& root = jsonBuffer.createObject();
-    root["dest"] = destId;
-    root["from"] = _chipId;
-    root["type"] = (uint8_t)type;
-
-    switch( type ) {
-        case NODE_SYNC_REQUEST:
-        case NODE_SYNC_REPLY:
-        {
-            JsonArray& subs = jsonBuffer.parseArray( msg );
-            if ( !subs.success() ) {
-                debugMsg( GENERAL, "buildMeshPackage(): subs = jsonBuffer.parseArray( msg ) failed!");
-            }
-            root["subs"] = subs;
-            break;
-        }
-        case TIME_SYNC:
-            root["msg"] = jsonBuffer.parseObject( msg );
-            break;
-        default:
-            root["msg"] = msg;
+ * @param payload The payload bytes, not NUL terminated.
+ * @param length The payload length.
+ * @param seq Broadcast sequence number, written right after type so peekJsonHeader() finds it.
+ * @param priority PRIORITY_HIGH adds the "urgent" key for application packages.
+ * @return The package length, 0 if it does not fit.
+ */
+uint16_t ICACHE_FLASH_ATTR easyMesh::buildMeshPackage( uint8_t *buf, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq, meshPriorityType priority ) {
+    debugMsg( GENERAL, "In buildMeshPackage(): length=%d\n", length );
+
+    meshJsonWriter out( buf, PACKAGE_MAX_SIZE );
+    out.number( "dest", destId );
+    out.number( "from", fromId );
+    out.number( "type", (uint8_t)type );
+    if ( seq != PACKAGE_NO_SEQ )
+        out.number( "seq", seq );
+    if ( priority == PRIORITY_HIGH && !isControl( type ) )
+        out.number( "urgent", 1 );
+
+    if ( type == TIME_SYNC )
+        out.raw( "msg", payload, length );  // built by buildTimeStamp()
+    else if ( payloadIsText( payload, length ) )
+        out.text( "msg", payload, length );
+    else
+        out.base64( "bin", payload, length );
+    return out.finish();
+}
+
+/**
+ * Creates a binary package: a meshPackageHeader followed by the payload as raw bytes.
+ * @param buf Receives the package, PACKAGE_MAX_SIZE bytes.
+ * @param destId The ID of the destination node.
+ * @param fromId The ID of the node the package originates from.
+ * @param type The mesh package type of the package.
+ * @param payload The payload bytes.
+ * @param length The payload length.
+ * @param seq Broadcast sequence number, PACKAGE_NO_SEQ leaves it out of the header.
+ * @param priority PRIORITY_HIGH sets PACKAGE_FLAG_URGENT for application packages.
+ * @return The package length, 0 if it does not fit.
+ */
+uint16_t ICACHE_FLASH_ATTR easyMesh::buildBinaryPackage( uint8_t *buf, uint32_t destId, uint32_t fromId, meshPackageType type, const uint8_t *payload, uint16_t length, uint16_t seq, meshPriorityType priority ) {
+    debugMsg( GENERAL, "In buildBinaryPackage(): length=%d\n", length );
+
+    meshPackageHeader header;
+    header.type = (uint8_t)type;
+    header.from = fromId;
+    header.dest = destId;
+    header.length = length;
+    if ( seq != PACKAGE_NO_SEQ ) {
+        header.flags |= PACKAGE_FLAG_SEQ;
+        header.seq = seq;
     }
+    if ( priority == PRIORITY_HIGH && !isControl( type ) )
+        header.flags |= PACKAGE_FLAG_URGENT;
 
-    String ret;
-    root.printTo( ret );
-    return ret;
+    uint16_t headerSize = packageHeaderSize( header );
+    if ( headerSize + length > PACKAGE_MAX_SIZE )
+        return 0;
+
+    encodePackageHeader( buf, header );
+    memcpy( buf + headerSize, payload, length );
+    return headerSize + length;
 }
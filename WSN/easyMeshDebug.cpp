@@ -3,7 +3,7 @@
 
 #include "easyMesh.h"
 
-uint16_t types = 0;
+uint16_t meshDebugTypes = 0;
 
 /**
  * Set the different kinds of debug messages you want to generate.
@@ -12,30 +12,31 @@ uint16_t types = 0;
  */
 
 void easyMesh::setDebugMsgTypes(uint16_t newTypes) {
-    types = newTypes;
-    Serial.printf("setDebugTypes 0x%x\n", types);
+    meshDebugTypes = newTypes;
+    Serial.printf("setDebugTypes 0x%x\n", meshDebugTypes);
+    if ((newTypes & DEBUG_MSG_TYPES) != newTypes)
+        Serial.printf("setDebugTypes 0x%x not compiled in, see DEBUG_MSG_TYPES\n", newTypes & ~(DEBUG_MSG_TYPES));
 }
 
 /**
- *
+ * Prints a debug message. Called through the debugMsg() macro, which has already checked
+ * the type against the compiled in and runtime masks.
  * @param type The type of the message to be desplayed (see above).
  * @param format The message to be desplayed.
  */
-void easyMesh::debugMsg(debugType type, const char *format ...) {
-    if (type & types) {  //Print only the message types set for output
-        char str[200];
+void easyMesh::debugOut(debugType type, const char *format ...) {
+    char str[200];
 
-        va_list args;
-        va_start(args, format);
+    va_list args;
+    va_start(args, format);
 
-        vsnprintf(str, sizeof(str), format, args);
+    vsnprintf(str, sizeof(str), format, args);
 
-        if (types && MSG_TYPES)
-            Serial.printf("0x%x\t", type, types);
+    if (meshDebugTypes & MSG_TYPES)
+        Serial.printf("0x%x\t", type);
 
-        Serial.print(str);
+    Serial.print(str);
 
-        va_end(args);
-    }
+    va_end(args);
 }
 
@@ -0,0 +1,136 @@
+#include <Arduino.h>
+
+#include "easyMeshPlatform.h"
+
+#include "easyMesh.h"
+
+/**
+ * Puts a leaf node on a duty cycle: it is awake for window us at the start of every period us
+ * of mesh time and light-sleeps in between. What it sends outside its window waits in the
+ * send queue, and its parent holds what goes down to it the same way, so both ends exchange
+ * their queues when the window opens. The window starts at our chip id modulo period, which
+ * the parent works out from the mesh time it shares with us, and spreads siblings apart.
+ * Only leaves sleep: the AP is switched off, which also lets the SDK light-sleep the station.
+ * Call it after init(), every answer is only as late as the next window.
+ * @param period us between two windows, 0 to stay awake and bring the AP back.
+ * @param window us awake per period, less than period.
+ */
+void ICACHE_FLASH_ATTR easyMesh::setDutyCycle( uint32_t period, uint32_t window ) {
+    debugMsg( GENERAL, "setDutyCycle(): period=%u window=%u\n", period, window );
+    if ( period != 0 && ( window == 0 || window >= period ) ) {
+        debugMsg( ERROR, "setDutyCycle(): window has to be shorter than the period\n" );
+        return;
+    }
+    if ( period != 0 && _dutyPeriod == 0 && childCount() > 0 ) {
+        debugMsg( ERROR, "setDutyCycle(): only a leaf can sleep, we have children\n" );
+        return;
+    }
+
+    bool wasSleeping = _dutyPeriod != 0;
+    _dutyPeriod = period;
+    _dutyWindow = window;
+    _dutyOffset = period != 0 ? _chipId % period : 0;
+
+    if ( period != 0 ) {
+        os_timer_disarm( &_roamTimer );  // a scan costs more than a better parent saves
+        wifi_set_opmode_current( STATION_MODE );
+        wifi_set_sleep_type( LIGHT_SLEEP_T );
+    } else if ( wasSleeping ) {
+        wifi_set_sleep_type( MODEM_SLEEP_T );  // the SDK default
+        wifi_set_opmode_current( STATIONAP_MODE );
+        apConfigure();
+        updateBeacon();
+        if ( stationConnection() != NULL )
+            armRoamTimer();
+    }
+
+    meshConnectionType *uplink = stationConnection();
+    if ( uplink != NULL ) {
+        setLinkDuty( uplink, _dutyPeriod, _dutyWindow, _chipId );
+        uplink->nodeSyncStatus = NEEDED;  // the schedule travels with nodeSync
+        scheduleConnection( uplink );
+    }
+}
+
+/**
+ * Microseconds until our next wake window, 0 while we are in one or do not sleep.
+ * The sketch can light-sleep for that long, see setDutyCycle().
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::timeToNextWake( void ) {
+    if ( _dutyPeriod == 0 )
+        return 0;
+
+    uint32_t phase = ( getNodeTime() - _dutyOffset ) % _dutyPeriod;
+    return phase < _dutyWindow ? 0 : _dutyPeriod - phase;
+}
+
+/**
+ * Sets the schedule the sleeping end of conn follows, on both ends of the link.
+ * @param conn The connection.
+ * @param period As in setDutyCycle(), 0 if neither end sleeps.
+ * @param window As in setDutyCycle().
+ * @param sleeperId Chip id of the node that sleeps, its window starts there in the period.
+ */
+void ICACHE_FLASH_ATTR easyMesh::setLinkDuty( meshConnectionType *conn, uint32_t period, uint32_t window, uint32_t sleeperId ) {
+    if ( period != 0 && ( window == 0 || window >= period ) )
+        period = 0;  // nonsense from the peer, treat it as always awake
+
+    conn->dutyPeriod = period;
+    conn->dutyWindow = period != 0 ? window : 0;
+    conn->dutyOffset = period != 0 ? sleeperId % period : 0;
+}
+
+/**
+ * True if the sleeping end of conn is outside its wake window at nodeTime. Both ends compute
+ * this from the shared mesh time, so they agree on the windows; a 32 bit wrap of the node
+ * time shortens one period, on both ends alike. Before the first time sync the two ends need
+ * not share a timebase yet and the windows would not meet, so the link counts as awake.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::linkDozing( meshConnectionType *conn, uint32_t nodeTime ) {
+    if ( conn->dutyPeriod == 0 || conn->lastTimeSync == 0 )
+        return false;
+
+    return ( nodeTime - conn->dutyOffset ) % conn->dutyPeriod >= conn->dutyWindow;
+}
+
+/**
+ * Node time the next wake window of conn opens, nodeTime if it is open already.
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::linkWake( meshConnectionType *conn, uint32_t nodeTime ) {
+    if ( !linkDozing( conn, nodeTime ) )
+        return nodeTime;
+
+    uint32_t phase = ( nodeTime - conn->dutyOffset ) % conn->dutyPeriod;
+    return nodeTime + conn->dutyPeriod - phase;
+}
+
+/**
+ * Node time the wake window of conn open at nodeTime closes, nodeTime if it is closed already.
+ * Only for a link with a sleeping end, on the others the window never closes.
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::linkSleep( meshConnectionType *conn, uint32_t nodeTime ) {
+    if ( linkDozing( conn, nodeTime ) )
+        return nodeTime;
+
+    uint32_t phase = ( nodeTime - conn->dutyOffset ) % conn->dutyPeriod;
+    return nodeTime + conn->dutyWindow - phase;
+}
+
+/**
+ * How long conn may stay silent before it is dropped: a sleeper is heard at most once a period,
+ * and the keepalive PING due halfway through may wait up to another one for a wake window.
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::linkTimeout( meshConnectionType *conn ) {
+    return NODE_TIMEOUT + 2 * conn->dutyPeriod;
+}
+
+/**
+ * Makes sure the update pass looks at conn again when its next wake window opens, where
+ * manageConnections() sends what the queue held meanwhile.
+ */
+void ICACHE_FLASH_ATTR easyMesh::holdForWake( meshConnectionType *conn ) {
+    uint32_t wake = linkWake( conn, getNodeTime() );
+    if ( (int32_t)( wake - conn->nextCheck ) < 0 )
+        conn->nextCheck = wake;
+    scheduleUpdate( wake );
+}
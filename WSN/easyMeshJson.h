@@ -0,0 +1,59 @@
+#ifndef   _MESH_JSON_H_
+#define   _MESH_JSON_H_
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+
+#ifndef JSON_ARENA_SIZE
+#define JSON_ARENA_SIZE     3072    // bytes for parsing one package or subs array, enough for ~60 nodes
+#endif
+#define JSON_NESTING_LIMIT  34      // a package with subs 16 hops deep, two levels a hop; the parser recurses per level
+
+/**
+ * One fixed JSON buffer, part of the mesh object, shared by everything that parses a
+ * variable sized package. Replaces a DynamicJsonBuffer per call, whose blocks fragmented the heap.
+ * Only one user at a time may hold it; acquire() returns NULL instead of handing out a buffer
+ * that is still in use further up the stack.
+ */
+class meshJsonArena {
+public:
+    StaticJsonBufferBase *acquire(void) {
+        noInterrupts();
+        bool wasBusy = _busy;
+        _busy = true;
+        interrupts();
+
+        if ( wasBusy )
+            return NULL;
+        _buffer.clear();
+        return &_buffer;
+    };
+
+    void release(void) { _busy = false; };
+
+    bool busy(void) { return _busy; };
+
+protected:
+    StaticJsonBuffer<JSON_ARENA_SIZE> _buffer;
+    volatile bool _busy = false;
+};
+
+/**
+ * Holds the arena for the lifetime of a scope. Check buffer for NULL before use.
+ */
+class meshJsonLease {
+public:
+    meshJsonLease(meshJsonArena &arena) : buffer( arena.acquire() ), _arena( arena ) {};
+
+    ~meshJsonLease(void) {
+        if ( buffer != NULL )
+            _arena.release();
+    };
+
+    StaticJsonBufferBase *buffer;
+
+protected:
+    meshJsonArena &_arena;
+};
+
+#endif //   _MESH_JSON_H_
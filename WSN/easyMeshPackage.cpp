@@ -0,0 +1,448 @@
+#include <Arduino.h>
+
+#include "easyMeshPackage.h"
+
+static const char base64Chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+meshJsonWriter::meshJsonWriter( uint8_t *buf, uint16_t size ) : _buf( buf ), _size( size ) {}
+
+/**
+ * Starts the next member: the opening brace before the first one, a comma before any other.
+ */
+void ICACHE_FLASH_ATTR meshJsonWriter::key( const char *name ) {
+    put( _used == 0 ? '{' : ',' );
+    put( '"' );
+    append( name );
+    put( '"' );
+    put( ':' );
+}
+
+void ICACHE_FLASH_ATTR meshJsonWriter::number( const char *name, uint32_t value ) {
+    key( name );
+    append( value );
+}
+
+/**
+ * A member whose value is JSON already, like the subs or a time stamp.
+ */
+void ICACHE_FLASH_ATTR meshJsonWriter::raw( const char *name, const uint8_t *json, uint16_t length ) {
+    key( name );
+    append( json, length );
+}
+
+/**
+ * A string member, escaped like ArduinoJson does: quote, backslash and the five control
+ * characters with a short escape, everything else as it is.
+ */
+void ICACHE_FLASH_ATTR meshJsonWriter::text( const char *name, const uint8_t *str, uint16_t length ) {
+    static const char escapes[] = "\"\"\\\\b\bf\fn\nr\rt\t";
+    key( name );
+    put( '"' );
+    for ( uint16_t i = 0; i < length; i++ ) {
+        const char *e = escapes;
+        while ( e[0] != '\0' && e[1] != (char)str[i] )
+            e += 2;
+        if ( e[0] != '\0' ) {
+            put( '\\' );
+            put( e[0] );
+        } else {
+            put( str[i] );
+        }
+    }
+    put( '"' );
+}
+
+/**
+ * A string member holding bytes base64 encoded, 4 characters per 3 bytes.
+ */
+void ICACHE_FLASH_ATTR meshJsonWriter::base64( const char *name, const uint8_t *bytes, uint16_t length ) {
+    key( name );
+    put( '"' );
+    for ( uint16_t i = 0; i < length; i += 3 ) {
+        uint32_t bits = (uint32_t)bytes[i] << 16;
+        if ( i + 1 < length )
+            bits |= (uint32_t)bytes[i + 1] << 8;
+        if ( i + 2 < length )
+            bits |= bytes[i + 2];
+
+        put( base64Chars[( bits >> 18 ) & 0x3F] );
+        put( base64Chars[( bits >> 12 ) & 0x3F] );
+        put( i + 1 < length ? base64Chars[( bits >> 6 ) & 0x3F] : '=' );
+        put( i + 2 < length ? base64Chars[bits & 0x3F] : '=' );
+    }
+    put( '"' );
+}
+
+void ICACHE_FLASH_ATTR meshJsonWriter::append( const char *str ) {
+    while ( *str != '\0' )
+        put( *str++ );
+}
+
+void ICACHE_FLASH_ATTR meshJsonWriter::append( uint32_t value ) {
+    char digits[10];
+    uint8_t n = 0;
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while ( value != 0 );
+    while ( n > 0 )
+        put( digits[--n] );
+}
+
+void ICACHE_FLASH_ATTR meshJsonWriter::append( const uint8_t *bytes, uint16_t length ) {
+    if ( length > _size - _used ) {
+        _overflow = true;
+        return;
+    }
+    memcpy( _buf + _used, bytes, length );
+    _used += length;
+}
+
+/**
+ * Closes the object.
+ * @return Its length, 0 if it did not fit.
+ */
+uint16_t ICACHE_FLASH_ATTR meshJsonWriter::finish( void ) {
+    put( '}' );
+    return _overflow ? 0 : _used;
+}
+
+void ICACHE_FLASH_ATTR meshJsonWriter::put( char c ) {
+    if ( _used >= _size ) {
+        _overflow = true;
+        return;
+    }
+    _buf[_used++] = c;
+}
+
+/**
+ * Returns the number of bytes the encoded header will take.
+ * @param header The header to measure.
+ */
+uint16_t ICACHE_FLASH_ATTR packageHeaderSize( meshPackageHeader &header ) {
+    return PACKAGE_HEADER_SIZE + ( ( header.flags & PACKAGE_FLAG_SEQ ) ? PACKAGE_SEQ_SIZE : 0 );
+}
+
+/**
+ * Writes the binary header into buf. The buffer must hold at least packageHeaderSize() bytes.
+ * Fields are written byte by byte, the xtensa core faults on unaligned 32bit access.
+ * @param buf The destination buffer.
+ * @param header The header to encode.
+ * @return The number of bytes written.
+ */
+uint16_t ICACHE_FLASH_ATTR encodePackageHeader( uint8_t *buf, meshPackageHeader &header ) {
+    uint16_t i = 0;
+    buf[i++] = PACKAGE_MAGIC;
+    buf[i++] = header.version;
+    buf[i++] = header.type;
+    buf[i++] = header.flags;
+    for ( uint8_t b = 0; b < 4; b++ )
+        buf[i++] = ( header.from >> ( 8 * b ) ) & 0xFF;
+    for ( uint8_t b = 0; b < 4; b++ )
+        buf[i++] = ( header.dest >> ( 8 * b ) ) & 0xFF;
+    buf[i++] = header.length & 0xFF;
+    buf[i++] = header.length >> 8;
+    if ( header.flags & PACKAGE_FLAG_SEQ ) {
+        buf[i++] = header.seq & 0xFF;
+        buf[i++] = header.seq >> 8;
+    }
+    return i;
+}
+
+/**
+ * Reads a binary header. Fails if the magic byte does not match, the version is one we
+ * do not speak or buf is too short to hold the header.
+ * @param buf The received bytes.
+ * @param length The number of bytes in buf.
+ * @param header Filled in with the decoded fields.
+ */
+bool ICACHE_FLASH_ATTR decodePackageHeader( const uint8_t *buf, uint16_t length, meshPackageHeader &header ) {
+    if ( length < PACKAGE_HEADER_SIZE || buf[0] != PACKAGE_MAGIC || buf[1] != PACKAGE_VERSION )
+        return false;
+
+    header.version = buf[1];
+    header.type = buf[2];
+    header.flags = buf[3];
+    header.from = 0;
+    header.dest = 0;
+    for ( uint8_t b = 0; b < 4; b++ ) {
+        header.from |= (uint32_t)buf[4 + b] << ( 8 * b );
+        header.dest |= (uint32_t)buf[8 + b] << ( 8 * b );
+    }
+    header.length = buf[12] | ( (uint16_t)buf[13] << 8 );
+    header.seq = 0;
+
+    if ( header.flags & PACKAGE_FLAG_SEQ ) {
+        if ( length < PACKAGE_HEADER_SIZE + PACKAGE_SEQ_SIZE )
+            return false;
+        header.seq = buf[14] | ( (uint16_t)buf[15] << 8 );
+    }
+    return true;
+}
+
+/**
+ * True if buf starts with a binary package rather than a JSON object.
+ */
+bool ICACHE_FLASH_ATTR isBinaryPackage( const uint8_t *buf, uint16_t length ) {
+    return length > 0 && buf[0] == PACKAGE_MAGIC;
+}
+
+/**
+ * Reads `key` followed by an unsigned decimal at p and advances p past both, leaves p where
+ * it was otherwise. Fails on a number that does not fit 32 bits, the parser would not read it
+ * as we do.
+ */
+static bool ICACHE_FLASH_ATTR readJsonUint( const char *&p, const char *end, const char *key, uint32_t &value ) {
+    size_t keyLen = strlen( key );
+    if ( (size_t)( end - p ) < keyLen || memcmp( p, key, keyLen ) != 0 )
+        return false;
+
+    const char *q = p + keyLen;
+    if ( q >= end || *q < '0' || *q > '9' )
+        return false;
+
+    uint32_t number = 0;
+    while ( q < end && *q >= '0' && *q <= '9' ) {
+        uint32_t digit = *q - '0';
+        if ( number > ( UINT32_MAX - digit ) / 10 )
+            return false;
+        number = number * 10 + digit;
+        q++;
+    }
+    value = number;
+    p = q;
+    return true;
+}
+
+/**
+ * True if one of the members from p to the end of the object is a key peekJsonHeader() reads.
+ * p points between two members of the outer object, and the scan never goes past end, so it
+ * needs no NUL. Strings are skipped with their escapes and nested values by depth, so neither
+ * a payload nor a sub object can pass for a key; a key that holds an escape counts as a header
+ * key, as it may spell one, and so does an object cut short before its closing brace.
+ */
+static bool ICACHE_FLASH_ATTR hasHeaderKey( const char *p, const char *end ) {
+    static const char *const headerKeys[] = { "dest", "from", "type", "seq", "urgent" };
+
+    uint16_t depth = 1;
+    bool keyNext = false;
+    while ( p < end ) {
+        char c = *p++;
+        if ( c == '"' ) {
+            const char *key = p;
+            bool escaped = false;
+            while ( p < end && *p != '"' ) {
+                if ( *p == '\\' ) {
+                    escaped = true;
+                    p++;
+                }
+                p++;
+            }
+            if ( p >= end )
+                return true;
+            size_t keyLen = p - key;
+            p++;
+
+            if ( !keyNext )
+                continue;
+            keyNext = false;
+            if ( escaped )
+                return true;
+            for ( uint8_t k = 0; k < sizeof( headerKeys ) / sizeof( headerKeys[0] ); k++ ) {
+                if ( keyLen == strlen( headerKeys[k] ) && memcmp( key, headerKeys[k], keyLen ) == 0 )
+                    return true;
+            }
+        } else if ( c == '{' || c == '[' ) {
+            depth++;
+        } else if ( c == '}' || c == ']' ) {
+            if ( --depth == 0 )
+                return false;
+        } else if ( c == ',' && depth == 1 ) {
+            keyNext = true;
+        }
+    }
+    return true;
+}
+
+/**
+ * Reads dest, from and type out of a JSON package without parsing it.
+ * buildMeshPackage() always emits these three keys first and in this order, so a plain
+ * prefix scan is enough. Returns false for anything else; the caller then parses normally.
+ * A "seq" key directly after type is picked up as well and sets PACKAGE_FLAG_SEQ, an
+ * "urgent" key after that sets PACKAGE_FLAG_URGENT. Any of these keys later in the package
+ * means another order than ours, and a header read from the prefix might miss a seq or
+ * disagree with the parser, so that returns false too.
+ * @param buf The received JSON package.
+ * @param length The number of bytes in buf.
+ * @param header Receives dest, from, type and seq.
+ */
+bool ICACHE_FLASH_ATTR peekJsonHeader( const uint8_t *buf, uint16_t length, meshPackageHeader &header ) {
+    const char *p = (const char *)buf;
+    const char *end = p + length;
+    uint32_t type;
+
+    if ( !readJsonUint( p, end, "{\"dest\":", header.dest ) ||
+         !readJsonUint( p, end, ",\"from\":", header.from ) ||
+         !readJsonUint( p, end, ",\"type\":", type ) )
+        return false;
+
+    uint8_t flags = 0;
+    uint32_t seq = PACKAGE_NO_SEQ;
+    if ( readJsonUint( p, end, ",\"seq\":", seq ) )
+        flags |= PACKAGE_FLAG_SEQ;
+
+    uint32_t urgent;
+    if ( readJsonUint( p, end, ",\"urgent\":", urgent ) && urgent != 0 )
+        flags |= PACKAGE_FLAG_URGENT;
+
+    if ( hasHeaderKey( p, end ) )
+        return false;
+
+    header.type = type;
+    header.flags |= flags;
+    header.seq = seq;
+    return true;
+}
+
+/**
+ * Finds the end of the JSON object at the start of buf by matching braces, skipping
+ * over anything inside strings.
+ * @return The object length including both braces, 0 if buf does not hold a complete object.
+ */
+uint16_t ICACHE_FLASH_ATTR jsonPackageLength( const uint8_t *buf, uint16_t length ) {
+    if ( length == 0 || buf[0] != '{' )
+        return 0;
+
+    uint16_t depth = 0;
+    bool inString = false;
+    for ( uint16_t i = 0; i < length; i++ ) {
+        char c = buf[i];
+        if ( inString ) {
+            if ( c == '\\' )
+                i++;
+            else if ( c == '"' )
+                inString = false;
+        } else if ( c == '"' ) {
+            inString = true;
+        } else if ( c == '{' || c == '[' ) {
+            depth++;
+        } else if ( c == '}' || c == ']' ) {
+            if ( --depth == 0 )
+                return i + 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Returns the length of the package at the start of buf, binary or JSON.
+ * @return 0 if buf does not start with a complete package.
+ */
+uint16_t ICACHE_FLASH_ATTR packageLength( const uint8_t *buf, uint16_t length ) {
+    if ( !isBinaryPackage( buf, length ) )
+        return jsonPackageLength( buf, length );
+
+    meshPackageHeader header;
+    if ( !decodePackageHeader( buf, length, header ) )
+        return 0;
+
+    uint32_t total = packageHeaderSize( header ) + header.length;
+    return total <= length ? total : 0;
+}
+
+/**
+ * True if buf could be the start of a package, complete or not. Used to resynchronise
+ * the stream after garbage.
+ */
+bool ICACHE_FLASH_ATTR isPackageStart( const uint8_t *buf, uint16_t length ) {
+    if ( length == 0 )
+        return false;
+    if ( buf[0] == '{' )
+        return true;
+    if ( buf[0] != PACKAGE_MAGIC )
+        return false;
+    if ( length >= 2 && buf[1] != PACKAGE_VERSION )
+        return false;
+    if ( length >= PACKAGE_HEADER_SIZE ) {
+        uint16_t payload = buf[12] | ( (uint16_t)buf[13] << 8 );
+        if ( PACKAGE_HEADER_SIZE + payload > PACKAGE_MAX_SIZE )
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Returns the offset of the next byte after buf[0] that could start a package, length if there is none.
+ */
+uint16_t ICACHE_FLASH_ATTR nextPackageStart( const uint8_t *buf, uint16_t length ) {
+    for ( uint16_t i = 1; i < length; i++ ) {
+        if ( isPackageStart( buf + i, length - i ) )
+            return i;
+    }
+    return length;
+}
+
+/**
+ * Copies a payload that is not NUL terminated into a String.
+ * @param payload The first payload byte.
+ * @param length The payload length.
+ * @param str Receives the payload.
+ */
+void ICACHE_FLASH_ATTR payloadToString( const uint8_t *payload, uint16_t length, String &str ) {
+    str = "";
+    str.reserve( length );
+    for ( uint16_t i = 0; i < length; i++ )
+        str += (char)payload[i];
+}
+
+/**
+ * True if the payload survives being carried as a JSON string, that is it holds no NUL.
+ */
+bool ICACHE_FLASH_ATTR payloadIsText( const uint8_t *payload, uint16_t length ) {
+    return memchr( payload, 0, length ) == NULL;
+}
+
+static int8_t ICACHE_FLASH_ATTR base64Value( char c ) {
+    if ( c >= 'A' && c <= 'Z' ) return c - 'A';
+    if ( c >= 'a' && c <= 'z' ) return c - 'a' + 26;
+    if ( c >= '0' && c <= '9' ) return c - '0' + 52;
+    if ( c == '+' ) return 62;
+    if ( c == '/' ) return 63;
+    return -1;
+}
+
+/**
+ * Decodes a NUL terminated base64 text in place, the bytes never outgrow the text.
+ * @param text The encoded payload, overwritten with the decoded one.
+ * @param length Receives the decoded length.
+ * @return False if text is not base64.
+ */
+bool ICACHE_FLASH_ATTR base64ToPayload( char *text, uint16_t &length ) {
+    uint8_t *out = (uint8_t *)text;
+    length = 0;
+    uint32_t bits = 0;
+    uint8_t count = 0;
+    for ( const char *c = text; *c != '\0' && *c != '='; c++ ) {
+        int8_t value = base64Value( *c );
+        if ( value < 0 )
+            return false;
+
+        bits = ( bits << 6 ) | value;
+        if ( ++count == 4 ) {
+            out[length++] = bits >> 16;
+            out[length++] = bits >> 8;
+            out[length++] = bits;
+            bits = 0;
+            count = 0;
+        }
+    }
+    if ( count == 1 )
+        return false;
+    if ( count == 2 ) {
+        out[length++] = bits >> 4;
+    } else if ( count == 3 ) {
+        out[length++] = bits >> 10;
+        out[length++] = bits >> 2;
+    }
+    return true;
+}
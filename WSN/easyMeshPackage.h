@@ -0,0 +1,110 @@
+#ifndef   _MESH_PACKAGE_H_
+#define   _MESH_PACKAGE_H_
+
+#include <Arduino.h>
+
+/**
+ * Binary package layout (little endian):
+ * | magic | version | type | flags | from (4) | dest (4) | length (2) | [seq (2)] | payload (length) |
+ * The magic byte can never start a JSON package, so both formats can share one link.
+ */
+#define PACKAGE_MAGIC           0xE5
+#define PACKAGE_VERSION         1
+#define PACKAGE_HEADER_SIZE     14      // header size without the optional sequence number
+#define PACKAGE_SEQ_SIZE        2
+#define PACKAGE_MAX_SIZE        1400    // largest package we hand to espconn_send
+
+#define PACKAGE_FLAG_SEQ        0x01    // header carries a sequence number
+#define PACKAGE_NO_SEQ          0       // seq value meaning "no sequence number", never sent
+#define PACKAGE_FLAG_SYNC_HASH  0x02    // NODE_SYNC payload starts with the hash and known hash (4 bytes each)
+#define PACKAGE_SYNC_HASH_SIZE  8
+#define PACKAGE_FLAG_PING       0x04    // NODE_SYNC sender answers PING, use it as keepalive
+#define PACKAGE_FLAG_URGENT     0x08    // application package every hop sends with PRIORITY_HIGH
+#define PACKAGE_FLAG_SINK       0x10    // NODE_SYNC sender is a sink, see easyMesh::setSink()
+#define PACKAGE_FLAG_DUTY       0x20    // NODE_SYNC hashes are followed by the sender's duty period and window (4 bytes each)
+#define PACKAGE_SYNC_DUTY_SIZE  8
+#define PACKAGE_FLAG_HOPS       0x40    // and then by the sender's hops from the root (1 byte)
+#define PACKAGE_SYNC_HOPS_SIZE  1
+
+enum wireFormatType {
+    WIRE_JSON = 0,      // legacy, one JSON object per package
+    WIRE_BINARY = 1     // meshPackageHeader followed by the raw payload
+};
+
+struct meshPackageHeader {
+    uint8_t version = PACKAGE_VERSION;
+    uint8_t type = 0;
+    uint8_t flags = 0;
+    uint32_t from = 0;
+    uint32_t dest = 0;
+    uint16_t length = 0;    // payload bytes following the header
+    uint16_t seq = 0;       // only valid if PACKAGE_FLAG_SEQ is set
+};
+
+/**
+ * Writes a JSON package straight into a fixed buffer, formatted the way ArduinoJson
+ * prints it, so encoding one never takes a String off the heap. Once something does not
+ * fit the writer stops and finish() returns 0.
+ */
+class meshJsonWriter {
+public:
+    meshJsonWriter(uint8_t *buf, uint16_t size);
+
+    void key(const char *name);
+
+    void number(const char *name, uint32_t value);
+
+    void raw(const char *name, const uint8_t *json, uint16_t length);
+
+    void text(const char *name, const uint8_t *str, uint16_t length);
+
+    void base64(const char *name, const uint8_t *bytes, uint16_t length);
+
+    void append(const char *str);
+
+    void append(uint32_t value);
+
+    void append(const uint8_t *bytes, uint16_t length);
+
+    void rewind(uint16_t length) { if (length <= _used) { _used = length; _overflow = false; } };
+
+    uint16_t finish(void);
+
+    uint16_t length(void) { return _used; };
+
+    bool overflow(void) { return _overflow; };
+
+protected:
+    void put(char c);
+
+    uint8_t *_buf;
+    uint16_t _size;
+    uint16_t _used = 0;
+    bool _overflow = false;
+};
+
+uint16_t packageHeaderSize(meshPackageHeader &header);
+
+uint16_t encodePackageHeader(uint8_t *buf, meshPackageHeader &header);
+
+bool decodePackageHeader(const uint8_t *buf, uint16_t length, meshPackageHeader &header);
+
+bool isBinaryPackage(const uint8_t *buf, uint16_t length);
+
+bool peekJsonHeader(const uint8_t *buf, uint16_t length, meshPackageHeader &header);
+
+uint16_t jsonPackageLength(const uint8_t *buf, uint16_t length);
+
+uint16_t packageLength(const uint8_t *buf, uint16_t length);
+
+bool isPackageStart(const uint8_t *buf, uint16_t length);
+
+uint16_t nextPackageStart(const uint8_t *buf, uint16_t length);
+
+void payloadToString(const uint8_t *payload, uint16_t length, String &str);
+
+bool payloadIsText(const uint8_t *payload, uint16_t length);
+
+bool base64ToPayload(char *text, uint16_t &length);
+
+#endif //   _MESH_PACKAGE_H_
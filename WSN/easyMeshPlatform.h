@@ -0,0 +1,31 @@
+#ifndef   _MESH_PLATFORM_H_
+#define   _MESH_PLATFORM_H_
+
+/**
+ * The one place the mesh pulls in the ESP8266 NONOS SDK.
+ *
+ * Everything the mesh needs from the platform goes through the calls below, so a host build
+ * (simulator, benchmarks) only has to provide these, plus Arduino.h with Serial, String,
+ * ESP.getCycleCount() and noInterrupts()/interrupts():
+ *   espconn:  espconn_accept, espconn_connect, espconn_disconnect, espconn_port, espconn_send,
+ *             espconn_set_opt, espconn_tcp_get_max_con, espconn_regist_{connect,discon,recon,recv,sent}cb
+ *   timers:   os_timer_setfn, os_timer_arm, os_timer_disarm
+ *   system:   system_get_chip_id, system_get_free_heap_size, system_get_time, system_rtc_mem_{read,write}, os_memcpy
+ *   wifi:     wifi_set_event_handler_cb, wifi_set_opmode, wifi_set_opmode_current, wifi_set_sleep_type,
+ *             wifi_get_ip_info, wifi_set_ip_info, wifi_get_channel,
+ *             wifi_set_user_ie, wifi_register_user_ie_manufacturer_recv_cb,
+ *             wifi_softap_{get,set}_config, wifi_softap_set_config_current, wifi_softap_get_station_num,
+ *             wifi_softap_dhcps_{start,stop},
+ *             wifi_station_{connect,disconnect,get_config,get_connect_status,scan,set_auto_connect,set_config}
+ * Build with -DEASYMESH_PLATFORM_SHIM=\"myShim.h\" to replace the SDK headers with such a shim.
+ */
+#ifdef EASYMESH_PLATFORM_SHIM
+#include EASYMESH_PLATFORM_SHIM
+#else
+extern "C" {
+#include "user_interface.h"
+#include "espconn.h"
+}
+#endif
+
+#endif //   _MESH_PLATFORM_H_
@@ -0,0 +1,191 @@
+#include <Arduino.h>
+
+#include "easyMeshQueue.h"
+
+/**
+ * Allocates the ring. Call once per connection.
+ * @param size The capacity in bytes.
+ */
+bool ICACHE_FLASH_ATTR meshSendQueue::begin( uint16_t size ) {
+    _buf = new uint8_t[ size ];
+    _size = ( _buf != NULL ) ? size : 0;
+    _head = 0;
+    _used = 0;
+    _count = 0;
+    return _buf != NULL;
+}
+
+/**
+ * Releases the ring and forgets anything still queued.
+ */
+void ICACHE_FLASH_ATTR meshSendQueue::end( void ) {
+    delete[] _buf;
+    _buf = NULL;
+    _size = 0;
+    _head = 0;
+    _used = 0;
+    _count = 0;
+}
+
+/**
+ * Appends a package. Fails, leaving the queue untouched, if there is not enough room.
+ * @param data The encoded package.
+ * @param length The package length in bytes.
+ */
+bool ICACHE_FLASH_ATTR meshSendQueue::push( const uint8_t *data, uint16_t length ) {
+    if ( !fits( length ) )
+        return false;
+
+    uint8_t prefix[QUEUE_LENGTH_SIZE] = { (uint8_t)( length & 0xFF ), (uint8_t)( length >> 8 ) };
+    write( prefix, QUEUE_LENGTH_SIZE );
+    write( data, length );
+    _count++;
+    return true;
+}
+
+/**
+ * Removes the oldest package and copies it to out.
+ * @param out Destination buffer.
+ * @param maxLength Size of out. A package that does not fit is dropped.
+ * @return The package length, 0 if the queue was empty.
+ */
+uint16_t ICACHE_FLASH_ATTR meshSendQueue::pop( uint8_t *out, uint16_t maxLength ) {
+    uint16_t length = frontLength();
+    if ( _count == 0 )
+        return 0;
+
+    if ( length > maxLength ) {
+        dropOldest();
+        return 0;
+    }
+
+    uint8_t prefix[QUEUE_LENGTH_SIZE];
+    read( prefix, QUEUE_LENGTH_SIZE );
+    read( out, length );
+    _count--;
+    return length;
+}
+
+/**
+ * Throws away the oldest package.
+ */
+bool ICACHE_FLASH_ATTR meshSendQueue::dropOldest( void ) {
+    if ( _count == 0 )
+        return false;
+
+    uint16_t skip = QUEUE_LENGTH_SIZE + frontLength();
+    _head = ( _head + skip ) % _size;
+    _used -= skip;
+    _count--;
+    return true;
+}
+
+/**
+ * Length of the oldest package, 0 if the queue is empty.
+ */
+uint16_t ICACHE_FLASH_ATTR meshSendQueue::frontLength( void ) {
+    if ( _count == 0 )
+        return 0;
+    return _buf[_head] | ( (uint16_t)_buf[( _head + 1 ) % _size] << 8 );
+}
+
+void ICACHE_FLASH_ATTR meshSendQueue::write( const uint8_t *data, uint16_t length ) {
+    uint16_t tail = ( _head + _used ) % _size;
+    uint16_t first = min( length, (uint16_t)( _size - tail ) );
+    memcpy( _buf + tail, data, first );
+    memcpy( _buf, data + first, length - first );
+    _used += length;
+}
+
+void ICACHE_FLASH_ATTR meshSendQueue::read( uint8_t *out, uint16_t length ) {
+    uint16_t first = min( length, (uint16_t)( _size - _head ) );
+    memcpy( out, _buf + _head, first );
+    memcpy( out + first, _buf, length - first );
+    _head = ( _head + length ) % _size;
+    _used -= length;
+}
+
+/**
+ * Allocates both lanes. Call once per connection.
+ * @param size The capacity of the normal lane in bytes, the high lane gets PRIORITY_QUEUE_SIZE.
+ */
+bool ICACHE_FLASH_ATTR meshSendLanes::begin( uint16_t size ) {
+    bool ok = _lanes[PRIORITY_HIGH].begin( PRIORITY_QUEUE_SIZE );
+    return _lanes[PRIORITY_NORMAL].begin( size ) && ok;
+}
+
+void ICACHE_FLASH_ATTR meshSendLanes::end( void ) {
+    for ( uint8_t i = 0; i < PRIORITY_LANES; i++ )
+        _lanes[i].end();
+}
+
+/**
+ * Removes the oldest package of the highest lane that has one, see meshSendQueue::pop().
+ */
+uint16_t ICACHE_FLASH_ATTR meshSendLanes::pop( uint8_t *out, uint16_t maxLength ) {
+    meshSendQueue *queue = front();
+    return queue != NULL ? queue->pop( out, maxLength ) : 0;
+}
+
+/**
+ * Length of the package pop() would return, 0 if every lane is empty.
+ */
+uint16_t ICACHE_FLASH_ATTR meshSendLanes::frontLength( void ) {
+    meshSendQueue *queue = front();
+    return queue != NULL ? queue->frontLength() : 0;
+}
+
+bool ICACHE_FLASH_ATTR meshSendLanes::empty( void ) {
+    return front() == NULL;
+}
+
+/**
+ * Bytes in use over all lanes.
+ */
+uint16_t ICACHE_FLASH_ATTR meshSendLanes::used( void ) {
+    uint16_t used = 0;
+    for ( uint8_t i = 0; i < PRIORITY_LANES; i++ )
+        used += _lanes[i].used();
+    return used;
+}
+
+meshSendQueue* ICACHE_FLASH_ATTR meshSendLanes::front( void ) {
+    for ( uint8_t i = 0; i < PRIORITY_LANES; i++ ) {
+        if ( !_lanes[i].empty() )
+            return &_lanes[i];
+    }
+    return NULL;
+}
+
+/**
+ * Allocates the reassembly buffer. Call once per connection.
+ * @param size The capacity in bytes.
+ */
+bool ICACHE_FLASH_ATTR meshRecvBuffer::begin( uint16_t size ) {
+    _buf = new uint8_t[ size ];
+    _size = ( _buf != NULL ) ? size : 0;
+    _used = 0;
+    return _buf != NULL;
+}
+
+/**
+ * Releases the buffer and whatever partial package it held.
+ */
+void ICACHE_FLASH_ATTR meshRecvBuffer::end( void ) {
+    delete[] _buf;
+    _buf = NULL;
+    _size = 0;
+    _used = 0;
+}
+
+/**
+ * Appends received bytes. Fails, leaving the buffer untouched, if they do not fit.
+ */
+bool ICACHE_FLASH_ATTR meshRecvBuffer::append( const uint8_t *data, uint16_t length ) {
+    if ( length > space() )
+        return false;
+
+    memcpy( _buf + _used, data, length );
+    _used += length;
+    return true;
+}
@@ -0,0 +1,118 @@
+#ifndef   _MESH_QUEUE_H_
+#define   _MESH_QUEUE_H_
+
+#include <Arduino.h>
+
+#define SEND_QUEUE_SIZE     2048    // default bytes per connection, must fit one PACKAGE_MAX_SIZE package
+#define QUEUE_LENGTH_SIZE   2       // every queued package is prefixed with its length
+#define RECV_BUFFER_SIZE    1400    // reassembly space per connection, one PACKAGE_MAX_SIZE package
+#define PRIORITY_QUEUE_SIZE 512     // bytes per connection for the high lane, a bigger package waits in the normal one
+#define PRIORITY_LANES      2
+
+enum dropPolicyType {
+    DROP_OLDEST = 0,    // make room by dropping the packages that have waited longest
+    DROP_NEWEST = 1     // refuse the new package, keep what is queued
+};
+
+enum meshPriorityType {
+    PRIORITY_HIGH = 0,      // control traffic (sync, PING) and urgent application messages
+    PRIORITY_NORMAL = 1     // everything else
+};
+
+/**
+ * Fixed capacity byte ring holding length prefixed packages waiting for meshSentCb().
+ * The buffer is allocated once when the connection is made and released when it is closed;
+ * copying the struct (SimpleList does that a lot) only copies the view, never the bytes.
+ */
+class meshSendQueue {
+public:
+    bool begin(uint16_t size);
+
+    void end(void);
+
+    bool push(const uint8_t *data, uint16_t length);
+
+    uint16_t pop(uint8_t *out, uint16_t maxLength);
+
+    bool dropOldest(void);
+
+    uint16_t frontLength(void);
+
+    bool fits(uint16_t length) { return length + QUEUE_LENGTH_SIZE <= _size - _used; };
+
+    bool empty(void) { return _count == 0; };
+
+    uint16_t size(void) { return _size; };
+
+    uint16_t used(void) { return _used; };
+
+    uint16_t count(void) { return _count; };
+
+protected:
+    void write(const uint8_t *data, uint16_t length);
+
+    void read(uint8_t *out, uint16_t length);
+
+    uint8_t *_buf = NULL;
+    uint16_t _size = 0;
+    uint16_t _head = 0;     // offset of the oldest byte
+    uint16_t _used = 0;     // bytes in use, including length prefixes
+    uint16_t _count = 0;    // packages in the queue
+};
+
+/**
+ * One meshSendQueue per meshPriorityType. Packages leave the high lane before any in the
+ * normal lane, so sync samples and alerts never wait behind a backlog of sensor data.
+ * Copies are views, like meshSendQueue.
+ */
+class meshSendLanes {
+public:
+    bool begin(uint16_t size);
+
+    void end(void);
+
+    meshSendQueue &lane(meshPriorityType priority) { return _lanes[priority]; };
+
+    uint16_t pop(uint8_t *out, uint16_t maxLength);
+
+    uint16_t frontLength(void);
+
+    bool empty(void);
+
+    uint16_t used(void);
+
+protected:
+    meshSendQueue *front(void);
+
+    meshSendQueue _lanes[PRIORITY_LANES];
+};
+
+/**
+ * Holds the start of a package that was split across TCP segments until the rest arrives.
+ * Same ownership rules as meshSendQueue: allocated once per connection, copies are views.
+ */
+class meshRecvBuffer {
+public:
+    bool begin(uint16_t size);
+
+    void end(void);
+
+    bool append(const uint8_t *data, uint16_t length);
+
+    void clear(void) { _used = 0; };
+
+    uint8_t *data(void) { return _buf; };
+
+    bool empty(void) { return _used == 0; };
+
+    uint16_t used(void) { return _used; };
+
+    uint16_t space(void) { return _size - _used; };
+
+protected:
+    uint8_t *_buf = NULL;
+    uint16_t _size = 0;
+    uint16_t _used = 0;
+};
+
+#endif //   _MESH_QUEUE_H_
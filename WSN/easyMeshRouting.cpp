@@ -0,0 +1,271 @@
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <SimpleList.h>
+
+#include "easyMesh.h"
+
+/**
+ * Home slot of a chip id in the routing table (Knuth multiplicative hash).
+ */
+static inline uint16_t routeSlot( uint32_t chipId ) {
+    return ( ( chipId * 2654435761u ) >> 16 ) & ( ROUTE_TABLE_SIZE - 1 );
+}
+
+/**
+ * Returns the routing table entry for a node, or NULL if we have no route to it.
+ * @param chipId The node we want to reach.
+ */
+meshRouteType* ICACHE_FLASH_ATTR easyMesh::findRoute( uint32_t chipId ) {
+    if ( chipId == 0 )
+        return NULL;
+
+    uint16_t i = routeSlot( chipId );
+    for ( uint16_t probe = 0; probe < ROUTE_TABLE_SIZE; probe++ ) {
+        if ( _routes[i].chipId == chipId )
+            return &_routes[i];
+        if ( _routes[i].chipId == 0 )
+            return NULL;
+        i = ( i + 1 ) & ( ROUTE_TABLE_SIZE - 1 );
+    }
+    return NULL;
+}
+
+/**
+ * Adds a route or, if the node is already known, keeps whichever route is shorter.
+ * @param chipId The node that can be reached.
+ * @param nextHop The chip id of the direct connection that leads to it.
+ * @param hops The number of links between us and chipId.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::addRoute( uint32_t chipId, uint32_t nextHop, uint8_t hops ) {
+    if ( chipId == 0 || chipId == _chipId )
+        return false;
+
+    uint16_t i = routeSlot( chipId );
+    for ( uint16_t probe = 0; probe < ROUTE_TABLE_SIZE; probe++ ) {
+        if ( _routes[i].chipId == 0 ) {
+            _routes[i].chipId = chipId;
+            _routes[i].nextHop = nextHop;
+            _routes[i].hops = hops;
+            return true;
+        }
+        if ( _routes[i].chipId == chipId ) {
+            if ( hops < _routes[i].hops ) {
+                _routes[i].nextHop = nextHop;
+                _routes[i].hops = hops;
+            }
+            return true;
+        }
+        i = ( i + 1 ) & ( ROUTE_TABLE_SIZE - 1 );
+    }
+
+    debugMsg( ERROR, "addRoute(): routing table full, can not add %u\n", chipId );
+    return false;
+}
+
+/**
+ * Empties slot i and shifts the rest of its probe cluster back so lookups still terminate
+ * at the first empty slot.
+ */
+void ICACHE_FLASH_ATTR easyMesh::eraseRoute( uint16_t i ) {
+    uint16_t j = i;
+    while ( true ) {
+        _routes[i].chipId = 0;
+        while ( true ) {
+            j = ( j + 1 ) & ( ROUTE_TABLE_SIZE - 1 );
+            if ( _routes[j].chipId == 0 )
+                return;
+
+            uint16_t home = routeSlot( _routes[j].chipId );
+            bool stays = ( i <= j ) ? ( i < home && home <= j ) : ( i < home || home <= j );
+            if ( !stays )
+                break;
+        }
+        _routes[i] = _routes[j];
+        i = j;
+    }
+}
+
+/**
+ * Forgets every route through a given direct connection. A node the other connections still
+ * reach keeps a route over the shortest of them: the table only ever holds the shortest route,
+ * so the routes the topology pool offers for those nodes are all the ones left to rebuild.
+ * Call it once the pool no longer holds what nextHop brought in, see removeTopology().
+ * @param nextHop The chip id of the direct connection.
+ */
+void ICACHE_FLASH_ATTR easyMesh::removeRoutes( uint32_t nextHop ) {
+    if ( nextHop == 0 )
+        return;
+
+    bool erased = false;
+    for ( uint16_t i = 0; i < ROUTE_TABLE_SIZE; i++ ) {
+        while ( _routes[i].chipId != 0 && _routes[i].nextHop == nextHop ) {
+            eraseRoute( i );
+            erased = true;
+        }
+    }
+    if ( !erased )
+        return;
+
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId != 0 && _topology[i].via != nextHop )
+            addRoute( _topology[i].chipId, _topology[i].via, _topology[i].hops );  // a no-op unless it lost its route
+    }
+}
+
+/**
+ * Stores one node in the first free slot of the topology pool.
+ * @return The slot index, or TOPOLOGY_ROOT if the pool is full.
+ */
+uint8_t ICACHE_FLASH_ATTR easyMesh::addTopologyNode( uint32_t chipId, uint32_t via, uint8_t parent, uint8_t hops ) {
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId == 0 ) {
+            _topology[i].chipId = chipId;
+            _topology[i].via = via;
+            _topology[i].parent = parent;
+            _topology[i].hops = hops;
+            _topology[i].sink = false;
+            _topologySize++;
+            addRoute( chipId, via, hops );
+            return i;
+        }
+    }
+    debugMsg( ERROR, "addTopologyNode(): topology pool full, can not add %u\n", chipId );
+    return TOPOLOGY_ROOT;
+}
+
+/**
+ * Adds every node of a subConnections JSON array below parent.
+ * @param subs The array, as sent in NODE_SYNC packages.
+ * @param via The direct connection the array was received from.
+ * @param parent Pool index of the node these subs hang off.
+ * @param hops The distance to the nodes at the top level of subs.
+ * @return The number of nodes added.
+ */
+uint16_t ICACHE_FLASH_ATTR easyMesh::addSubTopology( JsonArray &subs, uint32_t via, uint8_t parent, uint8_t hops ) {
+    uint16_t count = 0;
+    for ( JsonArray::iterator it = subs.begin(); it != subs.end(); ++it ) {
+        JsonObject &sub = it->as<JsonObject&>();
+        uint8_t index = addTopologyNode( sub["chipId"].as<uint32_t>(), via, parent, hops );
+        if ( index == TOPOLOGY_ROOT )
+            return count;
+        count++;
+        _topology[index].sink = sub.containsKey( "sink" );
+
+        if ( sub.containsKey( "subs" ) )
+            count += addSubTopology( sub["subs"].as<JsonArray&>(), via, index, hops + 1 );
+    }
+    return count;
+}
+
+/**
+ * Drops every node that was reached through a given direct connection, and the routes only it offered.
+ * @param via The chip id of the direct connection.
+ */
+void ICACHE_FLASH_ATTR easyMesh::removeTopology( uint32_t via ) {
+    if ( via == 0 )
+        return;
+
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId != 0 && _topology[i].via == via ) {
+            _topology[i].chipId = 0;
+            _topologySize--;
+        }
+    }
+    removeRoutes( via );
+}
+
+/**
+ * Replaces the part of the topology (and routing table) that hangs off conn with the
+ * subs it just sent us. This is the only place a NODE_SYNC subs array gets parsed.
+ * @param conn The connection that was synced.
+ * @param subs The subs JSON array it sent.
+ */
+void ICACHE_FLASH_ATTR easyMesh::updateTopology( meshConnectionType *conn, String &subs ) {
+    debugMsg( GENERAL, "updateTopology(): via %u\n", conn->chipId );
+
+    removeTopology( conn->chipId );
+    conn->subCount = 0;
+
+    uint8_t root = addTopologyNode( conn->chipId, conn->chipId, TOPOLOGY_ROOT, 1 );
+    if ( root == TOPOLOGY_ROOT )
+        return;
+    _topology[root].sink = conn->sink;
+    if ( subs.length() < 3 )
+        return;
+
+    meshJsonLease lease( _jsonArena );
+    if ( lease.buffer == NULL ) {
+        debugMsg( ERROR, "updateTopology(): JSON arena busy\n" );
+        return;
+    }
+
+    JsonArray& subArray = lease.buffer->parseArray( subs, JSON_NESTING_LIMIT );
+    if ( !subArray.success() ) {
+        debugMsg( ERROR, "updateTopology(): parseArray() failed\n" );
+        return;
+    }
+    conn->subCount = addSubTopology( subArray, conn->chipId, root, 2 );
+}
+
+/**
+ * Appends the children of a pool node to a subs JSON array, depth first.
+ * @param out The JSON text being built.
+ * @param parent Pool index whose children are written.
+ */
+void ICACHE_FLASH_ATTR easyMesh::appendSubTopology( meshJsonWriter &out, uint8_t parent ) {
+    bool first = true;
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId == 0 || _topology[i].parent != parent )
+            continue;
+
+        if ( !first )
+            out.append( "," );
+        first = false;
+
+        out.append( "{\"chipId\":" );
+        out.append( _topology[i].chipId );
+        if ( _topology[i].sink )
+            out.append( ",\"sink\":1" );  // older nodes ignore it
+        out.append( ",\"subs\":[" );
+        appendSubTopology( out, i );
+        out.append( "]}" );
+    }
+}
+
+/**
+ * Returns the nearest sink in the topology, 0 if none is known. Every sink in the pool is
+ * reachable through the routing table, so sendSingle() to it goes up the tree hop by hop.
+ */
+uint32_t ICACHE_FLASH_ATTR easyMesh::findSink( void ) {
+    uint32_t sinkId = 0;
+    uint8_t bestHops = 0xFF;
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId != 0 && _topology[i].sink && _topology[i].hops < bestHops ) {
+            sinkId = _topology[i].chipId;
+            bestHops = _topology[i].hops;
+        }
+    }
+    return sinkId;
+}
+
+/**
+ * True if chipId is in the topology and advertised itself as a sink.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::knownSink( uint32_t chipId ) {
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId == chipId && chipId != 0 )
+            return _topology[i].sink;
+    }
+    return false;
+}
+
+/**
+ * Returns the pool index that represents a direct connection, TOPOLOGY_ROOT if it has none yet.
+ */
+uint8_t ICACHE_FLASH_ATTR easyMesh::findTopologyRoot( uint32_t chipId ) {
+    for ( uint8_t i = 0; i < TOPOLOGY_POOL_SIZE; i++ ) {
+        if ( _topology[i].chipId == chipId && _topology[i].parent == TOPOLOGY_ROOT )
+            return i;
+    }
+    return TOPOLOGY_ROOT;
+}
@@ -1,28 +1,114 @@
 #include <Arduino.h>
 #include <SimpleList.h>
 
-extern "C" {
-    #include "user_interface.h"
-    #include "espconn.h"
-}
+#include "easyMeshPlatform.h"
 
 #include "easyMesh.h"
 
-/**
- * A static copy of the mesh handler, kept for convenience.
- */
-extern easyMesh* staticThis;
-
 /**
  * Initializes the station and starts the AP scan.
  * Called after init().
  */
 void ICACHE_FLASH_ATTR easyMesh::stationInit( void ) {
     debugMsg( STARTUP, "stationInit():\n");
-    startStationScan();
+    wifi_register_user_ie_manufacturer_recv_cb( beaconIeCb );
+    os_timer_setfn( &_roamTimer, roamTimerCallback, this );
+    loadParentCache();
+    connectToBestAP();  // nothing scanned yet, so this tries the cached parents first
     return;
 }
 
+/**
+ * Checksum over the cache entries, to tell a copy we wrote from whatever RTC memory held after power up.
+ */
+static uint32_t ICACHE_FLASH_ATTR parentCacheChecksum( meshParentCache &cache ) {
+    uint32_t sum = cache.magic;
+    uint8_t *bytes = (uint8_t *)cache.entries;
+    for (uint16_t i = 0; i < sizeof(cache.entries); i++)
+        sum = ( sum << 1 | sum >> 31 ) ^ bytes[i];
+    return sum;
+}
+
+/**
+ * Restores the parent cache from RTC memory, where it survives deep sleep.
+ */
+void ICACHE_FLASH_ATTR easyMesh::loadParentCache( void ) {
+    meshParentCache saved;
+    if (system_rtc_mem_read(PARENT_CACHE_RTC_BLOCK, &saved, sizeof(saved)) &&
+        saved.magic == PARENT_CACHE_MAGIC && saved.checksum == parentCacheChecksum(saved)) {
+        _parentCache = saved;
+        debugMsg(STARTUP, "loadParentCache(): last parent on channel %u\n", _parentCache.entries[0].channel);
+    }
+}
+
+/**
+ * Puts the AP we just associated with at the front of the parent cache.
+ */
+void ICACHE_FLASH_ATTR easyMesh::rememberParent( Event_StaMode_Connected_t &connected ) {
+    uint8_t i = 0;
+    while (i < PARENT_CACHE_SIZE - 1 && memcmp(_parentCache.entries[i].bssid, connected.bssid, 6) != 0)
+        i++;
+    for (; i > 0; i--)
+        _parentCache.entries[i] = _parentCache.entries[i - 1];
+
+    meshParentEntry &entry = _parentCache.entries[0];
+    memcpy(entry.bssid, connected.bssid, 6);
+    entry.channel = connected.channel;
+    entry.ssidLen = min(connected.ssid_len, (uint8)32);
+    memcpy(entry.ssid, connected.ssid, 32);
+
+    _parentCache.magic = PARENT_CACHE_MAGIC;
+    _parentCache.checksum = parentCacheChecksum(_parentCache);
+    system_rtc_mem_write(PARENT_CACHE_RTC_BLOCK, &_parentCache, sizeof(_parentCache));
+}
+
+/**
+ * The fast way back into the mesh when no scan results are left: a targeted connect to each
+ * cached parent, then a scan of the last parent's channel only, then a full scan. Each call
+ * moves on one step; wifiEventCb() and stationScanCb() call back in when a step fails.
+ * @return false once all steps are used up, the caller then backs off for SCAN_INTERVAL.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::rejoinFromCache( void ) {
+    while (_rejoinStep < PARENT_CACHE_SIZE) {
+        meshParentEntry &entry = _parentCache.entries[_rejoinStep++];
+        if (entry.channel == 0)
+            continue;
+
+        char ssid[33];
+        memcpy(ssid, entry.ssid, entry.ssidLen);
+        ssid[entry.ssidLen] = 0;
+        String apChipId = ssid + _meshPrefix.length();
+        if (entry.ssidLen <= _meshPrefix.length() || findConnection(apChipId.toInt()) != NULL)
+            continue;  // it joined our mesh through someone else meanwhile
+
+        debugMsg(CONNECTION, "rejoinFromCache(): trying cached parent %s on channel %u\n", ssid, entry.channel);
+        struct station_config stationConf;
+        memset(&stationConf, 0, sizeof(stationConf));
+        memcpy(&stationConf.ssid, entry.ssid, 32);
+        memcpy(&stationConf.password, _meshPassword.c_str(), min(_meshPassword.length() + 1, (unsigned int)64));
+        stationConf.bssid_set = 1;
+        memcpy(&stationConf.bssid, entry.bssid, 6);
+        wifi_station_set_config(&stationConf);
+        wifi_station_connect();
+        _nodeStatus = FOUND_MESH;
+        return true;
+    }
+
+    if (_rejoinStep == PARENT_CACHE_SIZE) {
+        _rejoinStep++;
+        uint8_t channel = _parentCache.entries[0].channel;
+        if (channel != 0 && startStationScan(channel))
+            return true;
+    }
+
+    if (_rejoinStep == PARENT_CACHE_SIZE + 1) {
+        _rejoinStep++;
+        if (startStationScan())
+            return true;
+    }
+    return false;
+}
+
 /**
  * Refreshes the connection status of the station.
  * Prints useful debug messages.
@@ -66,21 +152,245 @@ void ICACHE_FLASH_ATTR easyMesh::manageStation( void ) {
 /**
  * Starts scanning if on station mode.
  * Changes the scan status to SCANNING iff its IDLE.
+ * @param channel The only channel to scan, 0 for all of them.
  */
-void ICACHE_FLASH_ATTR easyMesh::startStationScan( void ) {
-    debugMsg(GENERAL, "startStationScan():\n");
+bool ICACHE_FLASH_ATTR easyMesh::startStationScan( uint8_t channel ) {
+    debugMsg(GENERAL, "startStationScan(): channel=%u\n", channel);
 
     if (_scanStatus != IDLE) {
-        return;
+        return false;
     }
 
-    if (!wifi_station_scan(NULL, stationScanCb)) {
+    struct scan_config config;
+    memset(&config, 0, sizeof(config));
+    config.channel = channel;
+
+    _stationOwner = this;  // stationScanCb() and beaconIeCb() deliver here
+    _beacons.clear();  // beaconIeCb() fills it while the scan runs
+    if (!wifi_station_scan(&config, stationScanCb)) {
         debugMsg(ERROR, "wifi_station_scan() failed!?\n");
-        return;
+        return false;
     }
     _scanStatus = SCANNING;
     debugMsg(CONNECTION, "-->scan started @ %d<--\n", system_get_time());
-    return;
+    return true;
+}
+
+/**
+ * Returns our connection to the parent, NULL if we have none.
+ */
+meshConnectionType* ICACHE_FLASH_ATTR easyMesh::stationConnection( void ) {
+    meshConnectionList::iterator connection = _connections.begin();
+    while (connection != _connections.end()) {
+        if (connection->esp_conn->proto.tcp->local_port != _meshPort)
+            return connection;
+        connection++;
+    }
+    return NULL;
+}
+
+/**
+ * Our distance from the root. The root is the one node of the tree without a parent.
+ */
+uint8_t ICACHE_FLASH_ATTR easyMesh::hopCount( void ) {
+    if (stationConnection() == NULL)
+        return 0;
+    return _uplinkHops < 0xFF ? _uplinkHops + 1 : 0xFF;
+}
+
+/**
+ * Number of stations connected to our AP.
+ */
+uint8_t ICACHE_FLASH_ATTR easyMesh::childCount( void ) {
+    uint8_t count = 0;
+    meshConnectionList::iterator connection = _connections.begin();
+    while (connection != _connections.end()) {
+        if (connection->esp_conn->proto.tcp->local_port == _meshPort)
+            count++;
+        connection++;
+    }
+    return count;
+}
+
+/**
+ * Puts our hop count, child count, child limit and mesh size in the vendor IE of our beacons
+ * and probe responses, where scanning nodes pick them up without connecting. Called whenever
+ * one of them changes. While nobody is on our AP it is also retuned to our new depth, see
+ * apConfigure().
+ */
+void ICACHE_FLASH_ATTR easyMesh::updateBeacon( void ) {
+    if (_apBeaconInterval != 0 && _dutyPeriod == 0 && childCount() == 0 && wifi_softap_get_station_num() == 0 &&
+            apBeaconInterval() != _apBeaconInterval)
+        apConfigure();
+
+    uint8 oui[3] = MESH_IE_OUI;
+    _meshIE[0] = MESH_IE_MAGIC;
+    _meshIE[1] = MESH_IE_VERSION;
+    _meshIE[2] = hopCount();
+    _meshIE[3] = childCount();
+    _meshIE[4] = _childLimit;
+    _meshIE[5] = min(connectionCount() + 1, 255);
+
+    debugMsg(GENERAL, "updateBeacon(): hops=%u children=%u limit=%u nodes=%u\n", _meshIE[2], _meshIE[3], _meshIE[4], _meshIE[5]);
+    wifi_set_user_ie(true, oui, USER_IE_BEACON, _meshIE, MESH_IE_SIZE);
+    wifi_set_user_ie(true, oui, USER_IE_PROBE_RESP, _meshIE, MESH_IE_SIZE);
+}
+
+/**
+ * Picks up the mesh IE of the APs heard during a scan.
+ */
+void ICACHE_FLASH_ATTR easyMesh::beaconIeCb(user_ie_type type, const uint8 sa[6], const uint8 m_oui[3], uint8 *ie, uint8 ie_len, sint32 rssi) {
+    easyMesh *mesh = _stationOwner;
+    uint8 oui[3] = MESH_IE_OUI;
+    if (mesh == NULL || memcmp(m_oui, oui, 3) != 0)
+        return;
+
+    // some SDK versions hand over the whole element (0xDD, length, OUI), others only what follows
+    if (ie_len >= 5 + MESH_IE_MIN_SIZE && ie[0] == 0xDD) {
+        ie += 5;
+        ie_len -= 5;
+    }
+    if (ie_len < MESH_IE_MIN_SIZE || ie[0] != MESH_IE_MAGIC || ie[1] != MESH_IE_VERSION)
+        return;
+
+    meshBeaconInfo *beacon = mesh->findBeacon(sa);
+    if (beacon == NULL) {
+        if (mesh->_beacons.size() >= BEACON_CACHE_SIZE)
+            return;
+        meshBeaconInfo fresh;
+        memcpy(fresh.bssid, sa, 6);
+        mesh->_beacons.push_back(fresh);
+        beacon = mesh->_beacons.end() - 1;
+    }
+    beacon->hops = ie[2];
+    beacon->children = ie[3];
+    beacon->capacity = ie_len >= MESH_IE_LIMIT_SIZE ? ie[4] : MAX_CHILDREN;
+    beacon->nodes = ie_len >= MESH_IE_SIZE ? ie[5] : 0;
+}
+
+/**
+ * Returns what the AP with this bssid advertised, NULL for APs that sent no mesh IE.
+ */
+meshBeaconInfo* ICACHE_FLASH_ATTR easyMesh::findBeacon(const uint8 *bssid) {
+    SimpleList<meshBeaconInfo>::iterator beacon = _beacons.begin();
+    while (beacon != _beacons.end()) {
+        if (memcmp(beacon->bssid, bssid, 6) == 0)
+            return beacon;
+        beacon++;
+    }
+    return NULL;
+}
+
+/**
+ * How good a parent an AP would make: its signal, less a penalty for every hop it sits
+ * from the root and every child it already serves. Short, balanced trees score best.
+ */
+int16_t ICACHE_FLASH_ATTR easyMesh::parentScore(bss_info &ap) {
+    meshBeaconInfo *beacon = findBeacon(ap.bssid);
+    int16_t hops = beacon != NULL ? beacon->hops : PARENT_UNKNOWN_HOPS;
+    int16_t children = beacon != NULL ? beacon->children : 0;
+    return ap.rssi - PARENT_HOP_PENALTY * hops - PARENT_CHILD_PENALTY * children;
+}
+
+/**
+ * True if the AP advertised that it takes no more stations.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::parentFull(bss_info &ap) {
+    meshBeaconInfo *beacon = findBeacon(ap.bssid);
+    return beacon != NULL && beacon->children >= beacon->capacity;
+}
+
+/**
+ * True if the AP belongs to another mesh that ours should fold into: a bigger one, or one as
+ * big whose node has the higher chip id, so that of two nodes meeting across the gap only one
+ * moves. Without this two meshes that formed apart stay apart as long as every node has a
+ * parent, no foreign AP ever beats it by ROAM_HYSTERESIS.
+ */
+bool ICACHE_FLASH_ATTR easyMesh::biggerMesh(bss_info &ap, uint32_t apChipId) {
+    meshBeaconInfo *beacon = findBeacon(ap.bssid);
+    if (beacon == NULL || beacon->nodes == 0 || findConnection(apChipId) != NULL)
+        return false;
+    // stations that have not synced yet count too, or a root would leave a child it just got
+    uint16_t ours = min(max(connectionCount(), (uint16_t)wifi_softap_get_station_num()) + 1, 255);
+    return beacon->nodes > ours || (beacon->nodes == ours && apChipId > _chipId);
+}
+
+/**
+ * Schedules the next look for a better parent.
+ * @param interval ms until then, before the jitter by chip id.
+ */
+void ICACHE_FLASH_ATTR easyMesh::armRoamTimer( uint32_t interval ) {
+    os_timer_disarm(&_roamTimer);
+    if (_dutyPeriod != 0)
+        return;  // a sleeping leaf keeps its parent, see setDutyCycle()
+    os_timer_arm(&_roamTimer, interval + _chipId % ROAM_JITTER, 0);
+}
+
+/**
+ * Rescans the channel we are on, a parent elsewhere would move our AP and drop all our children.
+ */
+void ICACHE_FLASH_ATTR easyMesh::roamTimerCallback( void *arg ) {
+    easyMesh *mesh = (easyMesh *)arg;
+    if (mesh->stationConnection() == NULL)
+        return;  // meshConnectedCb() arms us again
+    if (!mesh->startStationScan(wifi_get_channel()))
+        mesh->armRoamTimer();
+}
+
+/**
+ * Called with fresh scan results while we have a parent. Switches only to a candidate that
+ * beats the current parent by ROAM_HYSTERESIS, and never to a node in our own subtree.
+ * A node of a bigger mesh is taken whatever its score, see biggerMesh().
+ * Our children stay on our AP throughout, only our own uplink moves.
+ */
+void ICACHE_FLASH_ATTR easyMesh::evaluateRoam( void ) {
+    struct station_config stationConf;
+    wifi_station_get_config(&stationConf);
+
+    SimpleList<bss_info>::iterator parent = _meshAPs.end();
+    SimpleList<bss_info>::iterator best = _meshAPs.end();
+    SimpleList<bss_info>::iterator merge = _meshAPs.end();
+    SimpleList<bss_info>::iterator ap = _meshAPs.begin();
+    while (ap != _meshAPs.end()) {
+        if (strncmp((char *) ap->ssid, (char *) stationConf.ssid, 32) == 0) {
+            parent = ap;
+        } else if (!parentFull(*ap)) {
+            String apChipId = (char *) ap->ssid + _meshPrefix.length();
+            meshConnectionType *conn = findConnection(apChipId.toInt());
+            bool inSubtree = conn != NULL && conn->esp_conn->proto.tcp->local_port == _meshPort;
+            if (!inSubtree && (best == _meshAPs.end() || parentScore(*ap) > parentScore(*best)))
+                best = ap;
+            if (biggerMesh(*ap, apChipId.toInt()) && (merge == _meshAPs.end() || parentScore(*ap) > parentScore(*merge)))
+                merge = ap;
+        }
+        ap++;
+    }
+
+    if (parent == _meshAPs.end()) {  // missed it this time, don't act on half a picture
+        _meshAPs.clear();
+        armRoamTimer();
+        return;
+    }
+
+    meshBeaconInfo *beacon = findBeacon(parent->bssid);
+    _uplinkHops = beacon != NULL ? beacon->hops : PARENT_UNKNOWN_HOPS;
+    updateBeacon();
+
+    if (merge != _meshAPs.end()) {
+        best = merge;
+    } else if (best == _meshAPs.end() || parentScore(*best) < parentScore(*parent) + ROAM_HYSTERESIS) {
+        _meshAPs.clear();  // stale by the time the link is lost, the parent cache does better then
+        armRoamTimer();
+        return;
+    }
+
+    debugMsg(CONNECTION, "evaluateRoam(): moving from %s (%d) to %s (%d)\n",
+             (char *) parent->ssid, parentScore(*parent), (char *) best->ssid, parentScore(*best));
+    bss_info target = *best;
+    _meshAPs.clear();
+    _meshAPs.push_back(target);
+    // meshDisconCb() drops the station and connectToBestAP() then takes the target
+    closeConnection(stationConnection());
 }
 
 /**
@@ -88,7 +398,7 @@ void ICACHE_FLASH_ATTR easyMesh::startStationScan( void ) {
  * TODO eliminate this function on future releases.
  */
 void ICACHE_FLASH_ATTR easyMesh::scanTimerCallback( void *arg ) {
-    staticThis->startStationScan();
+    ((easyMesh *)arg)->startStationScan();
 }
 
 /**
@@ -98,39 +408,48 @@ void ICACHE_FLASH_ATTR easyMesh::scanTimerCallback( void *arg ) {
 void ICACHE_FLASH_ATTR easyMesh::stationScanCb(void *arg, STATUS status) {
     char ssid[32];
     bss_info *bssInfo = (bss_info *) arg;
-    staticThis->debugMsg(CONNECTION, "stationScanCb():-- > scan finished @ % d < --\n", system_get_time());
-    staticThis->_scanStatus = IDLE;
+    easyMesh *mesh = _stationOwner;  // set by startStationScan()
+    debugMsg(CONNECTION, "stationScanCb():-- > scan finished @ % d < --\n", system_get_time());
+    mesh->_scanStatus = IDLE;
 
-    staticThis->_meshAPs.clear();
+    mesh->_meshAPs.clear();
     while (bssInfo != NULL) {
-        staticThis->debugMsg(CONNECTION, "\tfound : % s, % ddBm", (char *) bssInfo->ssid, (int16_t) bssInfo->rssi);
-        if (strncmp((char *) bssInfo->ssid, staticThis->_meshPrefix.c_str(), staticThis->_meshPrefix.length()) == 0) {
-            staticThis->debugMsg(CONNECTION, " MESH_PRE< ---");
-            staticThis->_meshAPs.push_back(*bssInfo);
+        debugMsg(CONNECTION, "\tfound : % s, % ddBm", (char *) bssInfo->ssid, (int16_t) bssInfo->rssi);
+        if (strncmp((char *) bssInfo->ssid, mesh->_meshPrefix.c_str(), mesh->_meshPrefix.length()) == 0) {
+            debugMsg(CONNECTION, " MESH_PRE< ---");
+            mesh->_meshAPs.push_back(*bssInfo);
         }
-        staticThis->debugMsg(CONNECTION, "\n");
+        debugMsg(CONNECTION, "\n");
         bssInfo = STAILQ_NEXT(bssInfo, next);
     }
-    staticThis->debugMsg(CONNECTION, "\tFound % d nodes with _meshPrefix = \"%s\"\n",
-                         staticThis->_meshAPs.size(),
-                         staticThis->_meshPrefix.c_str());
-
-    staticThis->connectToBestAP();
+    debugMsg(CONNECTION, "\tFound % d nodes with _meshPrefix = \"%s\"\n",
+                         mesh->_meshAPs.size(),
+                         mesh->_meshPrefix.c_str());
+
+    if (mesh->stationConnection() != NULL)
+        mesh->evaluateRoam();
+    else
+        mesh->connectToBestAP();
 }
 
 /**
- * Drop the connected AP (if there is one) and try to find the one with the best signal.
- * If not IDLE this routine will fail. If no nodes are found retry in 5 sec.
- * If at least 1 meshAP exists find the one with the strongest signal  that is not already connected to our AP.
+ * Drop the connected AP (if there is one) and try to find the best parent, see parentScore().
+ * If not IDLE this routine will fail. If no nodes are left, go through rejoinFromCache() and
+ * only then retry in SCAN_INTERVAL.
+ * If at least 1 meshAP exists find the best scoring one that is neither already in our mesh nor full.
+ * Once others are on our AP we only join a bigger mesh, see biggerMesh(), else every node that
+ * powers on would pull the whole tree under it.
  * Finally drop bestAP from mesh list, so if doesn't work out, we can try the next one.
  */
 bool ICACHE_FLASH_ATTR easyMesh::connectToBestAP( void ) {
     debugMsg(CONNECTION, "connectToBestAP():");
+    _stationOwner = this;
 
     SimpleList<bss_info>::iterator ap = _meshAPs.begin();
     while (ap != _meshAPs.end()) {
         String apChipId = (char *) ap->ssid + _meshPrefix.length();
-        if (findConnection(apChipId.toInt()) != NULL) {
+        if (findConnection(apChipId.toInt()) != NULL || parentFull(*ap) ||
+                ((_connections.size() > 0 || wifi_softap_get_station_num() > 0) && !biggerMesh(*ap, apChipId.toInt()))) {
             ap = _meshAPs.erase(ap);
         } else {
             ap++;
@@ -143,28 +462,34 @@ bool ICACHE_FLASH_ATTR easyMesh::connectToBestAP( void ) {
         return false;
     }
 
-    if (staticThis->_meshAPs.empty()) {
+    if (_meshAPs.empty()) {
+        if (rejoinFromCache())
+            return true;
+
         debugMsg(CONNECTION, "connectToBestAP(): no nodes left in list, rescanning\n");
-        os_timer_setfn(&_scanTimer, scanTimerCallback, NULL);
+        os_timer_setfn(&_scanTimer, scanTimerCallback, this);
         os_timer_arm(&_scanTimer, SCAN_INTERVAL, 0);
         return false;
     }
 
     _nodeStatus = FOUND_MESH;
-    SimpleList<bss_info>::iterator bestAP = staticThis->_meshAPs.begin();
-    SimpleList<bss_info>::iterator i = staticThis->_meshAPs.begin();
-    while (i != staticThis->_meshAPs.end()) {
-        if (i->rssi > bestAP->rssi) {
+    SimpleList<bss_info>::iterator bestAP = _meshAPs.begin();
+    SimpleList<bss_info>::iterator i = _meshAPs.begin();
+    while (i != _meshAPs.end()) {
+        if (parentScore(*i) > parentScore(*bestAP)) {
             bestAP = i;
         }
         ++i;
     }
 
-    debugMsg(CONNECTION, "connectToBestAP(): Best AP is %s<---\n", (char *) bestAP->ssid);
+    meshBeaconInfo *beacon = findBeacon(bestAP->bssid);
+    _uplinkHops = beacon != NULL ? beacon->hops : PARENT_UNKNOWN_HOPS;
+
+    debugMsg(CONNECTION, "connectToBestAP(): Best AP is %s score=%d<---\n", (char *) bestAP->ssid, parentScore(*bestAP));
     struct station_config stationConf;
-    stationConf.bssid_set = 0;
+    memset(&stationConf, 0, sizeof(stationConf));
     memcpy(&stationConf.ssid, bestAP->ssid, 32);
-    memcpy(&stationConf.password, _meshPassword.c_str(), 64);
+    memcpy(&stationConf.password, _meshPassword.c_str(), min(_meshPassword.length() + 1, (unsigned int)64));
     wifi_station_set_config(&stationConf);
     wifi_station_connect();
 
@@ -184,8 +509,10 @@ void ICACHE_FLASH_ATTR easyMesh::tcpConnect( void ) {
     if (wifi_station_get_connect_status() == STATION_GOT_IP && ipconfig.ip.addr != 0) {
         debugMsg(CONNECTION, "tcpConnect(): Got local IP=%d.%d.%d.%d\n", IP2STR(&ipconfig.ip));
         debugMsg(CONNECTION, "tcpConnect(): Dest IP=%d.%d.%d.%d\n", IP2STR(&ipconfig.gw));
+        assignSubnet(ipconfig);
 
         _stationConn.type = ESPCONN_TCP;
+        _stationConn.reverse = NULL;  // set by meshConnectedCb() once connected
         _stationConn.state = ESPCONN_NONE;
         _stationConn.proto.tcp = &_stationTcp;
         _stationConn.proto.tcp->local_port = espconn_port();
@@ -0,0 +1,126 @@
+#ifndef   _MESH_SLAB_H_
+#define   _MESH_SLAB_H_
+
+#include <Arduino.h>
+
+#define SLAB_NO_INDEX   0xFF    // index of a handle that refers to nothing
+
+/**
+ * Refers to a slab slot and the occupant it held when the handle was taken. Freeing the slot
+ * bumps its generation, so a handle kept across a close resolves to NULL rather than to
+ * whatever moved in afterwards.
+ */
+struct meshHandle {
+    uint8_t index = SLAB_NO_INDEX;
+    uint8_t generation = 0;
+};
+
+/**
+ * Fixed array of N slots for T. Items never move and allocate()/erase() never touch the heap,
+ * so a pointer stays valid until its item is erased, and a meshHandle tells when it was.
+ * Iteration skips free slots and keeps the SimpleList style loops working:
+ *
+ *     meshSlab<T, N>::iterator item = slab.begin();
+ *     while ( item != slab.end() ) { ...; item++; }
+ */
+template <typename T, uint8_t N>
+class meshSlab {
+public:
+    class iterator {
+    public:
+        iterator( meshSlab *slab, uint8_t index ) : _slab( slab ), _index( index ) { skipFree(); };
+
+        T* operator->( void ) const { return &_slab->_slots[_index]; };
+
+        T& operator*( void ) const { return _slab->_slots[_index]; };
+
+        operator T*( void ) const { return _index < N ? &_slab->_slots[_index] : NULL; };
+
+        iterator& operator++( void ) { _index++; skipFree(); return *this; };
+
+        iterator operator++( int ) { iterator was = *this; ++*this; return was; };
+
+        bool operator==( const iterator &other ) const { return _index == other._index; };
+
+        bool operator!=( const iterator &other ) const { return _index != other._index; };
+
+    protected:
+        void skipFree( void ) { while ( _index < N && !_slab->_used[_index] ) _index++; };
+
+        meshSlab *_slab;
+        uint8_t _index;
+    };
+
+    iterator begin( void ) { return iterator( this, 0 ); };
+
+    iterator end( void ) { return iterator( this, N ); };
+
+    /**
+     * Takes a free slot and resets it to a default T.
+     * @return The new item, NULL if all N slots are taken.
+     */
+    T* allocate( void ) {
+        for ( uint8_t i = 0; i < N; i++ ) {
+            if ( !_used[i] ) {
+                _slots[i] = T();
+                _used[i] = true;
+                _count++;
+                return &_slots[i];
+            }
+        }
+        return NULL;
+    };
+
+    /**
+     * Frees the slot of item. Anything it owns has to be released by the caller first.
+     * @return The next item, for erasing while iterating.
+     */
+    iterator erase( T *item ) {
+        uint8_t i = indexOf( item );
+        if ( i == SLAB_NO_INDEX )
+            return end();
+
+        _slots[i] = T();  // a stale pointer into the slot finds nothing it recognises
+        _used[i] = false;
+        _generation[i]++;
+        _count--;
+        return iterator( this, i + 1 );
+    };
+
+    meshHandle handleOf( T *item ) {
+        meshHandle handle;
+        handle.index = indexOf( item );
+        if ( handle.index != SLAB_NO_INDEX )
+            handle.generation = _generation[handle.index];
+        return handle;
+    };
+
+    /**
+     * Returns the item a handle refers to, NULL if it has been erased since.
+     */
+    T* get( meshHandle handle ) {
+        if ( handle.index >= N || !_used[handle.index] || _generation[handle.index] != handle.generation )
+            return NULL;
+        return &_slots[handle.index];
+    };
+
+    uint8_t size( void ) { return _count; };
+
+    bool full( void ) { return _count == N; };
+
+    uint8_t capacity( void ) { return N; };
+
+protected:
+    uint8_t indexOf( T *item ) {
+        if ( item < _slots || item >= _slots + N || !_used[item - _slots] )
+            return SLAB_NO_INDEX;
+        return item - _slots;
+    };
+
+    T _slots[N];
+    bool _used[N] = {};
+    uint8_t _generation[N] = {};
+    uint8_t _count = 0;
+};
+
+#endif
@@ -0,0 +1,176 @@
+#include <Arduino.h>
+#include <SimpleList.h>
+
+#include "easyMesh.h"
+
+/**
+ * Counts one run of the measured routine.
+ * @param cycles CPU cycles the run took.
+ */
+void ICACHE_FLASH_ATTR meshCycleHistogram::record( uint32_t cycles ) {
+    uint8_t i = 0;
+    uint32_t limit = 1024;
+    while ( i < STATS_CYCLE_BUCKETS - 1 && cycles >= limit ) {
+        limit <<= 2;
+        i++;
+    }
+    buckets[i]++;
+    if ( cycles > peak )
+        peak = cycles;
+}
+
+/**
+ * Returns the stats of the direct connection to chipId, NULL if there is none.
+ */
+const meshConnectionStats* ICACHE_FLASH_ATTR easyMesh::getConnectionStats( uint32_t chipId ) {
+    meshConnectionList::iterator connection = _connections.begin();
+    while ( connection != _connections.end() ) {
+        if ( connection->chipId == chipId )
+            return &connection->stats;
+        connection++;
+    }
+    return NULL;
+}
+
+/**
+ * Zeroes the mesh wide counters and those of every open connection.
+ */
+void ICACHE_FLASH_ATTR easyMesh::resetStats( void ) {
+    _stats = meshStats();
+    meshConnectionList::iterator connection = _connections.begin();
+    while ( connection != _connections.end() ) {
+        connection->stats = meshConnectionStats();
+        connection++;
+    }
+}
+
+/**
+ * Set a callback routine for STATS_REPLY packages, the answers to requestStats().
+ */
+void ICACHE_FLASH_ATTR easyMesh::setStatsCallback( void(*onStats)(uint32_t from, String &stats) ) {
+    _statsCallback = onStats;
+}
+
+/**
+ * Asks a node, or with destId 0 every node, to send us its stats as a STATS_REPLY.
+ * @param destId The node to ask, 0 for the whole mesh.
+ */
+sendStatusType ICACHE_FLASH_ATTR easyMesh::requestStats( uint32_t destId ) {
+    String empty;
+    if ( destId == 0 )
+        return broadcastMessage( _chipId, STATS_REQUEST, empty, NULL, nextBroadcastSeq() );
+    return sendMessage( destId, STATS_REQUEST, empty );
+}
+
+/**
+ * Answers a STATS_REQUEST with our stats, routed back to whoever asked.
+ */
+void ICACHE_FLASH_ATTR easyMesh::handleStatsRequest( uint32_t fromId ) {
+    String stats = statsJson();
+    sendMessage( fromId, STATS_REPLY, stats );
+}
+
+static void ICACHE_FLASH_ATTR appendConnectionStats( String &out, const meshConnectionStats &stats ) {
+    out += "\"sent\":" + String( stats.sent );
+    out += ",\"recv\":" + String( stats.received );
+    out += ",\"fwd\":" + String( stats.forwarded );
+    out += ",\"txBytes\":" + String( stats.bytesSent );
+    out += ",\"rxBytes\":" + String( stats.bytesReceived );
+    out += ",\"sendErr\":" + String( stats.sendErrors );
+    out += ",\"parseErr\":" + String( stats.parseErrors );
+    out += ",\"queueHigh\":" + String( stats.queueHighWater );
+    if ( stats.rtt != 0 )
+        out += ",\"rtt\":" + String( stats.rtt );
+}
+
+static void ICACHE_FLASH_ATTR appendHistogram( String &out, const char *key, const meshCycleHistogram &histogram ) {
+    out += ",\"";
+    out += key;
+    out += "\":[";
+    for ( uint8_t i = 0; i < STATS_CYCLE_BUCKETS; i++ ) {
+        if ( i > 0 )
+            out += ',';
+        out += String( histogram.buckets[i] );
+    }
+    out += "],\"";
+    out += key;
+    out += "Peak\":" + String( histogram.peak );
+}
+
+/**
+ * Our stats as a JSON object, the payload of a STATS_REPLY.
+ */
+String ICACHE_FLASH_ATTR easyMesh::statsJson( void ) {
+    String ret = "{";
+    appendConnectionStats( ret, _stats.total );
+    ret += ",\"drops\":" + String( _queueDrops );
+    ret += ",\"timeouts\":" + String( _stats.timeoutDrops );
+    ret += ",\"syncRounds\":" + String( _stats.timeSyncRounds );
+    ret += ",\"adjust\":" + String( _stats.lastAdjustment );
+    ret += ",\"syncError\":" + String( _stats.syncError );
+    ret += ",\"skew\":" + String( _stats.skew );
+    appendHistogram( ret, "recvCycles", _stats.recvCycles );
+    appendHistogram( ret, "manageCycles", _stats.manageCycles );
+
+    ret += ",\"conns\":[";
+    meshConnectionList::iterator connection = _connections.begin();
+    while ( connection != _connections.end() ) {
+        if ( connection != _connections.begin() )
+            ret += ',';
+        ret += "{\"chipId\":" + String( connection->chipId ) + ",";
+        appendConnectionStats( ret, connection->stats );
+        ret += "}";
+        connection++;
+    }
+    ret += "]}";
+    return ret;
+}
+
+/**
+ * Counts packages that espconn_send accepted on conn.
+ */
+void ICACHE_FLASH_ATTR easyMesh::countSent( meshConnectionType *conn, uint16_t packages, uint16_t bytes ) {
+    conn->stats.sent += packages;
+    conn->stats.bytesSent += bytes;
+    _stats.total.sent += packages;
+    _stats.total.bytesSent += bytes;
+}
+
+/**
+ * Counts one complete package received on conn.
+ */
+void ICACHE_FLASH_ATTR easyMesh::countReceived( meshConnectionType *conn, uint16_t bytes ) {
+    conn->stats.received++;
+    conn->stats.bytesReceived += bytes;
+    _stats.total.received++;
+    _stats.total.bytesReceived += bytes;
+}
+
+/**
+ * Counts a package for another node passed on through conn.
+ */
+void ICACHE_FLASH_ATTR easyMesh::countForwarded( meshConnectionType *conn ) {
+    conn->stats.forwarded++;
+    _stats.total.forwarded++;
+}
+
+void ICACHE_FLASH_ATTR easyMesh::countSendError( meshConnectionType *conn ) {
+    conn->stats.sendErrors++;
+    _stats.total.sendErrors++;
+}
+
+void ICACHE_FLASH_ATTR easyMesh::countParseError( meshConnectionType *conn ) {
+    conn->stats.parseErrors++;
+    _stats.total.parseErrors++;
+}
+
+/**
+ * Updates the send queue high-water marks after a push.
+ */
+void ICACHE_FLASH_ATTR easyMesh::countQueued( meshConnectionType *conn ) {
+    uint16_t used = conn->sendQueue.used();
+    if ( used > conn->stats.queueHighWater )
+        conn->stats.queueHighWater = used;
+    if ( used > _stats.total.queueHighWater )
+        _stats.total.queueHighWater = used;
+}
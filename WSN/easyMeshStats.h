@@ -0,0 +1,61 @@
+#ifndef   _MESH_STATS_H_
+#define   _MESH_STATS_H_
+
+#include <Arduino.h>
+
+#define STATS_CYCLE_BUCKETS     8   // bucket i counts runs below 1024 << 2*i cycles, the last one everything longer
+
+/**
+ * Counters are only touched from SDK task context (espconn callbacks, os_timers, loop()),
+ * which never preempt each other on the ESP8266, so plain increments are atomic here.
+ */
+
+/**
+ * Coarse histogram of CPU cycles spent in one routine.
+ */
+class meshCycleHistogram {
+public:
+    void record(uint32_t cycles);
+
+    uint32_t buckets[STATS_CYCLE_BUCKETS] = {0};
+    uint32_t peak = 0;      // longest run seen
+};
+
+/**
+ * Records the cycles between construction and destruction, covers every early return.
+ */
+class meshCycleTimer {
+public:
+    meshCycleTimer(meshCycleHistogram &histogram) : _histogram( histogram ), _start( ESP.getCycleCount() ) {};
+
+    ~meshCycleTimer(void) { _histogram.record( ESP.getCycleCount() - _start ); };
+
+protected:
+    meshCycleHistogram &_histogram;
+    uint32_t _start;
+};
+
+struct meshConnectionStats {
+    uint32_t sent = 0;          // packages handed to espconn_send
+    uint32_t received = 0;      // complete packages received
+    uint32_t forwarded = 0;     // packages for other nodes passed on
+    uint32_t bytesSent = 0;
+    uint32_t bytesReceived = 0;
+    uint32_t sendErrors = 0;    // espconn_send failures
+    uint32_t parseErrors = 0;   // packages or stream bytes meshRecvCb() could not make sense of
+    uint16_t queueHighWater = 0;  // most send queue bytes in use at once
+    uint32_t rtt = 0;           // us, last PING round trip (0 in the totals)
+};
+
+struct meshStats {
+    meshConnectionStats total;  // summed over all connections, closed ones included
+    uint32_t timeoutDrops = 0;  // connections closed on NODE_TIMEOUT
+    uint32_t timeSyncRounds = 0;
+    int32_t lastAdjustment = 0; // us the clock moved on the last adopted time sync
+    uint32_t syncError = 0;     // us, error bound of that adjustment, half the best round trip
+    int32_t skew = 0;           // ppb, drift correction getNodeTime() applies
+    meshCycleHistogram recvCycles;
+    meshCycleHistogram manageCycles;
+};
+
+#endif //   _MESH_STATS_H_
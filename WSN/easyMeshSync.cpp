@@ -5,104 +5,243 @@
 #include "easyMesh.h"
 #include "easyMeshSync.h"
 
-extern easyMesh* staticThis;
-uint32_t timeAdjuster = 0;
+/**
+ * system_get_time() extended to 64 bits. It has to be called at least once per wrap, about
+ * 71 minutes; manageConnections() keeps the update timer armed at least every CLOCK_WRAP_GUARD for that.
+ */
+uint64_t ICACHE_FLASH_ATTR meshClock::systemTime64( void ) {
+    uint32_t now = system_get_time();
+    if ( now < _lastSystemTime )
+        _systemWraps++;
+    _lastSystemTime = now;
+    return ( (uint64_t)_systemWraps << 32 ) | now;
+}
+
+/**
+ * The correction the skew has built up since _skewBase.
+ */
+int32_t ICACHE_FLASH_ATTR meshClock::skewDrift( uint64_t now ) {
+    return (int32_t)( (int64_t)( now - _skewBase ) * _skew / 1000000000 );
+}
 
 /**
- * Returns the adjusted node time.
+ * Moves the drift built up so far into _adjuster, keeping the product in skewDrift() small.
+ */
+void ICACHE_FLASH_ATTR meshClock::foldSkew( uint64_t now ) {
+    _adjuster += skewDrift( now );
+    _skewBase = now;
+}
+
+/**
+ * The adjusted node time: the last offset plus the drift the skew estimate predicts since.
+ */
+uint64_t ICACHE_FLASH_ATTR meshClock::nodeTime64( void ) {
+    uint64_t now = systemTime64();
+    if ( now - _skewBase >= TIME_SKEW_FOLD )
+        foldSkew( now );
+
+    return now + _adjuster + skewDrift( now );
+}
+
+/**
+ * Applies an adopted offset. The residual offset since the last adjustment updates the skew
+ * estimate, and how fast it builds up sets the interval to the next sync. The residual of a
+ * short interval is mostly sample noise, so it counts as if built up over TIME_SKEW_DAMPING more,
+ * and the interval at most doubles per sync: one small residual may just have been lucky.
+ * The skew is only measured between adjustments from the same node, the first from another
+ * is that node's offset from the last one, not our drift.
+ * @param adjustment us the node time has to move.
+ * @param interval Updated with the us until the next sync.
+ * @param source Chip id of the node adopted from.
+ */
+void ICACHE_FLASH_ATTR meshClock::adopt( int32_t adjustment, uint32_t &interval, uint32_t source ) {
+    uint64_t now = systemTime64();
+    foldSkew( now );
+    _adjuster += adjustment;
+
+    uint32_t residual = adjustment < 0 ? -adjustment : adjustment;
+    uint64_t elapsed = now - _lastAdoption;
+    if ( residual > TIME_SKEW_MAX_STEP ) {  // joined another timebase, what we knew of the drift is void
+        _skew = 0;
+        interval = TIME_SYNC_MIN_INTERVAL;
+    } else if ( source != _skewSource ) {
+        interval = TIME_SYNC_MIN_INTERVAL;
+    } else if ( _lastAdoption != 0 && elapsed >= TIME_SYNC_MIN_INTERVAL / 2 ) {
+        int64_t measured = (int64_t)adjustment * 1000000000 / (int64_t)( elapsed + TIME_SKEW_DAMPING );
+        _skew = constrain( _skew + measured, -TIME_SKEW_MAX, TIME_SKEW_MAX );
+
+        uint64_t next = residual > 0 ? (uint64_t)TIME_SYNC_TARGET_ERROR * elapsed / residual : TIME_SYNC_MAX_INTERVAL;
+        next = min( next, (uint64_t)interval * 2 );
+        interval = constrain( next, (uint64_t)TIME_SYNC_MIN_INTERVAL, (uint64_t)TIME_SYNC_MAX_INTERVAL );
+    }
+    _lastAdoption = now;
+    _skewSource = source;
+}
+
+/**
+ * FNV-1a hash of a subs JSON array, enough to tell whether the topology behind a connection changed.
+ */
+static uint32_t ICACHE_FLASH_ATTR subsHash( const uint8_t *subs, uint16_t length ) {
+    uint32_t hash = 2166136261u;
+    for ( uint16_t i = 0; i < length; i++ ) {
+        hash ^= subs[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Returns the adjusted node time, 64 bits wide so it never wraps: the last offset plus the
+ * drift the skew estimate predicts since. It still steps when a time sync adopts another timebase.
+ */
+uint64_t ICACHE_FLASH_ATTR easyMesh::getNodeTime64( void ) {
+    return _clock.nodeTime64();
+}
+
+/**
+ * Returns the adjusted node time, the low 32 bits of getNodeTime64(). This is what goes on the
+ * wire; compare it only by signed difference (see timeReached()), it wraps every 71 minutes.
  */
 uint32_t ICACHE_FLASH_ATTR easyMesh::getNodeTime( void ) {
-    uint32_t ret = system_get_time() + timeAdjuster;
-    debugMsg( GENERAL, "getNodeTime(): time=%d\n", ret);
+    uint32_t ret = (uint32_t)getNodeTime64();
+    debugMsg( GENERAL, "getNodeTime(): time=%u\n", ret);
     return ret;
 }
 
 /**
- * Returns the timestamp of the mesh network.
+ * Returns the timestamp of the mesh network. Past the first it also carries when the stamp
+ * it answers arrived, so the far end can take our time in between out of the round trip.
+ * @param nodeTime Our node time, taken right before the stamp is sent.
+ * @param buf Receives the stamp, TIME_STAMP_SIZE bytes.
+ * @return The stamp length.
  */
-String ICACHE_FLASH_ATTR timeSync::buildTimeStamp( void ) {
-    staticThis->debugMsg( SYNC, "buildTimeStamp(): num=%d\n", num);
+uint16_t ICACHE_FLASH_ATTR timeSync::buildTimeStamp( uint32_t nodeTime, char *buf ) {
+    debugMsg( SYNC, "buildTimeStamp(): num=%d\n", num);
 
     if ( num > TIME_SYNC_CYCLES )
-        staticThis->debugMsg( ERROR, "buildTimeStamp(): timeSync not started properly\n");
+        debugMsg( ERROR, "buildTimeStamp(): timeSync not started properly\n");
 
-    StaticJsonBuffer<75> jsonBuffer;
+    StaticJsonBuffer<JSON_OBJECT_SIZE(4)> jsonBuffer;
     JsonObject& timeStampObj = jsonBuffer.createObject();
-    times[num] = staticThis->getNodeTime();
+    times[num] = nodeTime;
+    ownParity = num % 2;
     timeStampObj["time"] = times[num];
     timeStampObj["num"] = num;
     bool remoteAdopt = !adopt;
     timeStampObj["adopt"] = remoteAdopt;
+    if ( num > 0 )
+        timeStampObj["rx"] = recvTimes[num - 1];
 
-    String timeStampStr;
-    timeStampObj.printTo( timeStampStr );
+    uint16_t length = timeStampObj.printTo( buf, TIME_STAMP_SIZE );
 
-    staticThis->debugMsg( SYNC, "buildTimeStamp(): timeStamp=%s\n", timeStampStr.c_str() );
-    return timeStampStr;
+    debugMsg( SYNC, "buildTimeStamp(): timeStamp=%s\n", buf );
+    return length;
 }
 
 /**
  *  Sets the time related internal variables of the mesh.
  *  @param str the given timestamp
+ *  @param recvTime our node time when the package carrying it arrived
+ *  @param keepOwn drop the peer's opening stamp if it crossed our own, unanswered one
+ *  @return true if the exchange goes on and buildTimeStamp() should answer
  */
-bool ICACHE_FLASH_ATTR timeSync::processTimeStamp( String &str ) {
-    staticThis->debugMsg( SYNC, "processTimeStamp(): str=%s\n", str.c_str());
+bool ICACHE_FLASH_ATTR timeSync::processTimeStamp( String &str, uint32_t recvTime, bool keepOwn ) {
+    debugMsg( SYNC, "processTimeStamp(): str=%s\n", str.c_str());
 
-    DynamicJsonBuffer jsonBuffer(50 );
+    StaticJsonBuffer<JSON_OBJECT_SIZE(4) + 64> jsonBuffer;  // four values, plus a copy of str
     JsonObject& timeStampObj = jsonBuffer.parseObject(str);
 
     if ( !timeStampObj.success() ) {
-        staticThis->debugMsg( ERROR, "processTimeStamp(): out of memory1?\n" );
+        debugMsg( ERROR, "processTimeStamp(): out of memory1?\n" );
         return false;
     }
 
-    num = timeStampObj.get<uint32_t>("num");
+    int8_t remoteNum = timeStampObj.get<uint32_t>("num");
+    if ( remoteNum < 0 || remoteNum >= TIME_SYNC_CYCLES ) {
+        debugMsg( ERROR, "processTimeStamp(): bad num=%d\n", remoteNum );
+        return false;
+    }
+    if ( keepOwn && remoteNum == 0 && num == 0 ) {
+        debugMsg( SYNC, "processTimeStamp(): crossed our own first stamp, dropped\n" );
+        return false;
+    }
+    num = remoteNum;
 
     times[num] = timeStampObj.get<uint32_t>("time");
+    recvTimes[num] = recvTime;
     adopt = timeStampObj.get<bool>("adopt");
+    peerRecv = timeStampObj.containsKey("rx");
+    peerRecvTimes[num] = peerRecv ? timeStampObj.get<uint32_t>("rx") : times[num];
 
     num++;
 
-    if ( num < TIME_SYNC_CYCLES ) {
-        str = buildTimeStamp();
-        return true;
-    }
-    else {
-        return false;
-    }
+    return num < TIME_SYNC_CYCLES;
 }
 
 /**
  *  Adjusts the mesh time periodically.
+ *  Each of our stamps and the remote stamp answering it make one sample, as in NTP: the offset
+ *  is the mean of the two one way differences, the delay the round trip less the time the remote
+ *  held our stamp (which older nodes do not report, it then counts as delay). Only samples close
+ *  to the shortest delay are averaged: one that waited behind a busy link was held up in one
+ *  direction only, which would show up as offset. Half the shortest delay is the error bound.
+ *  A whole exchange that never got near the link's quiet round trip is not adopted at all, it
+ *  is retried after TIME_SYNC_MIN_INTERVAL.
+ *  meshClock::adopt() applies the result and works out the interval to the next sync.
+ *  @param clock The clock to adjust.
+ *  @param source Chip id of the node at the far end.
+ *  @return The adjustment applied to the clock, in us.
  */
-void ICACHE_FLASH_ATTR timeSync::calcAdjustment ( bool odd ) {
-    staticThis->debugMsg(SYNC, "calcAdjustment(): odd=%u\n", odd);
-
-    uint32_t bestInterval = 0xFFFFFFFF;
-    uint8_t bestIndex;
-    uint32_t temp;
+int32_t ICACHE_FLASH_ATTR timeSync::calcAdjustment ( bool odd, meshClock &clock, uint32_t source ) {
+    debugMsg(SYNC, "calcAdjustment(): odd=%u\n", odd);
+
+    uint32_t bestDelay = 0xFFFFFFFF;
+    for (uint8_t i = odd; i + 1 < TIME_SYNC_CYCLES; i += 2) {
+        uint32_t delay = ( recvTimes[i + 1] - times[i] ) - ( times[i + 1] - peerRecvTimes[i + 1] );
+        if (delay < bestDelay)
+            bestDelay = delay;
+    }
 
-    for (int i = 0; i < TIME_SYNC_CYCLES; i++) {
+    int64_t offsetSum = 0;
+    uint8_t samples = 0;
+    for (uint8_t i = odd; i + 1 < TIME_SYNC_CYCLES; i += 2) {
+        uint32_t delay = ( recvTimes[i + 1] - times[i] ) - ( times[i + 1] - peerRecvTimes[i + 1] );
+        if (delay > bestDelay + TIME_SYNC_DELAY_SLACK)
+            continue;
+        offsetSum += ( (int64_t)(int32_t)( peerRecvTimes[i + 1] - times[i] ) + (int32_t)( times[i + 1] - recvTimes[i + 1] ) ) / 2;
+        samples++;
+    }
+    int32_t adjustment = (int32_t)( offsetSum / samples );
+    error = bestDelay / 2;
 
-        if (i % 2 == odd) {
-            temp = times[i + 2] - times[i];
+    debugMsg(SYNC, "best delay=%u, %u samples, adjustment=%d\n", bestDelay, samples, adjustment);
 
-            if (i < TIME_SYNC_CYCLES - 2) {
-                if (temp < bestInterval) {
-                    bestInterval = temp;
-                    bestIndex = i;
-                }
-            }
-        }
+    if (shortestDelay != 0 && bestDelay > shortestDelay * 2) {
+        debugMsg(SYNC, "calcAdjustment(): delay %u against %u when quiet, not adopted\n", bestDelay, shortestDelay);
+        shortestDelay = ( shortestDelay + bestDelay ) / 2;  // in case the link got slower for good
+        interval = TIME_SYNC_MIN_INTERVAL;
+        return 0;
     }
-    staticThis->debugMsg(SYNC, "best interval=%u, best index=%u\n", bestInterval, bestIndex);
+    if (shortestDelay == 0 || bestDelay < shortestDelay)
+        shortestDelay = bestDelay;
 
-    uint32_t adopterTime = times[bestIndex] + (bestInterval / 2);
-    uint32_t adjustment = times[bestIndex + 1] - adopterTime;
+    clock.adopt( adjustment, interval, source );
 
-    staticThis->debugMsg(SYNC, "new calc time=%u, adoptedTime=%u\n", adopterTime + adjustment, times[bestIndex + 1]);
+    debugMsg(SYNC, "calcAdjustment(): error=%u skew=%dppb next sync in %ums\n", error, clock.skew(), interval / 1000);
+    return adjustment;
+}
 
-    timeAdjuster += adjustment;
+/**
+ *  Moves what we hold of an exchange in our own time along with a clock adjustment, so the
+ *  receive time our next stamp reports is in the same timebase as the stamp itself.
+ *  @param adjustment us the node time just moved.
+ */
+void ICACHE_FLASH_ATTR timeSync::shift( int32_t adjustment ) {
+    for ( uint8_t i = 0; i < TIME_SYNC_CYCLES; i++ ) {
+        recvTimes[i] += adjustment;
+        if ( i % 2 == ownParity )
+            times[i] += adjustment;
+    }
 }
 
 /**
@@ -111,12 +250,122 @@ void ICACHE_FLASH_ATTR timeSync::calcAdjustment ( bool odd ) {
 void ICACHE_FLASH_ATTR easyMesh::startNodeSync( meshConnectionType *conn ) {
     debugMsg( SYNC, "startNodeSync(): with %u\n", conn->chipId);
 
-    String subs = subConnectionJson( conn );
-    sendMessage( conn, conn->chipId, NODE_SYNC_REQUEST, subs );
+    sendNodeSync( conn, NODE_SYNC_REQUEST );
     conn->nodeSyncRequest = getNodeTime();
     conn->nodeSyncStatus = IN_PROGRESS;
 }
 
+/**
+ * Sends a NODE_SYNC_REQUEST or NODE_SYNC_REPLY. Along with the subs go their hash and the hash
+ * of the peer's subs we hold; once the peer reports holding our current subs only the hashes
+ * are exchanged. Older peers never report a hash, so they keep getting the full subs.
+ * It also advertises that we answer PING, which replaces nodeSync as the keepalive, and
+ * whether we are a sink, our wake schedule if we sleep, and our hops from the root, which our
+ * children take over as their parent's, see handleNodeSync().
+ * @param conn The connection to sync.
+ * @param type NODE_SYNC_REQUEST or NODE_SYNC_REPLY.
+ */
+void ICACHE_FLASH_ATTR easyMesh::sendNodeSync( meshConnectionType *conn, meshPackageType type ) {
+    uint32_t destId = ( type == NODE_SYNC_REQUEST ) ? conn->chipId : _chipId;
+    uint16_t dutySize = _dutyPeriod != 0 ? PACKAGE_SYNC_DUTY_SIZE : 0;
+
+    // the subs are written into _sendBuffer where the package carries them, and only left in
+    // if the peer does not hold them yet
+    if ( conn->wireFormat == WIRE_BINARY ) {
+        meshPackageHeader header;
+        header.type = (uint8_t)type;
+        header.flags = PACKAGE_FLAG_SYNC_HASH | PACKAGE_FLAG_PING | PACKAGE_FLAG_HOPS;
+        if ( _sink )
+            header.flags |= PACKAGE_FLAG_SINK;
+        if ( dutySize != 0 )
+            header.flags |= PACKAGE_FLAG_DUTY;
+        header.from = _chipId;
+        header.dest = destId;
+
+        uint16_t headerSize = packageHeaderSize( header );
+        uint16_t fixedSize = PACKAGE_SYNC_HASH_SIZE + dutySize + PACKAGE_SYNC_HOPS_SIZE;
+        uint8_t *p = _sendBuffer + headerSize;
+        meshJsonWriter subs( p + fixedSize, PACKAGE_MAX_SIZE - headerSize - fixedSize );
+        subConnectionJson( conn, subs );
+        if ( subs.overflow() ) {
+            debugMsg( ERROR, "sendNodeSync(): subs to %u do not fit a package\n", conn->chipId );
+            return;
+        }
+        uint32_t hash = subsHash( p + fixedSize, subs.length() );
+        bool withSubs = hash != conn->peerKnownHash;
+        debugMsg( SYNC, "sendNodeSync(): to %u hash=0x%x known=0x%x subs=%d\n", conn->chipId, hash, conn->subsHash, withSubs );
+
+        header.length = fixedSize + ( withSubs ? subs.length() : 0 );
+        encodePackageHeader( _sendBuffer, header );
+        for ( uint8_t b = 0; b < 4; b++ ) {
+            p[b] = ( hash >> ( 8 * b ) ) & 0xFF;
+            p[4 + b] = ( conn->subsHash >> ( 8 * b ) ) & 0xFF;
+        }
+        p += PACKAGE_SYNC_HASH_SIZE;
+        for ( uint8_t b = 0; b < 4 && dutySize != 0; b++ ) {
+            p[b] = ( _dutyPeriod >> ( 8 * b ) ) & 0xFF;
+            p[4 + b] = ( _dutyWindow >> ( 8 * b ) ) & 0xFF;
+        }
+        p += dutySize;
+        *p = hopCount();
+
+        sendPackage( conn, _sendBuffer, headerSize + header.length, PRIORITY_HIGH );
+        return;
+    }
+
+    meshJsonWriter root( _sendBuffer, PACKAGE_MAX_SIZE );
+    root.number( "dest", destId );
+    root.number( "from", _chipId );
+    root.number( "type", (uint8_t)type );
+    uint16_t withoutSubs = root.length();
+    root.key( "subs" );
+    uint16_t subsStart = root.length();
+    subConnectionJson( conn, root );
+    if ( root.overflow() ) {
+        debugMsg( ERROR, "sendNodeSync(): subs to %u do not fit a package\n", conn->chipId );
+        return;
+    }
+    uint32_t hash = subsHash( _sendBuffer + subsStart, root.length() - subsStart );
+    bool withSubs = hash != conn->peerKnownHash;
+    debugMsg( SYNC, "sendNodeSync(): to %u hash=0x%x known=0x%x subs=%d\n", conn->chipId, hash, conn->subsHash, withSubs );
+
+    if ( !withSubs )
+        root.rewind( withoutSubs );
+    root.number( "hash", hash );
+    root.number( "known", conn->subsHash );
+    root.number( "wire", PACKAGE_VERSION );  // advertise the binary format, older nodes ignore it
+    root.number( "ping", 1 );                // and that we answer PING
+    if ( _sink )
+        root.number( "sink", 1 );
+    if ( _dutyPeriod != 0 ) {
+        root.number( "duty", _dutyPeriod );
+        root.number( "window", _dutyWindow );
+    }
+    root.number( "hops", hopCount() );
+
+    sendEncoded( conn, root.finish(), PRIORITY_HIGH );
+}
+
+/**
+ * Flags every connection but exclude whose peer holds an outdated view of our side for a
+ * nodeSync. Peers that are still up to date are left alone, so a change only travels
+ * towards the links that need it.
+ */
+void ICACHE_FLASH_ATTR easyMesh::markStaleConnections( meshConnectionType *exclude ) {
+    meshConnectionList::iterator connection = _connections.begin();
+    while ( connection != _connections.end() ) {
+        if ( connection != exclude ) {
+            meshJsonWriter subs( _sendBuffer, PACKAGE_MAX_SIZE );
+            subConnectionJson( connection, subs );
+            if ( subsHash( _sendBuffer, subs.length() ) != connection->peerKnownHash ) {
+                connection->nodeSyncStatus = NEEDED;
+                scheduleConnection( connection );
+            }
+        }
+        connection++;
+    }
+}
+
 
 /**
  * Takes action when a new sync request is made.
@@ -126,12 +375,12 @@ void ICACHE_FLASH_ATTR easyMesh::startNodeSync( meshConnectionType *conn ) {
  * Finally, in case of a sync_request this node needs to send a sync_reply to its subs or in case of a
  * sync_reply the node needs to reset its sync timer.
  */
-void ICACHE_FLASH_ATTR easyMesh::handleNodeSync( meshConnectionType *conn, JsonObject& root ) {
+void ICACHE_FLASH_ATTR easyMesh::handleNodeSync( meshConnectionType *conn, meshPackageHeader &header, String &inComingSubs, meshSyncInfo &sync ) {
     debugMsg(SYNC, "handleNodeSync(): with %u\n", conn->chipId);
 
-    meshPackageType type = (meshPackageType) (int) root["type"];
-    uint32_t remoteChipId = (uint32_t) root["from"];
-    uint32_t destId = (uint32_t) root["dest"];
+    meshPackageType type = (meshPackageType) header.type;
+    uint32_t remoteChipId = header.from;
+    uint32_t destId = header.dest;
     bool reSyncAllSubConnections = false;
 
     if ((destId == 0) && (findConnection(remoteChipId) != NULL)) {
@@ -142,43 +391,89 @@ void ICACHE_FLASH_ATTR easyMesh::handleNodeSync( meshConnectionType *conn, JsonO
 
     if (conn->chipId != remoteChipId) {
         debugMsg(SYNC, "handleNodeSync(): conn->chipId updated from %d to %d\n", conn->chipId, remoteChipId);
+        removeTopology(conn->chipId);
         conn->chipId = remoteChipId;
+        reSyncAllSubConnections = true;
+    }
 
+    if (sync.hasHash)
+        conn->peerKnownHash = sync.known;
+    conn->keepalive = sync.keepalive;
+
+    // our depth is our parent's plus one, the beacon we joined on may be long out of date
+    if (conn == stationConnection() && sync.hops != 0xFF && sync.hops != _uplinkHops) {
+        debugMsg(SYNC, "handleNodeSync(): parent %u is %u hops from the root, was %u\n", conn->chipId, sync.hops, _uplinkHops);
+        if (sync.hops > _uplinkHops)
+            armRoamTimer(ROAM_DEEPER_INTERVAL);  // after a merge a closer parent may well be in range now
+        _uplinkHops = sync.hops;
+        updateBeacon();
+        meshConnectionList::iterator child = _connections.begin();
+        while (child != _connections.end()) {  // and theirs is ours plus one
+            if (child != conn) {
+                child->nodeSyncStatus = NEEDED;
+                scheduleConnection(child);
+            }
+            child++;
+        }
     }
 
+    bool sinkChanged = conn->sink != sync.sink;
+    conn->sink = sync.sink;
+
+    // only a child sleeps, what a parent advertises is ignored
+    if (conn->esp_conn->proto.tcp->local_port == _meshPort)
+        setLinkDuty(conn, sync.dutyPeriod, sync.dutyWindow, conn->chipId);
+
     // check to see if subs have changed.
-    String inComingSubs = root["subs"];
-    if (!conn->subConnections.equals(inComingSubs)) {  // change in the network
+    bool needFullSync = false;
+    if (sync.hasSubs) {
+        uint32_t inComingHash = sync.hasHash ? sync.hash : subsHash((const uint8_t *)inComingSubs.c_str(), inComingSubs.length());
+        if (conn->subsHash != inComingHash) {  // change in the network
+            reSyncAllSubConnections = true;
+            conn->subsHash = inComingHash;
+        }
+    } else if (sync.hash != conn->subsHash || reSyncAllSubConnections) {
+        // hash only, but it is not what we hold: forget ours so the next sync asks for the full subs
+        debugMsg(SYNC, "handleNodeSync(): %u sent hash 0x%x only, we hold 0x%x\n", conn->chipId, sync.hash, conn->subsHash);
+        conn->subsHash = 0;
+        needFullSync = true;
+    }
+
+    if (reSyncAllSubConnections) {
+        updateTopology(conn, inComingSubs);
+        updateBeacon();  // the mesh size we advertise, see biggerMesh()
+    } else if (sinkChanged) {
+        // the peer's subs are unchanged, only its own entry and what we tell the others
+        uint8_t root = findTopologyRoot(conn->chipId);
+        if (root != TOPOLOGY_ROOT)
+            _topology[root].sink = conn->sink;
         reSyncAllSubConnections = true;
-        conn->subConnections = inComingSubs;
     }
 
     switch (type) {
-        case NODE_SYNC_REQUEST: {
+        case NODE_SYNC_REQUEST:
             debugMsg(SYNC, "handleNodeSync(): valid NODE_SYNC_REQUEST %d sending NODE_SYNC_REPLY\n", conn->chipId);
-            String myOtherSubConnections = subConnectionJson(conn);
-            sendMessage(conn, _chipId, NODE_SYNC_REPLY, myOtherSubConnections);
+            sendNodeSync(conn, NODE_SYNC_REPLY);
             break;
-        }
         case NODE_SYNC_REPLY:
             debugMsg(SYNC, "handleNodeSync(): valid NODE_SYNC_REPLY from %d\n", conn->chipId);
             conn->nodeSyncRequest = 0;  //reset nodeSyncRequest Timer  ????
-            if (conn->lastTimeSync == 0)
-                startTimeSync(conn);
+            if (conn->lastTimeSync == 0 && conn->timeSyncStatus != IN_PROGRESS) {
+                if (linkDozing(conn, getNodeTime()))
+                    conn->timeSyncStatus = NEEDED;  // manageConnection() starts it in the next wake window
+                else
+                    startTimeSync(conn);
+            }
             break;
         default:
             debugMsg(ERROR, "handleNodeSync(): weird type? %d\n", type);
     }
 
-    if (reSyncAllSubConnections) {
-        SimpleList<meshConnectionType>::iterator connection = _connections.begin();
-        while (connection != _connections.end()) {
-            connection->nodeSyncStatus = NEEDED;
-            connection++;
-        }
-    }
+    if (reSyncAllSubConnections)
+        markStaleConnections(conn);
 
-    conn->nodeSyncStatus = COMPLETE;  // mark this connection nodeSync'd
+    conn->nodeSyncStatus = needFullSync ? NEEDED : COMPLETE;  // mark this connection nodeSync'd
+    scheduleConnection(conn);
 }
 
 /**
@@ -192,15 +487,48 @@ void ICACHE_FLASH_ATTR easyMesh::startTimeSync( meshConnectionType *conn ) {
     }
 
     conn->time.num = 0;
+    conn->time.error = 0;
+    conn->time.stale = false;
 
     conn->time.adopt = adoptionCalc( conn ); // do I adopt the estblished time? See below
 
-    String timeStamp = conn->time.buildTimeStamp();
-    staticThis->sendMessage( conn, _chipId, TIME_SYNC, timeStamp );
+    sendTimeStamp( conn );
 
     conn->timeSyncStatus = IN_PROGRESS;
 }
 
+/**
+ * Stops the exchange with conn because the wake window closed on it. Both ends see the window
+ * close, the one holding a stamp here and the one waiting for one in manageConnection(), and
+ * both go back to NEEDED so the exchange starts over in the next window; if both start it,
+ * handleTimeSync() settles which one goes on.
+ */
+void ICACHE_FLASH_ATTR easyMesh::postponeTimeSync( meshConnectionType *conn ) {
+    debugMsg( SYNC, "postponeTimeSync(): %d went to sleep, timeSync postponed\n", conn->chipId );
+    conn->timeSyncStatus = NEEDED;
+    conn->time.stampPending = false;  // it belongs to the exchange given up
+    holdForWake( conn );
+}
+
+/**
+ * Sends our next stamp once nothing is in flight on the link and no other control package
+ * waits, so it is taken right as it goes out. Taken on queueing it would count the time spent
+ * behind other packages as link delay in one direction only, which is offset to the far end.
+ * Until then it is flagged and sendQueued() sends it.
+ */
+void ICACHE_FLASH_ATTR easyMesh::sendTimeStamp( meshConnectionType *conn ) {
+    if ( !conn->sendReady || !conn->sendQueue.lane( PRIORITY_HIGH ).empty() ) {
+        conn->time.stampPending = true;
+        return;
+    }
+    conn->time.stampPending = false;
+
+    char timeStamp[TIME_STAMP_SIZE];
+    uint16_t length = conn->time.buildTimeStamp( getNodeTime(), timeStamp );
+    debugMsg( SYNC, "sendTimeStamp(): with %d out timestamp=%s\n", conn->chipId, timeStamp);
+    sendMessage( conn, _chipId, _chipId, TIME_SYNC, (const uint8_t *)timeStamp, length );
+}
+
 
 /**
  * Make the adoption calculation.
@@ -208,7 +536,7 @@ void ICACHE_FLASH_ATTR easyMesh::startTimeSync( meshConnectionType *conn ) {
  */
 bool ICACHE_FLASH_ATTR easyMesh::adoptionCalc( meshConnectionType *conn ) {
     uint16_t mySubCount = connectionCount( conn );  //exclude this connection.
-    uint16_t remoteSubCount = jsonSubConnCount( conn->subConnections );
+    uint16_t remoteSubCount = conn->subCount;
 
     bool ret = mySubCount > remoteSubCount ? false : true;
 
@@ -217,40 +545,83 @@ bool ICACHE_FLASH_ATTR easyMesh::adoptionCalc( meshConnectionType *conn ) {
     return ret;
 }
 
+/**
+ * Moves what we hold in node time along with a clock adjustment. Left behind, a step into
+ * another timebase makes every link look silent for as long as the step, and it gets dropped
+ * on NODE_TIMEOUT at the next check.
+ * @param adjustment us the node time just moved.
+ */
+void ICACHE_FLASH_ATTR easyMesh::shiftNodeTimes( int32_t adjustment ) {
+    meshConnectionList::iterator connection = _connections.begin();
+    while ( connection != _connections.end() ) {
+        connection->lastRecieved += adjustment;
+        connection->nextCheck += adjustment;
+        if ( connection->nodeSyncRequest != 0 )
+            connection->nodeSyncRequest += adjustment;
+        if ( connection->lastTimeSync != 0 )
+            connection->lastTimeSync += adjustment;
+        connection->time.shift( adjustment );
+        connection++;
+    }
+    _recvTime += adjustment;
+    _nextUpdate += adjustment;  // the timer itself runs on real time and still fires when it should
+}
+
 /**
  * Update the timestamp of the connection.
- * Find and flag all connections for re-timeSync
+ * An adjustment beyond TIME_SYNC_TARGET_ERROR is a step the rest of our side has not seen, so
+ * all other connections are flagged for re-timeSync. Smaller ones are plain drift, which each
+ * link's own time.interval already keeps up with, so they travel no further.
+ * One in the middle of an exchange finishes it first and only then resyncs: started over at
+ * once, its first stamp would cross the remote's stamps of the old exchange still on their way.
  */
-void ICACHE_FLASH_ATTR easyMesh::handleTimeSync( meshConnectionType *conn, JsonObject& root ) {
+void ICACHE_FLASH_ATTR easyMesh::handleTimeSync( meshConnectionType *conn, String &timeStamp ) {
 
-    String timeStamp = root["msg"];
     debugMsg( SYNC, "handleTimeSync(): with %d in timestamp=%s\n", conn->chipId, timeStamp.c_str());
 
-    conn->time.processTimeStamp( timeStamp );  //varifies timeStamp and updates it with a new one.
-
-    debugMsg( SYNC, "handleTimeSync(): with %d out timestamp=%s\n", conn->chipId, timeStamp.c_str());
-
+    // both ends opened an exchange at once: the higher chip id goes on, the other answers it
+    bool keepOwn = conn->timeSyncStatus == IN_PROGRESS && _chipId > conn->chipId;
+    bool goesOn = conn->time.processTimeStamp( timeStamp, _recvTime, keepOwn );
 
-    if ( conn->time.num < TIME_SYNC_CYCLES ) {
-        staticThis->sendMessage( conn, _chipId, TIME_SYNC, timeStamp );
+    // the wake window closed mid exchange: an answer held until the next one would count the
+    // wait as link delay, so the exchange stops here and starts over then
+    if ( goesOn && linkDozing( conn, getNodeTime() ) ) {
+        postponeTimeSync( conn );
+        return;
     }
 
+    if ( goesOn )
+        sendTimeStamp( conn );
+
     uint8_t odd = conn->time.num % 2;
 
     if ( (conn->time.num + odd) >= TIME_SYNC_CYCLES ) {   // timeSync completed
         if ( conn->time.adopt ) {
-            conn->time.calcAdjustment( odd );
-
-            SimpleList<meshConnectionType>::iterator connection = _connections.begin();
-            while ( connection != _connections.end() ) {
-                if ( connection != conn ) {  // exclude this connection
-                    connection->timeSyncStatus = NEEDED;
+            _stats.lastAdjustment = conn->time.calcAdjustment( odd, _clock, conn->chipId );
+            shiftNodeTimes( _stats.lastAdjustment );
+            _stats.syncError = conn->time.error;
+            _stats.skew = _clock.skew();
+
+            if ( abs( _stats.lastAdjustment ) > TIME_SYNC_TARGET_ERROR ) {
+                meshConnectionList::iterator connection = _connections.begin();
+                while ( connection != _connections.end() ) {
+                    if ( connection != conn ) {  // exclude this connection
+                        if ( connection->timeSyncStatus == IN_PROGRESS ) {
+                            connection->time.stale = true;
+                        } else {
+                            connection->timeSyncStatus = NEEDED;
+                            scheduleConnection( connection );
+                        }
+                    }
+                    connection++;
                 }
-                connection++;
             }
         }
         conn->lastTimeSync = getNodeTime();
-        conn->timeSyncStatus = COMPLETE;
+        conn->timeSyncStatus = conn->time.stale ? NEEDED : COMPLETE;
+        conn->time.stale = false;
+        _stats.timeSyncRounds++;
+        scheduleConnection( conn );
     }
 }
 
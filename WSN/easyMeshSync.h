@@ -4,20 +4,69 @@
 #include <Arduino.h>
 
 #define SCAN_INTERVAL       10000
-#define SYNC_INTERVAL       7000
 #define TIME_SYNC_CYCLES    10
+#define TIME_STAMP_SIZE     64          // bytes the longest stamp takes, with its NUL
+
+#define TIME_SYNC_MIN_INTERVAL  10000000    // us, the closest an adopting node resyncs
+#define TIME_SYNC_MAX_INTERVAL  600000000   // us, the furthest
+#define TIME_SYNC_TARGET_ERROR  150         // us of drift allowed to build up between syncs, it adds up over the hops
+#define TIME_SYNC_DELAY_SLACK   300         // us over the shortest delay a sample may take and still be averaged
+#define TIME_SKEW_MAX           100000      // ppb, two crystals 50ppm off in opposite directions
+#define TIME_SKEW_MAX_STEP      5000        // us, a larger adjustment is a new timebase, not drift
+#define TIME_SKEW_DAMPING       20000000    // us added to the time a residual built up over, the skew follows short ones less
+#define TIME_SKEW_FOLD          0x40000000  // us, the skew is folded into timeAdjuster this often
+#define CLOCK_WRAP_GUARD        1800000000  // us, longest the update timer sleeps, well inside one system_get_time() wrap
+
+/**
+ * The node clock: system_get_time() extended to 64 bits, plus the offset and skew that time
+ * sync worked out. Every easyMesh has its own, so nodes sharing a process keep their own time.
+ */
+class meshClock {
+public:
+    uint64_t nodeTime64(void);
+
+    void adopt(int32_t adjustment, uint32_t &interval, uint32_t source);
+
+    int32_t skew(void) { return _skew; };
+
+protected:
+    uint64_t systemTime64(void);
+
+    int32_t skewDrift(uint64_t now);
+
+    void foldSkew(uint64_t now);
+
+    int64_t _adjuster = 0;          // us between systemTime64() and the node time, less the skew drift
+    int32_t _skew = 0;              // ppb our clock runs slow against the mesh
+    uint64_t _skewBase = 0;         // systemTime64() the skew is counted from
+    uint64_t _lastAdoption = 0;     // systemTime64() of the last adjustment, 0 before the first
+    uint32_t _skewSource = 0;       // chip id it was adopted from, the skew is only measured against one
+    uint32_t _lastSystemTime = 0;   // system_get_time() at the previous call, to spot the wrap
+    uint32_t _systemWraps = 0;
+};
 
 class timeSync {
 public:
     uint32_t times[TIME_SYNC_CYCLES];
+    uint32_t recvTimes[TIME_SYNC_CYCLES];   // our time when the remote stamp at the same index arrived
+    uint32_t peerRecvTimes[TIME_SYNC_CYCLES];   // the remote's time when our stamp before that index arrived
+    bool peerRecv = false;                  // the remote reports them, older nodes do not
     int8_t num = -1;
     bool adopt;
+    uint32_t error = 0;                     // us, offset error bound of the last adjustment
+    uint32_t shortestDelay = 0;             // us, round trip of the link when it is quiet, 0 before the first
+    bool stampPending = false;              // our next stamp waits for the link to go idle, see easyMesh::sendTimeStamp()
+    bool stale = false;                     // our clock stepped mid exchange, it runs again once done
+    uint8_t ownParity = 0;                  // times at odd or even indices are ours
+    uint32_t interval = TIME_SYNC_MIN_INTERVAL; // us until the adopting side resyncs
+
+    uint16_t buildTimeStamp(uint32_t nodeTime, char *buf);
 
-    String buildTimeStamp(void);
+    bool processTimeStamp(String &str, uint32_t recvTime, bool keepOwn);
 
-    bool processTimeStamp(String &str);
+    int32_t calcAdjustment(bool even, meshClock &clock, uint32_t source);
 
-    void calcAdjustment(bool even);
+    void shift(int32_t adjustment);
 };
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef   _HOST_ARDUINO_H_
+#define   _HOST_ARDUINO_H_
+
+/**
+ * What the mesh library takes from the ESP8266 Arduino core, for the host build.
+ * Serial goes to stderr, ESP.getCycleCount() counts host time in 80 MHz ticks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "c_types.h"
+#include "WString.h"
+
+// the Makefile defines ARDUINO as the IDE does, but there are no streams or PROGMEM here
+#define ARDUINOJSON_ENABLE_ARDUINO_STREAM   0
+#define ARDUINOJSON_ENABLE_PROGMEM          0
+
+class HardwareSerial {
+public:
+    void begin(unsigned long baud) {};
+
+    size_t printf(const char *format, ...);
+
+    size_t print(const char *str);
+
+    size_t print(const String &str) { return print(str.c_str()); };
+
+    size_t println(const char *str) { return print(str) + print("\n"); };
+
+    size_t println(const String &str) { return println(str.c_str()); };
+};
+
+extern HardwareSerial Serial;
+
+class EspClass {
+public:
+    uint32_t getCycleCount(void);
+};
+
+extern EspClass ESP;
+
+inline void noInterrupts(void) {}
+inline void interrupts(void) {}
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+#endif //   _HOST_ARDUINO_H_
@@ -0,0 +1,78 @@
+#ifndef   _HOST_WSTRING_H_
+#define   _HOST_WSTRING_H_
+
+/**
+ * The Arduino String the mesh library uses, on top of std::string.
+ */
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+class String {
+public:
+    String(void) {};
+    String(const char *str) { if (str != NULL) s = str; };
+    String(const String &other) : s(other.s) {};
+    explicit String(char c) : s(1, c) {};
+    explicit String(unsigned char value) : s(std::to_string(value)) {};
+    explicit String(int value) : s(std::to_string(value)) {};
+    explicit String(unsigned int value) : s(std::to_string(value)) {};
+    explicit String(long value) : s(std::to_string(value)) {};
+    explicit String(unsigned long value) : s(std::to_string(value)) {};
+    explicit String(double value, unsigned char decimals = 2) : s(std::to_string(value)) {};
+
+    String &operator=(const String &other) { s = other.s; return *this; };
+    String &operator=(const char *str) { s = str != NULL ? str : ""; return *this; };
+
+    const char *c_str(void) const { return s.c_str(); };
+    unsigned int length(void) const { return s.size(); };
+    unsigned char reserve(unsigned int size) { s.reserve(size); return 1; };
+
+    bool equals(const String &other) const { return s == other.s; };
+    bool operator==(const String &other) const { return s == other.s; };
+    bool operator!=(const String &other) const { return s != other.s; };
+    bool startsWith(const String &prefix) const { return s.compare(0, prefix.s.size(), prefix.s) == 0; };
+
+    int indexOf(char c) const { return found(s.find(c)); };
+    int indexOf(const String &str) const { return found(s.find(str.s)); };
+    String substring(unsigned int from) const { String ret; ret.s = s.substr(from); return ret; };
+    String substring(unsigned int from, unsigned int to) const { String ret; ret.s = s.substr(from, to - from); return ret; };
+    long toInt(void) const { return atol(s.c_str()); };
+
+    unsigned char concat(const String &str) { s += str.s; return 1; };
+    unsigned char concat(const char *str) { s += str; return 1; };
+    unsigned char concat(const char *str, unsigned int length) { s.append(str, length); return 1; };
+    unsigned char concat(char c) { s += c; return 1; };
+    String &operator+=(const String &str) { s += str.s; return *this; };
+    String &operator+=(const char *str) { s += str; return *this; };
+    String &operator+=(char c) { s += c; return *this; };
+    String &operator+=(int value) { s += std::to_string(value); return *this; };
+    String &operator+=(unsigned int value) { s += std::to_string(value); return *this; };
+
+    char operator[](unsigned int i) const { return s[i]; };
+    char &operator[](unsigned int i) { return s[i]; };
+    char charAt(unsigned int i) const { return s[i]; };
+    void setCharAt(unsigned int i, char c) { s[i] = c; };
+    void remove(unsigned int from) { s.erase(from); };
+    void remove(unsigned int from, unsigned int count) { s.erase(from, count); };
+    void toCharArray(char *buf, unsigned int size) const { strncpy(buf, s.c_str(), size); };
+    void getBytes(unsigned char *buf, unsigned int size) const { memcpy(buf, s.c_str(), size); };
+
+    std::string s;
+
+protected:
+    static int found(size_t pos) { return pos == std::string::npos ? -1 : (int)pos; };
+};
+
+class StringSumHelper : public String {
+public:
+    StringSumHelper(const String &str) : String(str) {};
+    StringSumHelper(const char *str) : String(str) {};
+};
+
+inline StringSumHelper operator+(const String &a, const String &b) { StringSumHelper ret(a); ret.s += b.s; return ret; }
+inline StringSumHelper operator+(const String &a, const char *b) { StringSumHelper ret(a); ret.s += b; return ret; }
+inline StringSumHelper operator+(const char *a, const String &b) { StringSumHelper ret(a); ret.s += b.s; return ret; }
+
+#endif //   _HOST_WSTRING_H_
@@ -0,0 +1,23 @@
+#ifndef   _HOST_C_TYPES_H_
+#define   _HOST_C_TYPES_H_
+
+/**
+ * The SDK's c_types.h for the host build, see Makefile.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef uint8_t     uint8;
+typedef int8_t      sint8;
+typedef uint16_t    uint16;
+typedef int16_t     sint16;
+typedef uint32_t    uint32;
+typedef int32_t     sint32;
+typedef uint64_t    uint64;
+typedef int64_t     sint64;
+
+#define ICACHE_FLASH_ATTR
+#define ICACHE_RAM_ATTR
+
+#endif //   _HOST_C_TYPES_H_
@@ -0,0 +1,369 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <vector>
+
+#include "meshSim.h"
+
+/**
+ * Benchmarks the mesh library on the simulator, see the Makefile. In virtual time it
+ * powers on a grid (or line) of nodes and reports:
+ *   convergence   until every node counts all others in its mesh
+ *   time sync     offset of each node's mesh time from node 0's, sampled once settled;
+ *                 nodes in a separate mesh, which keeps its own time, are left out
+ *   single        SINGLE latency and delivery from node 0 to every node, by hop count
+ *   broadcast     BROADCAST fan-out latency and coverage, from node 0 and the last node
+ *   heap          what each node's mesh allocated, at its peak and at the end
+ *   traffic       what all nodes put on the air
+ *   drops         packages given up on a full queue or a lost connection
+ *   tree depth    deepest node below the root once roaming had the run to act, against the
+ *                 shallowest tree the range allows; more than BENCH_DEPTH_SLACK hops over makes
+ *                 the exit status 1
+ * usage: meshBench [-n nodes] [-t grid|line] [-l loss] [-d latency_us] [-p payload] [-s seed] [-v]
+ */
+
+#define BENCH_PREFIX        "meshBench"
+#define BENCH_PASSWORD      "benchpass"
+#define BENCH_PORT          5555
+#define BENCH_SPACING       10          // m between neighbours
+#define BENCH_BOOT_STAGGER  300000      // us between two nodes powering on, plus up to a third of it
+#define BENCH_CONVERGE_STEP 100000      // us between two convergence checks
+#define BENCH_CONVERGE_MAX  600000000   // us until we give up on convergence
+#define BENCH_SETTLE        30000000    // us after convergence before anything is measured
+#define BENCH_SYNC_SAMPLES  60          // time sync samples, one a second
+#define BENCH_ROUNDS        5           // of SINGLEs to every node, and of broadcasts
+#define BENCH_SINGLE_GAP    10000       // us between two SINGLEs of a round
+#define BENCH_ROUND_GAP     1000000     // us between two rounds
+#define BENCH_DRAIN         10000000    // us left for the last messages to arrive
+#define BENCH_DEPTH_SLACK   1           // hops the tree may be deeper than the shallowest one from its root
+
+struct benchMessage {
+    uint64_t sent = 0;
+    uint8_t from = 0;
+    uint8_t to = 0;             // only for SINGLEs
+    uint8_t hops = 0;
+    std::vector<uint64_t> arrival;  // per node, 0 until it arrived
+};
+
+struct benchLatency {
+    uint32_t sent = 0;
+    uint32_t delivered = 0;
+    double sum = 0;             // ms
+    double worst = 0;
+};
+
+static meshSim *sim;
+static std::vector<benchMessage> messages;
+
+/**
+ * Notes when a message of ours arrives, the payload starts with 's' or 'b' and its number.
+ */
+static void onReceive( uint32_t from, String &msg ) {
+    uint32_t seq = atoi( msg.c_str() + 1 );
+    if ( seq >= messages.size() )
+        return;
+
+    uint64_t &arrival = messages[seq].arrival[sim->current()->index];
+    if ( arrival == 0 )
+        arrival = sim->now();
+}
+
+static String payload( char kind, uint32_t seq, uint16_t length ) {
+    String msg( kind );
+    msg += String( (unsigned int)seq );
+    msg += ' ';
+    while ( msg.length() < length )
+        msg += '.';
+    return msg;
+}
+
+/**
+ * Books a message before it is sent, outside every node, so its record is charged to no
+ * node's heap. The event sending it stamps it with stampMessage().
+ */
+static uint32_t newMessage( simNode *from, simNode *to ) {
+    benchMessage message;
+    message.from = from->index;
+    if ( to != NULL )
+        message.to = to->index;
+    message.arrival.resize( sim->nodeCount(), 0 );
+    messages.push_back( message );
+    return messages.size() - 1;
+}
+
+static void stampMessage( uint32_t seq, bool single ) {
+    benchMessage &message = messages[seq];
+    message.sent = sim->now();
+    if ( single )
+        message.hops = sim->hops( sim->node( message.from ), sim->node( message.to ) );
+}
+
+static bool converged( void ) {
+    bool all = true;
+    for ( uint8_t i = 0; i < sim->nodeCount() && all; i++ ) {
+        simNode *node = sim->node( i );
+        sim->run( node, [&]() { all = node->mesh.connectionCount() == sim->nodeCount() - 1; } );
+    }
+    return all;
+}
+
+/**
+ * Hops from sim's root to node up the uplinks, 0xFF if they end in a loop.
+ */
+static uint8_t treeDepth( simNode *node ) {
+    uint8_t depth = 0;
+    while ( node->uplink >= 0 ) {
+        if ( ++depth >= sim->nodeCount() )
+            return 0xFF;
+        node = sim->node( node->uplink );
+    }
+    return depth;
+}
+
+/**
+ * Reports how deep the tree node 0 is in grew, against the shallowest tree the radio range
+ * allows from the same root.
+ * @return true if it is more than BENCH_DEPTH_SLACK hops deeper.
+ */
+static bool reportDepth( void ) {
+    simNode *root = sim->node( 0 );
+    while ( root->uplink >= 0 && treeDepth( root ) != 0xFF )
+        root = sim->node( root->uplink );
+
+    std::vector<uint8_t> best( sim->nodeCount(), 0xFF );
+    std::vector<uint8_t> reached( 1, root->index );
+    best[root->index] = 0;
+    for ( size_t i = 0; i < reached.size(); i++ ) {
+        for ( uint8_t j = 0; j < sim->nodeCount(); j++ ) {
+            if ( best[j] == 0xFF && sim->inRange( sim->node( reached[i] ), sim->node( j ) ) ) {
+                best[j] = best[reached[i]] + 1;
+                reached.push_back( j );
+            }
+        }
+    }
+
+    uint8_t depth = 0, shallowest = 0;
+    for ( uint8_t i = 0; i < sim->nodeCount(); i++ ) {
+        uint8_t hops = treeDepth( sim->node( i ) );
+        if ( hops > depth )
+            depth = hops;
+        if ( best[i] != 0xFF && best[i] > shallowest )
+            shallowest = best[i];
+    }
+    bool deep = depth > shallowest + BENCH_DEPTH_SLACK;
+    printf( "tree depth    %u hops below node %u at most, %u at best from there%s\n",
+            depth, root->index, shallowest, deep ? ", TOO DEEP" : "" );
+    return deep;
+}
+
+static void usage( void ) {
+    fprintf( stderr, "usage: meshBench [-n nodes] [-t grid|line] [-l loss] [-d latency_us] [-p payload] [-s seed] [-v]\n" );
+    exit( 2 );
+}
+
+int main( int argc, char **argv ) {
+    uint16_t nodes = 16;
+    bool line = false;
+    double loss = 0.01;
+    uint32_t latency = 2000;
+    uint16_t length = 32;
+    uint32_t seed = 1;
+    bool verbose = false;
+
+    for ( int i = 1; i < argc; i++ ) {
+        if ( strcmp( argv[i], "-v" ) == 0 ) {
+            verbose = true;
+            continue;
+        }
+        if ( i + 1 >= argc )
+            usage();
+        const char *value = argv[++i];
+        if ( strcmp( argv[i - 1], "-n" ) == 0 )
+            nodes = atoi( value );
+        else if ( strcmp( argv[i - 1], "-t" ) == 0 )
+            line = strcmp( value, "line" ) == 0;
+        else if ( strcmp( argv[i - 1], "-l" ) == 0 )
+            loss = atof( value );
+        else if ( strcmp( argv[i - 1], "-d" ) == 0 )
+            latency = atoi( value );
+        else if ( strcmp( argv[i - 1], "-p" ) == 0 )
+            length = atoi( value );
+        else if ( strcmp( argv[i - 1], "-s" ) == 0 )
+            seed = atoi( value );
+        else
+            usage();
+    }
+    if ( nodes < 2 || nodes > SIM_MAX_NODES || length > PACKAGE_MAX_SIZE / 2 )
+        usage();
+
+    meshSim simulator( seed );
+    sim = &simulator;
+    sim->link.loss = loss;
+    sim->link.latency = latency;
+
+    // a grid reaches its diagonal neighbours, a line only the next node either side
+    uint16_t side = line ? nodes : (uint16_t)ceil( sqrt( nodes ) );
+    sim->range = line ? BENCH_SPACING * 1.2 : BENCH_SPACING * 1.5;
+    for ( uint16_t i = 0; i < nodes; i++ )
+        sim->addNode( ( i % side ) * BENCH_SPACING, ( i / side ) * BENCH_SPACING );
+
+    printf( "%u nodes in a %s, %.1f%% loss, %u us latency, %u byte payloads, seed %u\n",
+            nodes, line ? "line" : "grid", loss * 100, latency, length, seed );
+
+    uint64_t lastBoot = 0;
+    for ( uint16_t i = 0; i < nodes; i++ ) {
+        simNode *node = sim->node( i );
+        uint64_t boot = (uint64_t)i * BENCH_BOOT_STAGGER + (uint64_t)( sim->random() * BENCH_BOOT_STAGGER / 3 );
+        if ( boot > lastBoot )
+            lastBoot = boot;
+        sim->at( boot, node, [node, verbose]() {
+            if ( verbose )
+                node->mesh.setDebugMsgTypes( ERROR | STARTUP | CONNECTION | SYNC );
+            node->mesh.setReceiveCallback( onReceive );
+            node->mesh.init( BENCH_PREFIX, BENCH_PASSWORD, BENCH_PORT );
+        } );
+    }
+
+    // convergence
+    uint64_t t = lastBoot;
+    bool all = false;
+    while ( !all && t < lastBoot + BENCH_CONVERGE_MAX ) {
+        t += BENCH_CONVERGE_STEP;
+        sim->runUntil( t );
+        all = converged();
+    }
+    uint8_t depth = 0;
+    for ( uint16_t i = 1; i < nodes; i++ ) {
+        uint8_t hops = sim->hops( sim->node( 0 ), sim->node( i ) );
+        if ( hops != 0xFF && hops > depth )
+            depth = hops;
+    }
+    if ( all )
+        printf( "convergence   %.2f s after the last power on, %u hops from node 0 at most\n",
+                ( t - lastBoot ) / 1e6, depth );
+    else
+        printf( "convergence   none within %u s, measuring what formed\n", BENCH_CONVERGE_MAX / 1000000 );
+
+    // time sync
+    t += BENCH_SETTLE;
+    sim->runUntil( t );
+    uint32_t syncMax = 0;
+    double syncSum = 0;
+    uint32_t syncCount = 0;
+    for ( uint16_t sample = 0; sample < BENCH_SYNC_SAMPLES; sample++ ) {
+        t += 1000000;
+        sim->runUntil( t );
+
+        uint32_t base;
+        sim->run( sim->node( 0 ), [&]() { base = sim->node( 0 )->mesh.getNodeTime(); } );
+        for ( uint16_t i = 1; i < nodes; i++ ) {
+            simNode *node = sim->node( i );
+            if ( sim->hops( sim->node( 0 ), node ) == 0xFF )
+                continue;  // a mesh of its own keeps its own time
+            uint32_t nodeTime;
+            sim->run( node, [&]() { nodeTime = node->mesh.getNodeTime(); } );
+            uint32_t error = abs( (int32_t)( nodeTime - base ) );
+            syncSum += error;
+            syncCount++;
+            if ( error > syncMax )
+                syncMax = error;
+        }
+    }
+    printf( "time sync     %.0f us mean, %u us max offset from node 0 over %u s, %.1f nodes in its mesh on average\n",
+            syncCount > 0 ? syncSum / syncCount : 0, syncMax, BENCH_SYNC_SAMPLES, (double)syncCount / BENCH_SYNC_SAMPLES );
+
+    // SINGLE from node 0 to every node
+    size_t firstSingle = messages.size();
+    simNode *origin = sim->node( 0 );
+    for ( uint16_t round = 0; round < BENCH_ROUNDS; round++ ) {
+        for ( uint16_t i = 1; i < nodes; i++ ) {
+            simNode *target = sim->node( i );
+            uint32_t seq = newMessage( origin, target );
+            sim->at( t + round * BENCH_ROUND_GAP + i * BENCH_SINGLE_GAP, origin, [origin, target, seq, length]() {
+                stampMessage( seq, true );
+                String msg = payload( 's', seq, length );
+                origin->mesh.sendSingle( target->chipId, msg );
+            } );
+        }
+    }
+    t += BENCH_ROUNDS * BENCH_ROUND_GAP + BENCH_DRAIN;
+    sim->runUntil( t );
+
+    std::map<uint8_t, benchLatency> byHops;  // 0xFF, no path when sent, sorts last
+    for ( size_t m = firstSingle; m < messages.size(); m++ ) {
+        benchMessage &message = messages[m];
+        benchLatency &row = byHops[message.hops];
+        row.sent++;
+        if ( message.arrival[message.to] == 0 )
+            continue;
+        double latency = ( message.arrival[message.to] - message.sent ) / 1e3;
+        row.delivered++;
+        row.sum += latency;
+        if ( latency > row.worst )
+            row.worst = latency;
+    }
+    printf( "single        hops  sent  delivered  mean ms   max ms\n" );
+    for ( std::map<uint8_t, benchLatency>::iterator row = byHops.begin(); row != byHops.end(); row++ )
+        printf( "              %4s %5u %10u %8.2f %8.2f\n", row->first == 0xFF ? "none" : String( row->first ).c_str(),
+                row->second.sent, row->second.delivered,
+                row->second.delivered > 0 ? row->second.sum / row->second.delivered : 0, row->second.worst );
+
+    // BROADCAST from node 0 and the last node in turn
+    size_t firstBroadcast = messages.size();
+    for ( uint16_t round = 0; round < BENCH_ROUNDS; round++ ) {
+        simNode *from = sim->node( round % 2 == 0 ? 0 : nodes - 1 );
+        uint32_t seq = newMessage( from, NULL );
+        sim->at( t + round * BENCH_ROUND_GAP, from, [from, seq, length]() {
+            stampMessage( seq, false );
+            String msg = payload( 'b', seq, length );
+            from->mesh.sendBroadcast( msg );
+        } );
+    }
+    t += BENCH_ROUNDS * BENCH_ROUND_GAP + BENCH_DRAIN;
+    sim->runUntil( t );
+
+    uint32_t reached = 0;
+    double sum = 0, lastSum = 0;
+    for ( size_t m = firstBroadcast; m < messages.size(); m++ ) {
+        benchMessage &message = messages[m];
+        double last = 0;
+        for ( uint16_t i = 0; i < nodes; i++ ) {
+            if ( i == message.from || message.arrival[i] == 0 )
+                continue;
+            double latency = ( message.arrival[i] - message.sent ) / 1e3;
+            reached++;
+            sum += latency;
+            if ( latency > last )
+                last = latency;
+        }
+        lastSum += last;
+    }
+    uint32_t expected = ( messages.size() - firstBroadcast ) * ( nodes - 1 );
+    printf( "broadcast     %.2f ms mean, %.2f ms to the last node, %.1f%% of nodes reached\n",
+            reached > 0 ? sum / reached : 0, lastSum / ( messages.size() - firstBroadcast ), 100.0 * reached / expected );
+
+    // heap
+    int32_t peakMax = 0, usedMax = 0;
+    double peakSum = 0, usedSum = 0;
+    uint32_t queueDrops = 0, timeoutDrops = 0;
+    for ( uint16_t i = 0; i < nodes; i++ ) {
+        simNode *node = sim->node( i );
+        peakSum += node->heapPeak;
+        usedSum += node->heapUsed;
+        if ( node->heapPeak > peakMax )
+            peakMax = node->heapPeak;
+        if ( node->heapUsed > usedMax )
+            usedMax = node->heapUsed;
+        queueDrops += node->mesh.getQueueDrops();
+        timeoutDrops += node->mesh.getStats().timeoutDrops;
+    }
+    printf( "heap          %.0f B mean, %d B max at the peak; %.0f B mean, %d B max at the end; easyMesh object %u B\n",
+            peakSum / nodes, peakMax, usedSum / nodes, usedMax, (unsigned int)sizeof( easyMesh ) );
+
+    printf( "traffic       %u sends, %u segments, %llu bytes, %u retransmits, %u aborted connections\n",
+            sim->sends, sim->segments, (unsigned long long)sim->bytes, sim->retransmits, sim->aborts );
+    printf( "drops         %u queue, %u timeout\n", queueDrops, timeoutDrops );
+    return reportDepth() ? 1 : 0;
+}
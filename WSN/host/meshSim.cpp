@@ -0,0 +1,900 @@
+#include <chrono>
+#include <math.h>
+#include <new>
+#include <stdarg.h>
+#include <string.h>
+
+#include "meshSim.h"
+
+meshSim *meshSim::active = NULL;
+
+HardwareSerial Serial;
+EspClass ESP;
+
+/**
+ * Heap accounting: every allocation made while a node's callback runs is charged to that
+ * node, so system_get_free_heap_size() and the heap figures of meshBench see what the mesh
+ * really allocates. The simulator's own bookkeeping runs inside a simSdkCall and is charged
+ * to nobody.
+ */
+static simNode *heapNode = NULL;
+static bool heapAccounting = true;
+
+struct simAllocation {
+    simNode *owner;
+    size_t size;
+};
+
+#define SIM_ALLOCATION_HEADER   16  // keeps the block behind it aligned like malloc()'s
+
+static void *simAlloc( size_t size ) {
+    simAllocation *block = (simAllocation *)malloc( size + SIM_ALLOCATION_HEADER );
+    if ( block == NULL )
+        return NULL;
+
+    block->owner = heapNode;
+    block->size = size;
+    if ( heapNode != NULL ) {
+        heapNode->heapUsed += size;
+        if ( heapNode->heapUsed > heapNode->heapPeak )
+            heapNode->heapPeak = heapNode->heapUsed;
+    }
+    return (uint8_t *)block + SIM_ALLOCATION_HEADER;
+}
+
+static void simFree( void *ptr ) {
+    if ( ptr == NULL )
+        return;
+
+    simAllocation *block = (simAllocation *)( (uint8_t *)ptr - SIM_ALLOCATION_HEADER );
+    if ( heapAccounting && block->owner != NULL )
+        block->owner->heapUsed -= block->size;
+    free( block );
+}
+
+void *operator new( size_t size ) {
+    void *ptr = simAlloc( size );
+    if ( ptr == NULL )
+        throw std::bad_alloc();
+    return ptr;
+}
+
+void *operator new[]( size_t size ) {
+    return operator new( size );
+}
+
+void *operator new( size_t size, const std::nothrow_t & ) noexcept {
+    return simAlloc( size );
+}
+
+void *operator new[]( size_t size, const std::nothrow_t & ) noexcept {
+    return simAlloc( size );
+}
+
+void operator delete( void *ptr ) noexcept { simFree( ptr ); }
+void operator delete[]( void *ptr ) noexcept { simFree( ptr ); }
+void operator delete( void *ptr, size_t ) noexcept { simFree( ptr ); }
+void operator delete[]( void *ptr, size_t ) noexcept { simFree( ptr ); }
+void operator delete( void *ptr, const std::nothrow_t & ) noexcept { simFree( ptr ); }
+void operator delete[]( void *ptr, const std::nothrow_t & ) noexcept { simFree( ptr ); }
+
+/**
+ * Charges what the simulator allocates for the rest of the scope to nobody.
+ */
+struct simSdkCall {
+    simSdkCall( void ) : _saved( heapNode ) { heapNode = NULL; };
+    ~simSdkCall( void ) { heapNode = _saved; };
+
+    simNode *_saved;
+};
+
+/**
+ * Debug output goes to stderr, each line led by the virtual time and the node printing it.
+ */
+size_t HardwareSerial::print( const char *str ) {
+    static bool lineStart = true;
+    for ( const char *c = str; *c != 0; c++ ) {
+        if ( lineStart && meshSim::active != NULL && meshSim::active->current() != NULL )
+            fprintf( stderr, "%10.6f %3u ", meshSim::active->now() / 1e6, meshSim::active->current()->index );
+        fputc( *c, stderr );
+        lineStart = *c == '\n';
+    }
+    return strlen( str );
+}
+
+size_t HardwareSerial::printf( const char *format, ... ) {
+    char str[256];
+
+    va_list args;
+    va_start( args, format );
+    vsnprintf( str, sizeof( str ), format, args );
+    va_end( args );
+    return print( str );
+}
+
+/**
+ * Host time in 80 MHz ticks, so the cycle histograms of meshStats compare code paths.
+ */
+uint32_t EspClass::getCycleCount( void ) {
+    uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch() ).count();
+    return (uint32_t)( ns * 2 / 25 );
+}
+
+/**
+ * The MAC of the node's softAP: Espressif's OUI and the chip id.
+ */
+void simNode::bssid( uint8_t *out ) {
+    out[0] = 0x1A;
+    out[1] = 0xFE;
+    out[2] = 0x34;
+    out[3] = chipId >> 16;
+    out[4] = chipId >> 8;
+    out[5] = chipId;
+}
+
+meshSim::meshSim( uint32_t seed ) : _rng( seed ), _uniform( 0.0, 1.0 ) {
+    active = this;
+}
+
+meshSim::~meshSim( void ) {
+    heapAccounting = false;  // the nodes go first, what they free may be charged to one already gone
+    _nodes.clear();
+    active = NULL;
+}
+
+/**
+ * Places a new node at x, y. It is powered on, but its mesh is not initialized yet; boot it
+ * with node->mesh.init() inside run() or at().
+ */
+simNode *meshSim::addNode( double x, double y ) {
+    if ( _nodes.size() >= SIM_MAX_NODES )
+        return NULL;
+
+    std::unique_ptr<simNode> node( new simNode );
+    node->index = _nodes.size();
+    node->x = x;
+    node->y = y;
+
+    bool unique;
+    do {
+        node->chipId = 1 + (uint32_t)( random() * 0xFFFFFE );  // 24 bits, as the SDK reports it
+        unique = true;
+        for ( size_t i = 0; i < _nodes.size(); i++ )
+            unique = unique && _nodes[i]->chipId != node->chipId;
+    } while ( !unique );
+
+    node->clockStart = (uint32_t)( random() * 0xFFFFFFFF );
+    node->skew = ( random() * 2 - 1 ) * 20;  // a plain crystal is good for 20 ppm
+    memset( node->rtc, 0, sizeof( node->rtc ) );
+    memset( &node->apConfig, 0, sizeof( node->apConfig ) );
+    memset( &node->apIp, 0, sizeof( node->apIp ) );
+    memset( &node->staConfig, 0, sizeof( node->staConfig ) );
+    memset( &node->staIp, 0, sizeof( node->staIp ) );
+
+    _nodes.push_back( std::move( node ) );
+    _radioFree.push_back( 0 );
+    return _nodes.back().get();
+}
+
+/**
+ * Runs fn at time, outside any node.
+ */
+void meshSim::at( uint64_t time, std::function<void()> fn ) {
+    simSdkCall sdk;
+    simEvent event;
+    event.time = time < _now ? _now : time;
+    event.seq = _seq++;
+    event.fn = fn;
+    _events.push( event );
+}
+
+/**
+ * Runs fn at time as a callback of node, see run().
+ */
+void meshSim::at( uint64_t time, simNode *node, std::function<void()> fn ) {
+    at( time, [this, node, fn]() { run( node, fn ); } );
+}
+
+/**
+ * Runs fn as a callback of node: the SDK calls it makes act on node, and what it allocates
+ * is charged to node.
+ */
+void meshSim::run( simNode *node, const std::function<void()> &fn ) {
+    simNode *savedCurrent = _current;
+    simNode *savedHeap = heapNode;
+    _current = node;
+    heapNode = node;
+    simMesh::driveStation( &node->mesh );
+
+    fn();
+
+    _current = savedCurrent;
+    heapNode = savedHeap;
+}
+
+/**
+ * Works through the events in their order until the virtual clock reaches time.
+ */
+void meshSim::runUntil( uint64_t time ) {
+    while ( !_events.empty() && _events.top().time <= time ) {
+        simEvent event = _events.top();
+        _events.pop();
+        _now = event.time;
+        event.fn();
+    }
+    _now = time;
+}
+
+/**
+ * Hops between two nodes over the TCP connections open right now, 0xFF if there is no path.
+ */
+uint8_t meshSim::hops( simNode *from, simNode *to ) {
+    simSdkCall sdk;
+    std::vector<uint8_t> distance( _nodes.size(), 0xFF );
+    std::queue<uint8_t> reached;
+    distance[from->index] = 0;
+    reached.push( from->index );
+
+    while ( !reached.empty() ) {
+        uint8_t here = reached.front();
+        reached.pop();
+        for ( size_t i = 0; i < _sockets.size(); i++ ) {
+            simSocket *socket = _sockets[i].get();
+            if ( !socket->open || ( socket->node[0] != here && socket->node[1] != here ) )
+                continue;
+            uint8_t next = socket->node[0] == here ? socket->node[1] : socket->node[0];
+            if ( distance[next] == 0xFF ) {
+                distance[next] = distance[here] + 1;
+                reached.push( next );
+            }
+        }
+    }
+    return distance[to->index];
+}
+
+/**
+ * Hands a wifi event to the node's event handler, as a callback of its own like the SDK does.
+ */
+void meshSim::post( simNode *node, System_Event_t &event ) {
+    System_Event_t copy = event;
+    at( _now, node, [node, copy]() {
+        System_Event_t event = copy;
+        if ( node->eventCb != NULL )
+            node->eventCb( &event );
+    } );
+}
+
+bool meshSim::inRange( simNode *a, simNode *b ) {
+    return hypot( a->x - b->x, a->y - b->y ) <= range;
+}
+
+sint8 meshSim::rssi( simNode *a, simNode *b ) {
+    double distance = hypot( a->x - b->x, a->y - b->y );
+    return (sint8)lround( -35 - 40 * distance / range );  // -75 dBm at the edge of the range
+}
+
+uint8_t meshSim::stationsOn( simNode *ap ) {
+    uint8_t count = 0;
+    for ( size_t i = 0; i < _nodes.size(); i++ ) {
+        if ( _nodes[i]->uplink == ap->index )
+            count++;
+    }
+    return count;
+}
+
+/**
+ * The association wifi_station_connect() started, then DHCP. A later connect or disconnect
+ * bumps staAttempt and turns this into a no-op.
+ */
+void meshSim::associate( simNode *sta, uint32_t attempt ) {
+    if ( attempt != sta->staAttempt )
+        return;
+
+    station_config &conf = sta->staConfig;
+    simNode *ap = NULL;
+    for ( size_t i = 0; i < _nodes.size() && ap == NULL; i++ ) {
+        simNode *node = _nodes[i].get();
+        uint8_t bssid[6];
+        node->bssid( bssid );
+        if ( node != sta && node->apConfigured && ( node->opmode & SOFTAP_MODE ) && inRange( sta, node ) &&
+             strnlen( (char *)conf.ssid, 32 ) == node->apConfig.ssid_len &&
+             memcmp( conf.ssid, node->apConfig.ssid, node->apConfig.ssid_len ) == 0 &&
+             ( !conf.bssid_set || memcmp( conf.bssid, bssid, 6 ) == 0 ) &&
+             strncmp( (char *)conf.password, (char *)node->apConfig.password, 64 ) == 0 &&
+             stationsOn( node ) < node->apConfig.max_connection )
+            ap = node;
+    }
+
+    System_Event_t event;
+    memset( &event, 0, sizeof( event ) );
+    if ( ap == NULL ) {
+        sta->staStatus = STATION_IDLE;
+        event.event = EVENT_STAMODE_DISCONNECTED;
+        memcpy( event.event_info.disconnected.ssid, conf.ssid, 32 );
+        event.event_info.disconnected.ssid_len = strnlen( (char *)conf.ssid, 32 );
+        event.event_info.disconnected.reason = REASON_NO_AP_FOUND;
+        post( sta, event );
+        return;
+    }
+
+    sta->uplink = ap->index;
+    event.event = EVENT_STAMODE_CONNECTED;
+    memcpy( event.event_info.connected.ssid, ap->apConfig.ssid, 32 );
+    event.event_info.connected.ssid_len = ap->apConfig.ssid_len;
+    ap->bssid( event.event_info.connected.bssid );
+    event.event_info.connected.channel = 1;
+    post( sta, event );
+
+    memset( &event, 0, sizeof( event ) );
+    event.event = EVENT_SOFTAPMODE_STACONNECTED;
+    post( ap, event );
+
+    at( _now + SIM_DHCP_TIME, [this, sta, ap, attempt]() {
+        if ( attempt != sta->staAttempt || sta->uplink != ap->index )
+            return;
+
+        System_Event_t event;
+        memset( &event, 0, sizeof( event ) );
+        if ( !ap->dhcps ) {
+            event.event = EVENT_STAMODE_DHCP_TIMEOUT;
+            post( sta, event );
+            return;
+        }
+
+        sta->staIp = ap->apIp;
+        ( (uint8_t *)&sta->staIp.ip )[3] = ap->nextLease;
+        ap->nextLease = ap->nextLease < 254 ? ap->nextLease + 1 : 2;
+        sta->staStatus = STATION_GOT_IP;
+        event.event = EVENT_STAMODE_GOT_IP;
+        post( sta, event );
+    } );
+}
+
+/**
+ * Ends the association of sta and with it every connection over it.
+ * @param notify Post the disconnect events, as the SDK does unless nothing was associated.
+ */
+void meshSim::dropStation( simNode *sta, bool notify ) {
+    sta->staStatus = STATION_IDLE;
+    if ( sta->uplink < 0 )
+        return;
+
+    simNode *ap = _nodes[sta->uplink].get();
+    for ( size_t i = 0; i < _sockets.size(); i++ ) {
+        simSocket *socket = _sockets[i].get();
+        if ( socket->open && socket->node[0] == sta->index && socket->node[1] == ap->index )
+            close( socket );
+    }
+    sta->uplink = -1;
+    memset( &sta->staIp, 0, sizeof( sta->staIp ) );
+
+    if ( notify ) {
+        System_Event_t event;
+        memset( &event, 0, sizeof( event ) );
+        event.event = EVENT_STAMODE_DISCONNECTED;
+        memcpy( event.event_info.disconnected.ssid, ap->apConfig.ssid, 32 );
+        event.event_info.disconnected.ssid_len = ap->apConfig.ssid_len;
+        ap->bssid( event.event_info.disconnected.bssid );
+        event.event_info.disconnected.reason = REASON_ASSOC_LEAVE;
+        post( sta, event );
+
+        memset( &event, 0, sizeof( event ) );
+        event.event = EVENT_SOFTAPMODE_STADISCONNECTED;
+        post( ap, event );
+    }
+}
+
+/**
+ * The SDK restarts the softAP on a new configuration, every station on it is dropped.
+ */
+void meshSim::restartAp( simNode *ap ) {
+    for ( size_t i = 0; i < _nodes.size(); i++ ) {
+        if ( _nodes[i]->uplink == ap->index )
+            dropStation( _nodes[i].get(), true );
+    }
+}
+
+/**
+ * A scan of one channel, or all of them for 0. Every AP in range is heard unless it is
+ * missed by the odds in link.scanMiss; its mesh IE goes to the IE callback first, as the
+ * SDK delivers it with the probe response.
+ */
+void meshSim::scan( simNode *sta, uint8_t channel, scan_done_cb_t cb ) {
+    sta->scanning = true;
+    uint32_t duration = channel != 0 ? SIM_SCAN_CHANNEL : 13 * SIM_SCAN_CHANNEL;
+
+    at( _now + duration, [this, sta, channel, cb]() {
+        sta->scanning = false;
+
+        std::vector<bss_info> found;
+        std::vector<simNode *> aps;
+        for ( size_t i = 0; i < _nodes.size(); i++ ) {
+            simNode *ap = _nodes[i].get();
+            if ( ap == sta || !ap->apConfigured || !( ap->opmode & SOFTAP_MODE ) || !inRange( sta, ap ) ||
+                 ( channel != 0 && channel != 1 ) || random() < link.scanMiss )
+                continue;
+
+            bss_info info;
+            memset( &info, 0, sizeof( info ) );
+            ap->bssid( info.bssid );
+            memcpy( info.ssid, ap->apConfig.ssid, 32 );
+            info.ssid_len = ap->apConfig.ssid_len;
+            info.channel = 1;
+            info.rssi = rssi( sta, ap ) + (sint8)( random() * 7 ) - 3;
+            info.authmode = ap->apConfig.authmode;
+            found.push_back( info );
+            aps.push_back( ap );
+        }
+        for ( size_t i = 0; i + 1 < found.size(); i++ )
+            found[i].next.stqe_next = &found[i + 1];
+
+        run( sta, [&]() {
+            for ( size_t i = 0; i < found.size(); i++ ) {
+                simNode *ap = aps[i];
+                if ( sta->ieCb == NULL || ap->beaconIe == NULL )
+                    continue;
+                uint8_t ie[256];
+                memcpy( ie, ap->beaconIe, ap->beaconIeLength );
+                sta->ieCb( USER_IE_PROBE_RESP, found[i].bssid, ap->ieOui, ie, ap->beaconIeLength, found[i].rssi );
+            }
+            cb( found.empty() ? NULL : &found[0], OK );
+        } );
+    } );
+}
+
+void meshSim::armTimer( os_timer_t *timer, uint32_t ms, bool repeat ) {
+    uint32_t generation = ++_timers[timer];
+    _timerNodes[timer] = _current;
+    timer->timer_period = repeat ? ms : 0;
+    at( _now + (uint64_t)ms * 1000, [this, timer, generation]() { fire( timer, generation ); } );
+}
+
+void meshSim::disarmTimer( os_timer_t *timer ) {
+    _timers[timer]++;
+}
+
+void meshSim::fire( os_timer_t *timer, uint32_t generation ) {
+    if ( _timers[timer] != generation )
+        return;  // disarmed or armed again meanwhile
+
+    if ( timer->timer_period != 0 )
+        at( _now + (uint64_t)timer->timer_period * 1000, [this, timer, generation]() { fire( timer, generation ); } );
+    run( _timerNodes[timer], [timer]() { timer->timer_func( timer->timer_arg ); } );
+}
+
+/**
+ * Opens a TCP connection from the station to the AP it is associated with. The station hears
+ * of it after one round trip, the AP accepts it half a round trip later.
+ */
+sint8 meshSim::connect( espconn *conn ) {
+    simNode *sta = _current;
+    if ( sta->staStatus != STATION_GOT_IP || sta->uplink < 0 )
+        return ESPCONN_RTE;
+
+    simNode *ap = _nodes[sta->uplink].get();
+    std::map<int, espconn *>::iterator listener = ap->listeners.find( conn->proto.tcp->remote_port );
+    if ( memcmp( conn->proto.tcp->remote_ip, &ap->apIp.ip, 4 ) != 0 || listener == ap->listeners.end() ) {
+        at( _now + 2 * link.latency, sta, [conn]() {
+            if ( conn->proto.tcp->reconnect_callback != NULL )
+                conn->proto.tcp->reconnect_callback( conn, ESPCONN_RST );
+        } );
+        return ESPCONN_OK;
+    }
+
+    _sockets.push_back( std::unique_ptr<simSocket>( new simSocket ) );
+    simSocket *socket = _sockets.back().get();
+    memset( &socket->accepted, 0, sizeof( socket->accepted ) );
+    memset( &socket->acceptedTcp, 0, sizeof( socket->acceptedTcp ) );
+    socket->accepted.type = ESPCONN_TCP;
+    socket->accepted.state = ESPCONN_CONNECT;
+    socket->accepted.proto.tcp = &socket->acceptedTcp;
+    socket->acceptedTcp.local_port = conn->proto.tcp->remote_port;
+    socket->acceptedTcp.remote_port = conn->proto.tcp->local_port;
+    memcpy( socket->acceptedTcp.local_ip, &ap->apIp.ip, 4 );
+    memcpy( socket->acceptedTcp.remote_ip, &sta->staIp.ip, 4 );
+
+    socket->end[0] = conn;
+    socket->end[1] = &socket->accepted;
+    socket->node[0] = sta->index;
+    socket->node[1] = ap->index;
+    _ends[conn] = std::make_pair( socket, 0 );
+    _ends[&socket->accepted] = std::make_pair( socket, 1 );
+    conn->state = ESPCONN_WAIT;
+
+    uint64_t synAck = _now + 2 * link.latency;
+    uint64_t accept = synAck + link.latency;
+    socket->arrival[0] = accept;  // what the station sends comes after the accept
+    socket->arrival[1] = synAck;
+
+    at( synAck, sta, [this, socket, conn]() {
+        if ( !socket->open || _ends[conn].first != socket )
+            return;
+        conn->state = ESPCONN_CONNECT;
+        if ( conn->proto.tcp->connect_callback != NULL )
+            conn->proto.tcp->connect_callback( conn );
+    } );
+    int port = conn->proto.tcp->remote_port;
+    at( accept, ap, [socket, ap, port]() {
+        std::map<int, espconn *>::iterator listener = ap->listeners.find( port );
+        if ( !socket->open || listener == ap->listeners.end() )
+            return;
+        if ( listener->second->proto.tcp->connect_callback != NULL )
+            listener->second->proto.tcp->connect_callback( &socket->accepted );
+    } );
+    return ESPCONN_OK;
+}
+
+/**
+ * When the radio of from is done putting out a segment of length bytes.
+ */
+uint64_t meshSim::transmit( simNode *from, uint16_t length ) {
+    uint64_t start = _radioFree[from->index] > _now ? _radioFree[from->index] : _now;
+    uint64_t airtime = (uint64_t)( length + link.headerBytes ) * 8 * 1000000 / link.bitRate;
+    _radioFree[from->index] = start + airtime;
+    return start + airtime;
+}
+
+/**
+ * Sends length bytes in mss sized segments. Each one arrives in order in its own receive
+ * callback; the sent callback follows once the ACK of the last one is back.
+ */
+sint8 meshSim::send( espconn *conn, uint8 *data, uint16 length ) {
+    std::map<espconn *, std::pair<simSocket *, uint8_t> >::iterator end = _ends.find( conn );
+    if ( end == _ends.end() || !end->second.first->open )
+        return ESPCONN_CONN;
+
+    simSocket *socket = end->second.first;
+    uint8_t dir = end->second.second;
+    if ( socket->sending[dir] )
+        return ESPCONN_INPROGRESS;
+
+    simNode *from = _nodes[socket->node[dir]].get();
+    simNode *to = _nodes[socket->node[1 - dir]].get();
+    sends++;
+    bytes += length;
+
+    uint64_t last = _now;
+    for ( uint16_t offset = 0; offset < length; offset += link.mss ) {
+        uint16_t size = length - offset < link.mss ? length - offset : link.mss;
+        segments++;
+
+        uint64_t arrival = transmit( from, size ) + link.latency + (uint64_t)( random() * link.jitter );
+        uint8_t losses = 0;
+        while ( random() < link.loss ) {
+            if ( ++losses > link.maxRetries ) {
+                aborts++;
+                at( arrival, [this, socket]() {
+                    if ( socket->open )
+                        close( socket );
+                } );
+                socket->sending[dir] = true;  // until the abort, nothing more goes out
+                return ESPCONN_OK;
+            }
+            retransmits++;
+            arrival += (uint64_t)link.retransmit << ( losses - 1 );
+        }
+
+        if ( arrival <= socket->arrival[dir] )
+            arrival = socket->arrival[dir] + 1;
+        socket->arrival[dir] = arrival;
+        last = arrival;
+
+        std::vector<char> segment( data + offset, data + offset + size );
+        at( arrival, to, [socket, dir, segment]() mutable {
+            espconn *receiver = socket->end[1 - dir];
+            if ( socket->open && receiver->recv_callback != NULL )
+                receiver->recv_callback( receiver, segment.data(), segment.size() );
+        } );
+    }
+
+    uint64_t ack = last + link.latency + (uint64_t)( random() * link.jitter );
+    while ( random() < link.loss )
+        ack += link.retransmit;  // the segment is resent and acknowledged again
+
+    socket->sending[dir] = true;
+    at( ack, from, [socket, dir]() {
+        if ( !socket->open )
+            return;
+        socket->sending[dir] = false;
+        espconn *sender = socket->end[dir];
+        if ( sender->sent_callback != NULL )
+            sender->sent_callback( sender );
+    } );
+    return ESPCONN_OK;
+}
+
+sint8 meshSim::disconnect( espconn *conn ) {
+    std::map<espconn *, std::pair<simSocket *, uint8_t> >::iterator end = _ends.find( conn );
+    if ( end == _ends.end() || !end->second.first->open )
+        return ESPCONN_ARG;
+
+    close( end->second.first );
+    return ESPCONN_OK;
+}
+
+/**
+ * Closes a connection, both ends get their disconnect callback. The station's espconn is
+ * the mesh's and is reused for the next connection, a callback for an old one is dropped.
+ */
+void meshSim::close( simSocket *socket ) {
+    socket->open = false;
+    for ( uint8_t i = 0; i < 2; i++ ) {
+        espconn *conn = socket->end[i];
+        if ( _ends[conn].first != socket )
+            continue;
+        conn->state = ESPCONN_CLOSE;
+
+        at( _now + link.latency, _nodes[socket->node[i]].get(), [this, socket, conn]() {
+            if ( _ends[conn].first == socket && conn->proto.tcp->disconnect_callback != NULL )
+                conn->proto.tcp->disconnect_callback( conn );
+        } );
+    }
+}
+
+
+// The SDK calls, each acting on the node whose callback runs.
+
+static simNode *sdkNode( void ) {
+    simNode *node = meshSim::active != NULL ? meshSim::active->current() : NULL;
+    if ( node == NULL ) {
+        fprintf( stderr, "meshSim: SDK call outside a node, see meshSim::run()\n" );
+        abort();
+    }
+    return node;
+}
+
+void os_timer_setfn( os_timer_t *timer, os_timer_func_t *func, void *arg ) {
+    timer->timer_func = func;
+    timer->timer_arg = arg;
+}
+
+void os_timer_arm( os_timer_t *timer, uint32 ms, bool repeat ) {
+    sdkNode();
+    simSdkCall sdk;
+    meshSim::active->armTimer( timer, ms, repeat );
+}
+
+void os_timer_disarm( os_timer_t *timer ) {
+    simSdkCall sdk;
+    meshSim::active->disarmTimer( timer );
+}
+
+uint32 system_get_time( void ) {
+    simNode *node = sdkNode();
+    double now = (double)meshSim::active->now();
+    return node->clockStart + (uint32)(uint64_t)( now + now * node->skew / 1000000 );
+}
+
+uint32 system_get_chip_id( void ) {
+    return sdkNode()->chipId;
+}
+
+uint32 system_get_free_heap_size( void ) {
+    simNode *node = sdkNode();
+    return node->heapUsed < SIM_HEAP_SIZE ? SIM_HEAP_SIZE - node->heapUsed : 0;
+}
+
+bool system_rtc_mem_read( uint8 src_addr, void *des_addr, uint16 load_size ) {
+    simNode *node = sdkNode();
+    if ( src_addr * 4 + load_size > SIM_RTC_SIZE )
+        return false;
+    memcpy( des_addr, node->rtc + src_addr * 4, load_size );
+    return true;
+}
+
+bool system_rtc_mem_write( uint8 des_addr, const void *src_addr, uint16 save_size ) {
+    simNode *node = sdkNode();
+    if ( des_addr < 64 || des_addr * 4 + save_size > SIM_RTC_SIZE )
+        return false;  // the first 64 blocks are the system's
+    memcpy( node->rtc + des_addr * 4, src_addr, save_size );
+    return true;
+}
+
+void wifi_set_event_handler_cb( wifi_event_handler_cb_t cb ) {
+    sdkNode()->eventCb = cb;
+}
+
+bool wifi_set_opmode_current( uint8 opmode ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    node->opmode = opmode;
+    if ( !( opmode & SOFTAP_MODE ) )
+        meshSim::active->restartAp( node );
+    if ( !( opmode & STATION_MODE ) && node->uplink >= 0 )
+        meshSim::active->dropStation( node, true );
+    return true;
+}
+
+bool wifi_set_opmode( uint8 opmode ) {
+    return wifi_set_opmode_current( opmode );
+}
+
+bool wifi_set_sleep_type( enum sleep_type type ) {
+    sdkNode();
+    return true;
+}
+
+bool wifi_get_ip_info( uint8 if_index, struct ip_info *info ) {
+    simNode *node = sdkNode();
+    *info = if_index == SOFTAP_IF ? node->apIp : node->staIp;
+    return true;
+}
+
+bool wifi_set_ip_info( uint8 if_index, struct ip_info *info ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    if ( if_index != SOFTAP_IF || node->dhcps )
+        return false;  // the station gets its address by DHCP, and the SDK insists on DHCP being stopped
+
+    if ( memcmp( &node->apIp, info, sizeof( ip_info ) ) != 0 ) {
+        node->apIp = *info;
+        meshSim::active->restartAp( node );
+    }
+    return true;
+}
+
+uint8 wifi_get_channel( void ) {
+    sdkNode();
+    return 1;
+}
+
+bool wifi_set_user_ie( bool enable, uint8 *m_oui, user_ie_type type, uint8 *user_ie, uint8 len ) {
+    simNode *node = sdkNode();
+    if ( type != USER_IE_BEACON )
+        return true;  // the probe response carries the same one, see meshSim::scan()
+    memcpy( node->ieOui, m_oui, 3 );
+    node->beaconIe = enable ? user_ie : NULL;
+    node->beaconIeLength = len;
+    return true;
+}
+
+int wifi_register_user_ie_manufacturer_recv_cb( user_ie_manufacturer_recv_cb_t cb ) {
+    sdkNode()->ieCb = cb;
+    return 0;
+}
+
+bool wifi_softap_get_config( struct softap_config *config ) {
+    *config = sdkNode()->apConfig;
+    return true;
+}
+
+bool wifi_softap_set_config_current( struct softap_config *config ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    bool changed = !node->apConfigured || memcmp( &node->apConfig, config, sizeof( softap_config ) ) != 0;
+    node->apConfig = *config;
+    node->apConfigured = true;
+    if ( changed )
+        meshSim::active->restartAp( node );
+    return true;
+}
+
+bool wifi_softap_set_config( struct softap_config *config ) {
+    return wifi_softap_set_config_current( config );
+}
+
+uint8 wifi_softap_get_station_num( void ) {
+    return meshSim::active->stationsOn( sdkNode() );
+}
+
+bool wifi_softap_dhcps_start( void ) {
+    sdkNode()->dhcps = true;
+    return true;
+}
+
+bool wifi_softap_dhcps_stop( void ) {
+    sdkNode()->dhcps = false;
+    return true;
+}
+
+bool wifi_station_connect( void ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    meshSim::active->dropStation( node, false );
+    node->staStatus = STATION_CONNECTING;
+    uint32_t attempt = ++node->staAttempt;
+    meshSim *sim = meshSim::active;
+    uint64_t when = sim->now() + SIM_ASSOC_TIME + (uint64_t)( sim->random() * SIM_ASSOC_TIME );
+    sim->at( when, [sim, node, attempt]() { sim->associate( node, attempt ); } );
+    return true;
+}
+
+bool wifi_station_disconnect( void ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    node->staAttempt++;
+    meshSim::active->dropStation( node, true );
+    return true;
+}
+
+bool wifi_station_get_config( struct station_config *config ) {
+    *config = sdkNode()->staConfig;
+    return true;
+}
+
+uint8 wifi_station_get_connect_status( void ) {
+    return sdkNode()->staStatus;
+}
+
+bool wifi_station_scan( struct scan_config *config, scan_done_cb_t cb ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    if ( node->scanning || !( node->opmode & STATION_MODE ) )
+        return false;
+    meshSim::active->scan( node, config != NULL ? config->channel : 0, cb );
+    return true;
+}
+
+bool wifi_station_set_auto_connect( uint8 set ) {
+    sdkNode();
+    return true;
+}
+
+bool wifi_station_set_config( struct station_config *config ) {
+    sdkNode()->staConfig = *config;
+    return true;
+}
+
+sint8 espconn_accept( struct espconn *espconn ) {
+    simNode *node = sdkNode();
+    simSdkCall sdk;
+    node->listeners[espconn->proto.tcp->local_port] = espconn;
+    espconn->state = ESPCONN_LISTEN;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_connect( struct espconn *espconn ) {
+    sdkNode();
+    simSdkCall sdk;
+    return meshSim::active->connect( espconn );
+}
+
+sint8 espconn_disconnect( struct espconn *espconn ) {
+    sdkNode();
+    simSdkCall sdk;
+    return meshSim::active->disconnect( espconn );
+}
+
+uint32 espconn_port( void ) {
+    return sdkNode()->nextPort++;
+}
+
+sint8 espconn_send( struct espconn *espconn, uint8 *psent, uint16 length ) {
+    sdkNode();
+    simSdkCall sdk;
+    return meshSim::active->send( espconn, psent, length );
+}
+
+sint8 espconn_set_opt( struct espconn *espconn, uint8 opt ) {
+    return ESPCONN_OK;
+}
+
+uint8 espconn_tcp_get_max_con( void ) {
+    return 5;
+}
+
+sint8 espconn_regist_connectcb( struct espconn *espconn, espconn_connect_callback connect_cb ) {
+    espconn->proto.tcp->connect_callback = connect_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb( struct espconn *espconn, espconn_connect_callback discon_cb ) {
+    espconn->proto.tcp->disconnect_callback = discon_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb( struct espconn *espconn, espconn_reconnect_callback recon_cb ) {
+    espconn->proto.tcp->reconnect_callback = recon_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb( struct espconn *espconn, espconn_recv_callback recv_cb ) {
+    espconn->recv_callback = recv_cb;
+    return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb( struct espconn *espconn, espconn_sent_callback sent_cb ) {
+    espconn->sent_callback = sent_cb;
+    return ESPCONN_OK;
+}
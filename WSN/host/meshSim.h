@@ -0,0 +1,218 @@
+#ifndef   _MESH_SIM_H_
+#define   _MESH_SIM_H_
+
+// the standard headers go first, Arduino.h defines min() and max() as macros
+#include <functional>
+#include <map>
+#include <memory>
+#include <queue>
+#include <random>
+#include <vector>
+
+#include "easyMesh.h"
+
+#define SIM_MAX_NODES       MESH_MAX_INSTANCES
+#define SIM_HEAP_SIZE       40000   // bytes free on a node before the mesh allocates anything
+#define SIM_RTC_SIZE        768     // bytes of RTC memory, in 4 byte blocks
+#define SIM_SCAN_CHANNEL    120000  // us a scan spends on one channel, a full scan covers 13
+#define SIM_ASSOC_TIME      150000  // us from wifi_station_connect() to the association
+#define SIM_DHCP_TIME       50000   // us from the association to the lease
+#define SIM_FIRST_PORT      49152   // first local port espconn_port() hands out
+
+/**
+ * The radio and TCP between two nodes. Every segment takes its airtime on the sender's
+ * radio, then the latency; a lost one is resent after the retransmit timeout, which doubles
+ * per loss in a row. After maxRetries losses the connection is aborted.
+ */
+struct simLinkConfig {
+    uint32_t latency = 2000;        // us one way, on top of the airtime
+    uint32_t jitter = 1000;         // us at most added to the latency
+    double loss = 0.01;             // chance a segment or an ACK is lost
+    uint32_t bitRate = 2000000;     // bits/s a radio puts out
+    uint32_t retransmit = 250000;   // us until a lost segment is sent again
+    uint8_t maxRetries = 6;
+    uint16_t mss = 536;             // bytes per segment, as the core's lwIP uses
+    uint8_t headerBytes = 40;       // TCP/IP overhead per segment
+    double scanMiss = 0.05;         // chance a scan does not hear an AP in range
+};
+
+/**
+ * Gives the simulator the one thing of the mesh it has to drive from outside: which mesh
+ * the station callbacks (wifi events, scan results, beacon IEs) go to. On the device that
+ * is the one mesh running the station; here every node has its own.
+ */
+class simMesh : public easyMesh {
+public:
+    static void driveStation(easyMesh *mesh) { _stationOwner = mesh; };
+};
+
+/**
+ * One ESP8266: its mesh and the SDK state behind it.
+ */
+struct simNode {
+    uint8_t index;
+    uint32_t chipId;
+    double x, y;                    // position in m, see meshSim::range
+    simMesh mesh;
+
+    // clock: system_get_time() runs from a random start, skew ppm fast or slow
+    uint32_t clockStart = 0;
+    double skew = 0;
+
+    int32_t heapUsed = 0;           // bytes the mesh allocated, see operator new in meshSim.cpp
+    int32_t heapPeak = 0;
+    uint8_t rtc[SIM_RTC_SIZE];
+
+    // wifi
+    uint8_t opmode = STATIONAP_MODE;
+    wifi_event_handler_cb_t eventCb = NULL;
+    user_ie_manufacturer_recv_cb_t ieCb = NULL;
+    uint8_t ieOui[3];
+    uint8_t *beaconIe = NULL;       // the SDK keeps pointing at the caller's IE
+    uint8_t beaconIeLength = 0;
+
+    // softAP
+    softap_config apConfig;
+    bool apConfigured = false;
+    ip_info apIp;
+    bool dhcps = false;
+    uint8_t nextLease = 2;
+
+    // station
+    station_config staConfig;
+    uint8_t staStatus = STATION_IDLE;
+    int16_t uplink = -1;            // index of the node whose AP we are associated with
+    ip_info staIp;
+    uint32_t staAttempt = 0;        // counts connects and disconnects, stale association steps check it
+    bool scanning = false;
+
+    uint16_t nextPort = SIM_FIRST_PORT;
+    std::map<int, espconn *> listeners;  // by port, see espconn_accept()
+
+    void bssid(uint8_t *out);
+};
+
+/**
+ * A TCP connection between a station and the AP it is associated with.
+ * End 0 is the station's espconn, end 1 the one the AP accepted, which the simulator owns.
+ */
+struct simSocket {
+    espconn *end[2];
+    uint8_t node[2];
+    bool open = true;
+    bool sending[2] = { false, false };     // a send waits for its ACK
+    uint64_t arrival[2] = { 0, 0 };         // last segment each way, keeps the stream in order
+
+    espconn accepted;
+    esp_tcp acceptedTcp;
+};
+
+struct simEvent {
+    uint64_t time;
+    uint64_t seq;
+    std::function<void()> fn;
+
+    bool operator>(const simEvent &other) const { return time != other.time ? time > other.time : seq > other.seq; };
+};
+
+/**
+ * Runs up to SIM_MAX_NODES easyMesh nodes in one process, on a virtual clock and over links
+ * as configured in link. Nodes hear each other within range metres, with an RSSI falling off
+ * over that distance. The SDK calls of meshSimSdk.h act on the node at hand, the one whose
+ * callback runs (see run()); every callback into a node is an event, so all of them happen in
+ * the order of their virtual time, and no time passes while one runs.
+ * Simplifications: one channel, no contention beyond each radio sending one segment at a
+ * time, a failed association leaves the station idle instead of retrying, and an aborted
+ * connection is reported to both ends through the disconnect callback.
+ */
+class meshSim {
+public:
+    meshSim(uint32_t seed);
+
+    ~meshSim(void);
+
+    simNode *addNode(double x, double y);
+
+    simNode *node(uint8_t index) { return _nodes[index].get(); };
+
+    uint8_t nodeCount(void) { return _nodes.size(); };
+
+    uint64_t now(void) { return _now; };
+
+    simNode *current(void) { return _current; };
+
+    void at(uint64_t time, std::function<void()> fn);
+
+    void at(uint64_t time, simNode *node, std::function<void()> fn);
+
+    void run(simNode *node, const std::function<void()> &fn);
+
+    void runUntil(uint64_t time);
+
+    uint8_t hops(simNode *from, simNode *to);
+
+    double random(void) { return _uniform(_rng); };
+
+    simLinkConfig link;
+    double range = 15;
+
+    // traffic totals
+    uint32_t sends = 0;
+    uint32_t segments = 0;
+    uint32_t retransmits = 0;
+    uint32_t aborts = 0;
+    uint64_t bytes = 0;
+
+    static meshSim *active;     // the SDK calls reach the simulator here
+
+    // the SDK calls, see meshSimSdk.h
+    void post(simNode *node, System_Event_t &event);
+
+    bool inRange(simNode *a, simNode *b);
+
+    sint8 rssi(simNode *a, simNode *b);
+
+    uint8_t stationsOn(simNode *ap);
+
+    void associate(simNode *sta, uint32_t attempt);
+
+    void dropStation(simNode *sta, bool notify);
+
+    void restartAp(simNode *ap);
+
+    void scan(simNode *sta, uint8_t channel, scan_done_cb_t cb);
+
+    void armTimer(os_timer_t *timer, uint32_t ms, bool repeat);
+
+    void disarmTimer(os_timer_t *timer);
+
+    sint8 connect(espconn *conn);
+
+    sint8 send(espconn *conn, uint8 *data, uint16 length);
+
+    sint8 disconnect(espconn *conn);
+
+    void close(simSocket *socket);
+
+protected:
+    void fire(os_timer_t *timer, uint32_t generation);
+
+    uint64_t transmit(simNode *from, uint16_t length);
+
+    uint64_t _now = 0;
+    uint64_t _seq = 0;
+    simNode *_current = NULL;
+    std::priority_queue<simEvent, std::vector<simEvent>, std::greater<simEvent> > _events;
+
+    std::vector<std::unique_ptr<simNode> > _nodes;
+    std::vector<std::unique_ptr<simSocket> > _sockets;  // kept to the end, late events still check them
+    std::map<espconn *, std::pair<simSocket *, uint8_t> > _ends;
+    std::map<os_timer_t *, uint32_t> _timers;   // generation of the armed timer, a stale firing checks it
+    std::map<os_timer_t *, simNode *> _timerNodes;
+    std::vector<uint64_t> _radioFree;           // per node, when its radio is done with the last segment
+
+    std::mt19937 _rng;
+    std::uniform_real_distribution<double> _uniform;
+};
+
+#endif //   _MESH_SIM_H_
@@ -0,0 +1,299 @@
+#ifndef   _MESH_SIM_SDK_H_
+#define   _MESH_SIM_SDK_H_
+
+/**
+ * The part of the ESP8266 NONOS SDK the mesh uses (see easyMeshPlatform.h), declared for the
+ * host build. The types follow the SDK's user_interface.h and espconn.h so the library
+ * compiles unchanged; meshSim.cpp implements the calls for many nodes in one process.
+ */
+#include <string.h>
+
+#include "c_types.h"
+
+typedef enum {
+    OK = 0,
+    FAIL,
+    PENDING,
+    BUSY,
+    CANCEL
+} STATUS;
+
+#define os_memcpy   memcpy
+#define os_memset   memset
+
+// timers
+typedef void os_timer_func_t(void *timer_arg);
+
+typedef struct _os_timer_t {
+    struct _os_timer_t *timer_next;
+    uint32 timer_expire;
+    uint32 timer_period;
+    os_timer_func_t *timer_func;
+    void *timer_arg;
+} os_timer_t;
+
+void os_timer_setfn(os_timer_t *timer, os_timer_func_t *func, void *arg);
+void os_timer_arm(os_timer_t *timer, uint32 ms, bool repeat);
+void os_timer_disarm(os_timer_t *timer);
+
+// system
+uint32 system_get_time(void);
+uint32 system_get_chip_id(void);
+uint32 system_get_free_heap_size(void);
+bool system_rtc_mem_read(uint8 src_addr, void *des_addr, uint16 load_size);
+bool system_rtc_mem_write(uint8 des_addr, const void *src_addr, uint16 save_size);
+
+// wifi
+#define STATION_IF      0x00
+#define SOFTAP_IF       0x01
+
+#define NULL_MODE       0x00
+#define STATION_MODE    0x01
+#define SOFTAP_MODE     0x02
+#define STATIONAP_MODE  0x03
+
+typedef enum _auth_mode {
+    AUTH_OPEN = 0,
+    AUTH_WEP,
+    AUTH_WPA_PSK,
+    AUTH_WPA2_PSK,
+    AUTH_WPA_WPA2_PSK,
+    AUTH_MAX
+} AUTH_MODE;
+
+enum sleep_type {
+    NONE_SLEEP_T = 0,
+    LIGHT_SLEEP_T,
+    MODEM_SLEEP_T
+};
+
+enum {
+    STATION_IDLE = 0,
+    STATION_CONNECTING,
+    STATION_WRONG_PASSWORD,
+    STATION_NO_AP_FOUND,
+    STATION_CONNECT_FAIL,
+    STATION_GOT_IP
+};
+
+struct ip_addr {
+    uint32 addr;
+};
+
+typedef struct ip_addr ip_addr_t;
+
+struct ip_info {
+    struct ip_addr ip;
+    struct ip_addr netmask;
+    struct ip_addr gw;
+};
+
+#define IP4_ADDR(ipaddr, a, b, c, d) \
+    (ipaddr)->addr = ((uint32)((d) & 0xff) << 24) | ((uint32)((c) & 0xff) << 16) | \
+                     ((uint32)((b) & 0xff) << 8) | (uint32)((a) & 0xff)
+
+#define IP2STR(ipaddr) ((uint8 *)(ipaddr))[0], ((uint8 *)(ipaddr))[1], ((uint8 *)(ipaddr))[2], ((uint8 *)(ipaddr))[3]
+
+#define STAILQ_ENTRY(type)  struct { struct type *stqe_next; }
+#define STAILQ_NEXT(elm, field) ((elm)->field.stqe_next)
+
+struct bss_info {
+    STAILQ_ENTRY(bss_info) next;
+    uint8 bssid[6];
+    uint8 ssid[32];
+    uint8 ssid_len;
+    uint8 channel;
+    sint8 rssi;
+    AUTH_MODE authmode;
+    uint8 is_hidden;
+    sint16 freq_offset;
+    sint16 freqcal_val;
+    uint8 *esp_mesh_ie;
+};
+
+typedef void (*scan_done_cb_t)(void *arg, STATUS status);
+
+struct scan_config {
+    uint8 *ssid;
+    uint8 *bssid;
+    uint8 channel;
+    uint8 show_hidden;
+};
+
+struct station_config {
+    uint8 ssid[32];
+    uint8 password[64];
+    uint8 bssid_set;
+    uint8 bssid[6];
+};
+
+struct softap_config {
+    uint8 ssid[32];
+    uint8 password[64];
+    uint8 ssid_len;
+    uint8 channel;
+    AUTH_MODE authmode;
+    uint8 ssid_hidden;
+    uint8 max_connection;
+    uint16 beacon_interval;
+};
+
+enum {
+    EVENT_STAMODE_CONNECTED = 0,
+    EVENT_STAMODE_DISCONNECTED,
+    EVENT_STAMODE_AUTHMODE_CHANGE,
+    EVENT_STAMODE_GOT_IP,
+    EVENT_STAMODE_DHCP_TIMEOUT,
+    EVENT_SOFTAPMODE_STACONNECTED,
+    EVENT_SOFTAPMODE_STADISCONNECTED,
+    EVENT_SOFTAPMODE_PROBEREQRECVED,
+    EVENT_MAX
+};
+
+enum {
+    REASON_ASSOC_LEAVE = 8,
+    REASON_NO_AP_FOUND = 201
+};
+
+typedef struct {
+    uint8 ssid[32];
+    uint8 ssid_len;
+    uint8 bssid[6];
+    uint8 channel;
+} Event_StaMode_Connected_t;
+
+typedef struct {
+    uint8 ssid[32];
+    uint8 ssid_len;
+    uint8 bssid[6];
+    uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef union {
+    Event_StaMode_Connected_t connected;
+    Event_StaMode_Disconnected_t disconnected;
+} Event_Info_u;
+
+typedef struct _esp_event {
+    uint32 event;
+    Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *event);
+
+typedef enum {
+    USER_IE_BEACON = 0,
+    USER_IE_PROBE_REQ,
+    USER_IE_PROBE_RESP,
+    USER_IE_ASSOC_REQ,
+    USER_IE_ASSOC_RESP,
+    USER_IE_MAX
+} user_ie_type;
+
+typedef void (*user_ie_manufacturer_recv_cb_t)(user_ie_type type, const uint8 sa[6], const uint8 m_oui[3], uint8 *ie, uint8 ie_len, sint32 rssi);
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb);
+bool wifi_set_opmode(uint8 opmode);
+bool wifi_set_opmode_current(uint8 opmode);
+bool wifi_set_sleep_type(enum sleep_type type);
+bool wifi_get_ip_info(uint8 if_index, struct ip_info *info);
+bool wifi_set_ip_info(uint8 if_index, struct ip_info *info);
+uint8 wifi_get_channel(void);
+bool wifi_set_user_ie(bool enable, uint8 *m_oui, user_ie_type type, uint8 *user_ie, uint8 len);
+int wifi_register_user_ie_manufacturer_recv_cb(user_ie_manufacturer_recv_cb_t cb);
+
+bool wifi_softap_get_config(struct softap_config *config);
+bool wifi_softap_set_config(struct softap_config *config);
+bool wifi_softap_set_config_current(struct softap_config *config);
+uint8 wifi_softap_get_station_num(void);
+bool wifi_softap_dhcps_start(void);
+bool wifi_softap_dhcps_stop(void);
+
+bool wifi_station_connect(void);
+bool wifi_station_disconnect(void);
+bool wifi_station_get_config(struct station_config *config);
+uint8 wifi_station_get_connect_status(void);
+bool wifi_station_scan(struct scan_config *config, scan_done_cb_t cb);
+bool wifi_station_set_auto_connect(uint8 set);
+bool wifi_station_set_config(struct station_config *config);
+
+// espconn
+#define ESPCONN_OK          0
+#define ESPCONN_MEM         -1
+#define ESPCONN_TIMEOUT     -3
+#define ESPCONN_RTE         -4
+#define ESPCONN_INPROGRESS  -5
+#define ESPCONN_MAXNUM      -7
+#define ESPCONN_ABRT        -8
+#define ESPCONN_RST         -9
+#define ESPCONN_CLSD        -10
+#define ESPCONN_CONN        -11
+#define ESPCONN_ARG         -12
+
+typedef void (*espconn_connect_callback)(void *arg);
+typedef void (*espconn_reconnect_callback)(void *arg, sint8 err);
+typedef void (*espconn_recv_callback)(void *arg, char *pdata, unsigned short len);
+typedef void (*espconn_sent_callback)(void *arg);
+
+enum espconn_type {
+    ESPCONN_INVALID = 0,
+    ESPCONN_TCP = 0x10,
+    ESPCONN_UDP = 0x20
+};
+
+enum espconn_state {
+    ESPCONN_NONE,
+    ESPCONN_WAIT,
+    ESPCONN_LISTEN,
+    ESPCONN_CONNECT,
+    ESPCONN_WRITE,
+    ESPCONN_READ,
+    ESPCONN_CLOSE
+};
+
+typedef struct _esp_tcp {
+    int remote_port;
+    int local_port;
+    uint8 local_ip[4];
+    uint8 remote_ip[4];
+    espconn_connect_callback connect_callback;
+    espconn_reconnect_callback reconnect_callback;
+    espconn_connect_callback disconnect_callback;
+    espconn_connect_callback write_finish_fn;
+} esp_tcp;
+
+struct espconn {
+    enum espconn_type type;
+    enum espconn_state state;
+    union {
+        esp_tcp *tcp;
+    } proto;
+    espconn_recv_callback recv_callback;
+    espconn_sent_callback sent_callback;
+    uint8 link_cnt;
+    void *reverse;
+};
+
+enum espconn_option {
+    ESPCONN_START = 0x00,
+    ESPCONN_REUSEADDR = 0x01,
+    ESPCONN_NODELAY = 0x02,
+    ESPCONN_COPY = 0x04,
+    ESPCONN_KEEPALIVE = 0x08,
+    ESPCONN_END
+};
+
+sint8 espconn_accept(struct espconn *espconn);
+sint8 espconn_connect(struct espconn *espconn);
+sint8 espconn_disconnect(struct espconn *espconn);
+uint32 espconn_port(void);
+sint8 espconn_send(struct espconn *espconn, uint8 *psent, uint16 length);
+sint8 espconn_set_opt(struct espconn *espconn, uint8 opt);
+uint8 espconn_tcp_get_max_con(void);
+sint8 espconn_regist_connectcb(struct espconn *espconn, espconn_connect_callback connect_cb);
+sint8 espconn_regist_disconcb(struct espconn *espconn, espconn_connect_callback discon_cb);
+sint8 espconn_regist_reconcb(struct espconn *espconn, espconn_reconnect_callback recon_cb);
+sint8 espconn_regist_recvcb(struct espconn *espconn, espconn_recv_callback recv_cb);
+sint8 espconn_regist_sentcb(struct espconn *espconn, espconn_sent_callback sent_cb);
+
+#endif //   _MESH_SIM_SDK_H_
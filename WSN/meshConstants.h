@@ -15,9 +15,21 @@
 #define TIMER0_INTERRUPT_PIN 16   //GPIO 16. Interrupt attached. Also the Built in led pin.
 #define CPU_SEC   80000000L       //80MHz -> 1 sec
 
-#define   MESH_UPDATE_INTERVAL    100L          // microseconds between each broadcast
 #define   SENSOR_UPDATE_INTERVAL  1000L         // microseconds between each sensor update
-#define   BROADCAST_INTERVAL      5             // seconds between each broadcast
+#define   BROADCAST_INTERVAL      5             // seconds a reading waits at most before its batch is broadcast
+
+#define   HEARTBEAT_INTERVAL      60            // seconds, with report by exception a quiet sensor still reports this often
+#define   SAMPLE_BATCH_SIZE       16            // readings per batch, a full batch is broadcast right away
+#define   SAMPLE_CHANNELS         2             // values per reading, the DHT11 has two
+#define   SAMPLE_BATCH_MAGIC      0xB5          // first byte of a batch payload, anything else is text
+#define   SAMPLE_VARINT_MAX       5             // bytes a 32bit varint takes at most
+#define   SAMPLE_BATCH_MAX_BYTES  ( 3 + SAMPLE_VARINT_MAX + SAMPLE_BATCH_SIZE * SAMPLE_VARINT_MAX * ( 1 + SAMPLE_CHANNELS ) )
+
+#define   SENSOR_TYPES            4             // SENSOR_NO values, 0 being the relay
+#define   AGGREGATE_WINDOW        2000          // ms a relay collects its subtree's readings before broadcasting the aggregate
+#define   AGGREGATE_MAGIC         0xA6          // first byte of an aggregate payload
+#define   AGGREGATE_MAX_NODES     16            // contributing chip IDs named per aggregate, further ones are only counted
+#define   AGGREGATE_MAX_BYTES     ( 3 + SAMPLE_VARINT_MAX * ( 1 + 3 * SAMPLE_CHANNELS ) + 4 * AGGREGATE_MAX_NODES )
 
 #define   MESH_PREFIX     "mesh"
 #define   MESH_PASSWORD   "12345678"
@@ -34,17 +46,43 @@ uint16_t MQ135_THRESHOLD = 200;
 uint16_t LDR_THRESHOLD = 500;
 uint16_t DHT11_TEMPERATURE_THRESHOLD = 25;
 
+/**
+ * Report by exception: a reading is only sent if it moved by at least its deadband since the
+ * last one sent, crossed its threshold, or nothing was sent for HEARTBEAT_INTERVAL.
+ * Set REPORT_BY_EXCEPTION to false to send every reading. DHT11 deadbands are in tenths.
+ */
+bool REPORT_BY_EXCEPTION = true;
+uint16_t MQ135_DEADBAND = 10;
+uint16_t LDR_DEADBAND = 20;
+uint16_t DHT11_TEMPERATURE_DEADBAND = 5;
+uint16_t DHT11_HUMIDITY_DEADBAND = 20;
 
 /**
- * The mesh handler. All actions such as Signal and Broadcast are invoked by this object.
+ * In-network aggregation: readings arriving from our subtree are merged per sensor type into
+ * one min, max, mean and count record and published every AGGREGATE_WINDOW instead of relayed,
+ * both when readings are broadcast and when they travel up to a sink.
  */
-easyMesh mesh;
+bool AGGREGATE_READINGS = true;
 
 /**
- * Schedules the mesh maintenance tasks required in order to keep the mesh network
- * alive and balanced.
+ * The gateway sets SINK_NODE. Once a sink is known readings are sent to it up the tree
+ * instead of broadcast, and the sink prints everything it collects on the serial port.
  */
-os_timer_t meshUpdateTimer;
+bool SINK_NODE = false;
+
+/**
+ * A battery powered leaf, a node nobody relays through, can set DUTY_CYCLE_PERIOD. It then wakes
+ * for DUTY_CYCLE_WINDOW at the same point of every period of mesh time, trades its queued readings
+ * with its parent and light-sleeps in between. Alarms wait for the window too. 0 keeps the radio on.
+ */
+uint32_t DUTY_CYCLE_PERIOD = 0;     // ms
+uint32_t DUTY_CYCLE_WINDOW = 500;   // ms
+
+
+/**
+ * The mesh handler. All actions such as Signal and Broadcast are invoked by this object.
+ */
+easyMesh mesh;
 
 /**
  * Schedules the tasks required to read the values of the connected sensor(s) and store